@@ -12,21 +12,68 @@ this software module.
 #include "afc.h"
 #include "eloop.h"
 #include "json.h"
+#include "afc_reg_rule.h"
+#include "afc_grant.h"
+#include "afc_driver.h"
+#include "list.h"
 
 struct afc_config config;
 struct afc_spectrum_inquiry_resp afc_response;
 
-enum afc_status afc_spectrum_resp_expiry(void)
+static time_t afc_resp_expire_timestamp(void)
 {
-	int remaining_time;
 	struct tm expire_tm;
-	time_t expire_timestamp, current_time;
 
 	memset(&expire_tm, 0, sizeof(expire_tm));
 	if (!strptime(afc_response.expire_time, "%Y-%m-%dT%H:%M:%SZ", &expire_tm))
-		return AFC_STATUS_FAILURE;
+		return -1;
+
+	/* availabilityExpireTime is UTC */
+	return timegm(&expire_tm);
+}
+
+static void afc_publish_grant(void)
+{
+	time_t expire_timestamp = afc_resp_expire_timestamp();
+
+	afc_grant_publish(&afc_response, afc_reg_rule_get_regd(),
+			  expire_timestamp < 0 ? 0 : (int64_t)expire_timestamp);
+}
+
+static void afc_query_notify(enum afc_query_event event, enum afc_status status,
+			     unsigned int next_sec);
+
+static void afc_expiry_warning(void *eloop_ctx, void *user_ctx)
+{
+	const struct afc_grant_table *grant = afc_grant_get();
+	int64_t remaining;
+
+	UNUSED_PARAM(eloop_ctx);
+	UNUSED_PARAM(user_ctx);
 
-	expire_timestamp = mktime(&expire_tm);
+	if (!grant || !grant->expire_time)
+		return;
+
+	remaining = grant->expire_time - (int64_t)time(NULL);
+	afc_query_notify(AFC_QUERY_EXPIRING, AFC_STATUS_SUCCESS,
+			 remaining > 0 ? (unsigned int)remaining : 0);
+}
+
+static void afc_expiry_deadline(void *eloop_ctx, void *user_ctx)
+{
+	UNUSED_PARAM(eloop_ctx);
+	UNUSED_PARAM(user_ctx);
+
+	afc_printf(MSG_INFO, "AFC grant expired, querying the server");
+	afc_query_server();
+}
+
+enum afc_status afc_spectrum_resp_expiry(void)
+{
+	int remaining_time;
+	time_t expire_timestamp, current_time;
+
+	expire_timestamp = afc_resp_expire_timestamp();
 	if (expire_timestamp < 0)
 		return AFC_STATUS_FAILURE;
 
@@ -40,7 +87,18 @@ enum afc_status afc_spectrum_resp_expiry(void)
 		afc_printf(MSG_INFO, "remaining time = %d hrs", remaining_time/ONE_HOUR_IN_SECONDS);
 			if (eloop_is_timeout_registered(afc_query_server, NULL, NULL))
 				eloop_cancel_timeout(afc_query_server, NULL, NULL);
-			eloop_register_timeout(remaining_time, 0, afc_query_server, NULL, NULL);
+			eloop_cancel_deadline(afc_expiry_deadline, NULL, NULL);
+			/* follow the wall clock so an NTP step neither expires the
+			grant early nor lets it run past availabilityExpireTime */
+			if (eloop_register_deadline(expire_timestamp, afc_expiry_deadline, NULL, NULL)) {
+				afc_printf(MSG_WARNING, "wall clock deadline unavailable, using a relative timeout");
+				eloop_register_timeout(remaining_time, 0, afc_query_server, NULL, NULL);
+			}
+			/* a deadline already past fires right away, after the grant
+			is published */
+			eloop_cancel_deadline(afc_expiry_warning, NULL, NULL);
+			eloop_register_deadline(expire_timestamp - AFC_EXPIRY_WARN_SEC,
+						afc_expiry_warning, NULL, NULL);
 	} else {
 		afc_printf(MSG_ERROR, "expiration time has already passed.");
 		return AFC_STATUS_FAILURE;
@@ -105,6 +163,8 @@ enum afc_status afc_construct_afc_reg_db(void)
 	if (afc_construct_regrule_from_afc_response(&afc_response))
 		return AFC_STATUS_FAILURE;
 
+	afc_publish_grant();
+
 	return AFC_STATUS_SUCCESS;
 }
 
@@ -112,7 +172,8 @@ enum afc_status afc_validate_spectrum_resp(void)
 {
 	if (strcmp(afc_response.resp_info.short_description, "SUCCESS") != 0) {
 		afc_printf(MSG_ERROR, "AFC response failed : %d", afc_response.resp_info.resp_status);
-		afc_construct_regrule_from_afc_response(&afc_response);
+		if (!afc_construct_regrule_from_afc_response(&afc_response))
+			afc_publish_grant();
 		return AFC_STATUS_FAILURE;
 	}
 
@@ -122,6 +183,155 @@ enum afc_status afc_validate_spectrum_resp(void)
 	return AFC_STATUS_SUCCESS;
 }
 
+/* Single flight: one inquiry is in flight at a time, parsed into the
+global afc_response, and every trigger arriving meanwhile joins it and
+gets its result. Triggers arriving while idle wait in afc_query_pending
+for the next inquiry, which starts no sooner than min_query_interval
+after the previous one. */
+struct afc_query {
+	struct dl_list list;
+	unsigned int id;
+	afc_query_cb cb;
+	void *ctx;
+	struct reltime queued;
+	struct reltime started;
+};
+
+static struct dl_list afc_query_pending = DL_LIST_HEAD_INIT(afc_query_pending);
+static struct dl_list afc_query_flight = DL_LIST_HEAD_INIT(afc_query_flight);
+static int afc_query_in_flight;
+static unsigned int afc_query_flight_id;
+static struct reltime afc_query_last_start;
+static unsigned int afc_query_next_id;
+static struct afc_query_stats afc_query_stats;
+static afc_query_cb afc_query_observer;
+static void *afc_query_observer_ctx;
+
+static void afc_query_schedule(void);
+
+static unsigned int afc_ms_between(struct reltime *from, struct reltime *to)
+{
+	struct reltime diff;
+
+	reltime_sub(to, from, &diff);
+	return (unsigned int)(diff.sec * 1000 + diff.usec / 1000);
+}
+
+static void afc_query_complete(struct afc_query *query, enum afc_status status)
+{
+	struct afc_query_result result;
+	struct reltime now;
+
+	get_reltime(&now);
+	if (!query->started.sec && !query->started.usec)
+		query->started = now;
+	memset(&result, 0, sizeof(result));
+	result.event = AFC_QUERY_DONE;
+	result.id = query->id;
+	result.inquiry = afc_query_flight_id;
+	result.status = status;
+	result.queue_ms = afc_ms_between(&query->queued, &query->started);
+	result.exchange_ms = afc_ms_between(&query->started, &now);
+
+	if (query->cb)
+		query->cb(&result, query->ctx);
+	free(query);
+}
+
+static void afc_query_notify(enum afc_query_event event, enum afc_status status,
+			     unsigned int next_sec)
+{
+	struct afc_query_result result;
+
+	if (!afc_query_observer)
+		return;
+
+	memset(&result, 0, sizeof(result));
+	result.event = event;
+	result.id = afc_query_flight_id;
+	result.inquiry = afc_query_flight_id;
+	result.status = status;
+	result.next_sec = next_sec;
+	if (event == AFC_QUERY_DONE)
+		result.exchange_ms = afc_query_stats.last_exchange_ms;
+	else if (event == AFC_QUERY_STARTED)
+		result.requests = dl_list_len(&afc_query_flight);
+	afc_query_observer(&result, afc_query_observer_ctx);
+}
+
+static void afc_query_finish(enum afc_status status)
+{
+	struct afc_query *query;
+	struct reltime now;
+
+	if (afc_response.freq_info)
+		free(afc_response.freq_info);
+	if (afc_response.chan_info)
+		free(afc_response.chan_info);
+	afc_response.freq_info = NULL;
+	afc_response.chan_info = NULL;
+
+	if (status) {
+		if (eloop_is_timeout_registered(afc_query_server, NULL, NULL))
+			eloop_cancel_timeout(afc_query_server, NULL, NULL);
+		eloop_register_timeout(TIMEOUT_INTERVAL_IN_SEC, 0, afc_query_server, NULL, NULL);
+		afc_printf(MSG_ERROR, "scheduled timeout of 24 hours");
+	}
+
+	get_reltime(&now);
+	afc_query_stats.last_exchange_ms = afc_ms_between(&afc_query_last_start, &now);
+	if (status)
+		afc_query_stats.failures++;
+	else
+		afc_query_stats.last_success = time(NULL);
+	afc_printf(MSG_INFO, "AFC inquiry %u %s in %u ms for %u requests", afc_query_flight_id,
+		   status ? "failed" : "completed", afc_query_stats.last_exchange_ms,
+		   dl_list_len(&afc_query_flight));
+
+	/* triggers from the callbacks wait for the next inquiry */
+	afc_query_in_flight = 0;
+	while (!dl_list_empty(&afc_query_flight)) {
+		query = dl_list_first(&afc_query_flight, struct afc_query, list);
+		dl_list_del(&query->list);
+		afc_query_complete(query, status);
+	}
+
+	afc_query_notify(AFC_QUERY_DONE, status, status ? TIMEOUT_INTERVAL_IN_SEC : 0);
+
+	afc_query_schedule();
+}
+
+static void afc_query_response(int status, char *body, size_t len, void *ctx)
+{
+	UNUSED_PARAM(ctx);
+
+	if (status || !afc_populate_afc_spectrum_inquiry_resp_cb(body, 1, len, NULL)) {
+		afc_printf(MSG_ERROR, "failed to send AFC request");
+		goto fail;
+	}
+
+	if (afc_validate_spectrum_resp()) {
+		afc_printf(MSG_ERROR, "validation of AFC response failed");
+		goto fail;
+	}
+
+	if (afc_construct_afc_reg_db()) {
+		afc_printf(MSG_ERROR, "failed to construct regdb");
+		goto fail;
+	}
+
+	if (afc_spectrum_resp_expiry()) {
+		afc_printf(MSG_ERROR, "failed to schedule timeout based on the afc response");
+		goto fail;
+	}
+
+	afc_query_finish(AFC_STATUS_SUCCESS);
+	return;
+
+fail:
+	afc_query_finish(AFC_STATUS_FAILURE);
+}
+
 enum afc_status afc_send_spectrum_request(void)
 {
 	char *json_data;
@@ -137,7 +347,8 @@ enum afc_status afc_send_spectrum_request(void)
 	afc_printf(MSG_INFO, "afc_server_url: %s\n JSON request message:\n  %s",
 			   config.afc_server_url, json_data);
 
-	if (afc_curl_message_to_server(json_data, &config)) {
+	/* the request body is copied, the response arrives in afc_query_response */
+	if (afc_curl_message_to_server(json_data, &config, afc_query_response, NULL)) {
 		cJSON_free(json_data);
 		goto fail;
 	}
@@ -151,52 +362,198 @@ fail:
 	return AFC_STATUS_FAILURE;
 }
 
-enum afc_status afc_query_server(void)
+static enum afc_status afc_query_begin(void)
 {
 	memset(&afc_response, 0, sizeof(afc_response));
 
 	if (afc_read_req_configs(&config)) {
 		afc_printf(MSG_ERROR, "failed to read AFC config");
-		goto fail;
+		return AFC_STATUS_FAILURE;
 	}
 
+	if (config.num_ifnames)
+		afc_driver_set_ifaces(config.ifnames, config.num_ifnames);
+
 	if (afc_send_spectrum_request()) {
 		afc_printf(MSG_ERROR, "failed to send AFC request");
-		goto fail;
+		return AFC_STATUS_FAILURE;
 	}
 
-	if (afc_validate_spectrum_resp()) {
-		afc_printf(MSG_ERROR, "validation of AFC response failed");
-		goto fail;
+	return AFC_STATUS_SUCCESS;
+}
+
+static void afc_query_kick(void *eloop_ctx, void *user_ctx)
+{
+	struct afc_query *query;
+	struct reltime now;
+
+	UNUSED_PARAM(eloop_ctx);
+	UNUSED_PARAM(user_ctx);
+
+	if (afc_query_in_flight || dl_list_empty(&afc_query_pending))
+		return;
+
+	get_reltime(&now);
+	afc_query_stats.inquiries++;
+	afc_query_in_flight = 1;
+	afc_query_last_start = now;
+	afc_query_flight_id = dl_list_first(&afc_query_pending, struct afc_query, list)->id;
+	while (!dl_list_empty(&afc_query_pending)) {
+		query = dl_list_first(&afc_query_pending, struct afc_query, list);
+		query->started = now;
+		dl_list_move_tail(&afc_query_flight, &query->list);
 	}
 
-	if (afc_construct_afc_reg_db()) {
-		afc_printf(MSG_ERROR, "failed to construct regdb");
-		goto fail;
+	afc_printf(MSG_INFO, "AFC inquiry %u started for %u requests", afc_query_flight_id,
+		   dl_list_len(&afc_query_flight));
+	afc_query_notify(AFC_QUERY_STARTED, AFC_STATUS_SUCCESS, 0);
+	if (afc_query_begin())
+		afc_query_finish(AFC_STATUS_FAILURE);
+}
+
+/* started from the loop, so the caller sees the ID before any completion,
+even one failing right away */
+static void afc_query_schedule(void)
+{
+	struct reltime now, next, wait;
+
+	if (afc_query_in_flight || dl_list_empty(&afc_query_pending) ||
+	    eloop_is_timeout_registered(afc_query_kick, NULL, NULL))
+		return;
+
+	wait.sec = 0;
+	wait.usec = 0;
+	if (config.min_query_interval && (afc_query_last_start.sec || afc_query_last_start.usec)) {
+		get_reltime(&now);
+		next = afc_query_last_start;
+		next.sec += config.min_query_interval;
+		if (reltime_before(&now, &next)) {
+			reltime_sub(&next, &now, &wait);
+			afc_query_stats.deferred++;
+			afc_printf(MSG_INFO, "AFC inquiry deferred %ld s by min_query_interval",
+				   (long)wait.sec + (wait.usec ? 1 : 0));
+		}
 	}
 
-	if (afc_spectrum_resp_expiry()) {
-		afc_printf(MSG_ERROR, "failed to schedule timeout based on the afc response");
-		goto fail;
+	eloop_register_timeout(wait.sec, wait.usec, afc_query_kick, NULL, NULL);
+}
+
+unsigned int afc_query_start(afc_query_cb cb, void *ctx)
+{
+	struct afc_query *query;
+
+	query = zalloc(sizeof(*query));
+	if (!query)
+		return 0;
+
+	/* 0 is reserved for failure */
+	if (++afc_query_next_id == 0)
+		afc_query_next_id = 1;
+	query->id = afc_query_next_id;
+	query->cb = cb;
+	query->ctx = ctx;
+	get_reltime(&query->queued);
+	afc_query_stats.requests++;
+
+	if (afc_query_in_flight) {
+		afc_query_stats.joined++;
+		afc_printf(MSG_DEBUG, "request %u joins AFC inquiry %u", query->id, afc_query_flight_id);
+		query->started = query->queued;
+		dl_list_add_tail(&afc_query_flight, &query->list);
+		return query->id;
 	}
 
-	if (afc_response.freq_info)
-		free(afc_response.freq_info);
-	if (afc_response.chan_info)
-		free(afc_response.chan_info);
+	dl_list_add_tail(&afc_query_pending, &query->list);
+	afc_query_schedule();
 
-	return AFC_STATUS_SUCCESS;
+	return query->id;
+}
 
-fail:
-	if (afc_response.freq_info)
-		free(afc_response.freq_info);
-	if (afc_response.chan_info)
-		free(afc_response.chan_info);
+void afc_query_set_observer(afc_query_cb cb, void *ctx)
+{
+	afc_query_observer = cb;
+	afc_query_observer_ctx = ctx;
+}
 
-	if (eloop_is_timeout_registered(afc_query_server, NULL, NULL))
-		eloop_cancel_timeout(afc_query_server, NULL, NULL);
-	eloop_register_timeout(TIMEOUT_INTERVAL_IN_SEC, 0, afc_query_server, NULL, NULL);
-	afc_printf(MSG_ERROR, "scheduled timeout of 24 hours");
+const struct afc_query_stats *afc_query_get_stats(void)
+{
+	afc_query_stats.in_flight = afc_query_in_flight;
+	return &afc_query_stats;
+}
 
-	return AFC_STATUS_FAILURE;
+enum afc_status afc_query_server(void)
+{
+	return afc_query_start(NULL, NULL) ? AFC_STATUS_SUCCESS : AFC_STATUS_FAILURE;
+}
+
+/* outstanding requests are abandoned and complete as failed */
+static void afc_refresh_timeout(void *eloop_ctx, void *user_ctx)
+{
+	UNUSED_PARAM(eloop_ctx);
+	UNUSED_PARAM(user_ctx);
+
+	afc_query_server();
+}
+
+void afc_query_deinit(void)
+{
+	struct afc_query *query;
+
+	eloop_cancel_timeout(afc_query_kick, NULL, NULL);
+	eloop_cancel_timeout(afc_refresh_timeout, NULL, NULL);
+	/* grant expiry is a wall clock deadline, or a relative afc_query_server
+	timeout without one; that timeout also carries the retry of a failed
+	inquiry */
+	eloop_cancel_deadline(afc_expiry_deadline, NULL, NULL);
+	eloop_cancel_timeout(afc_query_server, NULL, NULL);
+	eloop_cancel_deadline(afc_expiry_warning, NULL, NULL);
+	afc_curl_deinit();
+	afc_query_in_flight = 0;
+	while (!dl_list_empty(&afc_query_flight)) {
+		query = dl_list_first(&afc_query_flight, struct afc_query, list);
+		dl_list_del(&query->list);
+		afc_query_complete(query, AFC_STATUS_FAILURE);
+	}
+	while (!dl_list_empty(&afc_query_pending)) {
+		query = dl_list_first(&afc_query_pending, struct afc_query, list);
+		dl_list_del(&query->list);
+		afc_query_complete(query, AFC_STATUS_FAILURE);
+	}
+}
+
+void afc_schedule_refresh(const char *reason)
+{
+	if (eloop_is_timeout_registered(afc_refresh_timeout, NULL, NULL)) {
+		afc_printf(MSG_DEBUG, "AFC refresh already pending, coalescing %s", reason);
+		return;
+	}
+
+	afc_printf(MSG_INFO, "AFC refresh requested : %s", reason);
+	eloop_register_timeout(AFC_REFRESH_COALESCE_SEC, 0, afc_refresh_timeout, NULL, NULL);
+}
+
+/* the grant is flagged in the table rather than withdrawn, readers decide
+whether power an interface did not take is usable */
+void afc_grant_rejected(unsigned int ifaces)
+{
+	const struct afc_grant_table *grant = afc_grant_get();
+	struct afc_query_result result;
+
+	if (!grant || grant->rejected_ifaces == ifaces)
+		return;
+
+	if (ifaces)
+		afc_printf(MSG_ERROR, "grant %u rejected on %u interface(s)", grant->grant_seq, ifaces);
+	else
+		afc_printf(MSG_INFO, "grant %u applied on all interfaces", grant->grant_seq);
+	afc_grant_set_rejected((uint16_t)ifaces);
+
+	if (!afc_query_observer)
+		return;
+
+	memset(&result, 0, sizeof(result));
+	result.event = AFC_QUERY_REJECTED;
+	result.status = ifaces ? AFC_STATUS_FAILURE : AFC_STATUS_SUCCESS;
+	result.ifaces = ifaces;
+	afc_query_observer(&result, afc_query_observer_ctx);
 }
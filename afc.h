@@ -15,6 +15,9 @@ this software module.
 #define AFCD_RESP_DUMP_FILE  "/tmp/afc_resp_dump.db"
 #define AFCD_SOCKET_PATH "/tmp/afc_ctrl_socket"
 #define ONE_HOUR_IN_SECONDS 3600
+#define AFC_REFRESH_COALESCE_SEC 2 /* driver events arriving within this window share one inquiry */
+#define AFC_ELOOP_STALL_MS 100 /* callbacks blocking eloop this long are logged */
+#define AFC_EXPIRY_WARN_SEC 3600 /* the observer hears of the expiry this early */
 
 #define UNUSED_PARAM(param) ((void)(param))
 
@@ -54,4 +57,49 @@ struct afc_spectrum_inquiry_resp {
 	char country[3];
 };
 
-enum afc_status afc_query_server(void);
\ No newline at end of file
+/* what the observer is told about, requesters only get AFC_QUERY_DONE */
+enum afc_query_event {
+	AFC_QUERY_DONE,
+	AFC_QUERY_STARTED,
+	AFC_QUERY_EXPIRING, /* the grant expires in next_sec */
+	AFC_QUERY_REJECTED, /* the number of interfaces refusing the grant changed */
+};
+
+/* completion of an inquiry started with afc_query_start() */
+struct afc_query_result {
+	enum afc_query_event event;
+	unsigned int id;
+	unsigned int inquiry; /* ID of the request that started the inquiry served */
+	enum afc_status status;
+	unsigned int queue_ms; /* waiting for the inquiry to start */
+	unsigned int exchange_ms; /* server exchange and regdomain update */
+	unsigned int requests; /* AFC_QUERY_STARTED: requests the inquiry serves */
+	unsigned int next_sec; /* failed AFC_QUERY_DONE: until the retry */
+	unsigned int ifaces; /* AFC_QUERY_REJECTED: interfaces refusing the grant */
+};
+
+typedef void (*afc_query_cb)(const struct afc_query_result *result, void *ctx);
+
+struct afc_query_stats {
+	uint32_t requests;
+	uint32_t joined; /* requests served by an inquiry already in flight */
+	uint32_t inquiries; /* server queries started */
+	uint32_t failures;
+	uint32_t deferred; /* inquiries held back by min_query_interval */
+	uint32_t last_exchange_ms;
+	int in_flight;
+	int64_t last_success; /* seconds since epoch, 0 if none */
+};
+
+unsigned int afc_query_start(afc_query_cb cb, void *ctx);
+/* called when an inquiry starts and finishes, whoever triggered it, and
+AFC_EXPIRY_WARN_SEC before the grant expires; id and inquiry both carry
+the inquiry ID */
+void afc_query_set_observer(afc_query_cb cb, void *ctx);
+const struct afc_query_stats *afc_query_get_stats(void);
+void afc_query_deinit(void);
+enum afc_status afc_query_server(void);
+void afc_schedule_refresh(const char *reason);
+/* driver backends report how many interfaces rejected or did not ack the
+regdomain of the published grant */
+void afc_grant_rejected(unsigned int ifaces);
\ No newline at end of file
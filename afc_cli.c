@@ -11,13 +11,18 @@ this software module.
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include "ctrl.h"
 #include "process.h"
 #include "eloop.h"
 #include "afc.h"
 
 #define AFC_CLI_SOCKET_PATH "/tmp/afc_cli_ctrl_"
-#define AFC_CLI_MAX_ARGUMENT_LIMIT 5
+#define AFC_CLI_MAX_ARGUMENT_LIMIT 16
+/* batch mode keeps up to this many requests in flight, their replies are
+printed in command order */
+#define AFC_CLI_BATCH_WINDOW 32
+#define AFC_CLI_BATCH_LINE_LEN 512
 
 struct afc_cli_cmd {
 	const char *cmd;
@@ -25,18 +30,119 @@ struct afc_cli_cmd {
 	const char *usage;
 };
 
+struct afc_cli_batch_req {
+	char cmd[256];
+	int tag;
+	int done;
+	int status;
+	char *reply;
+};
+
 static const struct afc_cli_cmd cli_cmds[];
 static char req_confidential_reply;
 static int interactive;
+static int watching;
+/* batch mode runs while ctrl is set */
+static struct {
+	struct afc_ctrl *ctrl;
+	int failed;
+	int len;
+	struct afc_cli_batch_req req[AFC_CLI_BATCH_WINDOW];
+} batch;
 
 static void afc_cli_msg_cb(char *msg, size_t len)
 {
 	printf("len:%zu, msg:%s\n", len, msg);
 }
 
-static int afc_cli_ctrl_cmd(struct afc_ctrl *ctrl, char *cmd, int clen)
+static void afc_cli_batch_msg(char *msg, size_t len, void *ctx)
+{
+	UNUSED_PARAM(ctx);
+
+	afc_cli_msg_cb(msg, len);
+}
+
+static void afc_cli_batch_reply(int status, char *reply, size_t len, void *ctx)
+{
+	struct afc_cli_batch_req *req = ctx;
+
+	UNUSED_PARAM(len);
+
+	req->done = 1;
+	req->status = status;
+	if (!status)
+		req->reply = strdup(reply);
+}
+
+/* waits for the requests in flight and prints their replies in order,
+also before anything else is printed */
+static void afc_cli_batch_flush(void)
 {
-	char buf[512], cmd_t[256];
+	struct afc_cli_batch_req *req;
+	int idx;
+
+	if (!batch.ctrl)
+		return;
+
+	afc_ctrl_wait(batch.ctrl, AFC_CTRL_REQUEST_TIMEOUT + 1, afc_cli_batch_msg, NULL);
+
+	for (idx = 0; idx < batch.len; idx++) {
+		req = &batch.req[idx];
+		if (!req->done) {
+			afc_ctrl_cancel(batch.ctrl, req->tag);
+			req->status = -2;
+		}
+
+		if (req->status == -2)
+			printf("'%s' command timed out.\n", req->cmd);
+		else if (req->status < 0 || !req->reply)
+			printf("'%s' command failed.\n", req->cmd);
+		else
+			printf("%s\n", req->reply);
+
+		if (req->status || !req->reply || afc_ctrl_reply_failed(req->reply))
+			batch.failed = 1;
+		free(req->reply);
+	}
+
+	batch.len = 0;
+	fflush(stdout);
+}
+
+static int afc_cli_batch_send(const char *cmd)
+{
+	struct afc_cli_batch_req *req;
+	int retry;
+
+	for (retry = 0; retry < 2; retry++) {
+		if (batch.len == AFC_CLI_BATCH_WINDOW)
+			afc_cli_batch_flush();
+
+		req = &batch.req[batch.len];
+		memset(req, 0, sizeof(*req));
+		snprintf(req->cmd, sizeof(req->cmd), "%s%s",
+			 req_confidential_reply ? "confidential_reply " : "", cmd);
+		req->tag = afc_ctrl_send_request(batch.ctrl, req->cmd, afc_cli_batch_reply, req);
+		if (req->tag >= 0) {
+			batch.len++;
+			return 0;
+		}
+
+		/* afcd has not caught up, let it drain the requests in flight */
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			break;
+		afc_cli_batch_flush();
+	}
+
+	printf("'%s' command failed.\n", cmd);
+	batch.failed = 1;
+	return -1;
+}
+
+static int afc_cli_ctrl_request(struct afc_ctrl *ctrl, char *cmd, int clen,
+				char *buf, size_t size)
+{
+	char cmd_t[256];
 	size_t len;
 	int ret;
 
@@ -45,12 +151,15 @@ static int afc_cli_ctrl_cmd(struct afc_ctrl *ctrl, char *cmd, int clen)
 		return -1;
 	}
 
+	/* replies to requests in flight are printed first, in order */
+	afc_cli_batch_flush();
+
 	if (req_confidential_reply) {
 		clen = snprintf(cmd_t, sizeof(cmd_t), "confidential_reply %s", cmd);
 		cmd = cmd_t;
 	}
 
-	len = sizeof(buf) - 1;
+	len = size - 1;
 
 	ret = afc_ctrl_request(ctrl, cmd, clen, buf, &len,
 			       afc_cli_msg_cb);
@@ -65,13 +174,27 @@ static int afc_cli_ctrl_cmd(struct afc_ctrl *ctrl, char *cmd, int clen)
 	buf[len] = '\0';
 	printf("%s\n", buf);
 
+	if (batch.ctrl && afc_ctrl_reply_failed(buf))
+		batch.failed = 1;
+
 	return 0;
 }
 
+static int afc_cli_ctrl_cmd(struct afc_ctrl *ctrl, char *cmd, int clen)
+{
+	static char buf[AFC_CTRL_MSG_MAX];
+
+	if (batch.ctrl)
+		return afc_cli_batch_send(cmd);
+
+	return afc_cli_ctrl_request(ctrl, cmd, clen, buf, sizeof(buf));
+}
+
 void cmd_usage(const char *cmd)
 {
 	int n;
 
+	afc_cli_batch_flush();
 	printf("commands:\n");
 	for (n = 0; cli_cmds[n].cmd; n++) {
 		if (!strcmp(cli_cmds[n].usage, ""))
@@ -91,20 +214,175 @@ static int afc_cli_help(struct afc_ctrl *ctrl, int argc, char *argv[])
 
 static int afc_cli_send_spectrum_req(struct afc_ctrl *ctrl, int argc, char *argv[])
 {
-	char cmd[64] = {0};
+	char cmd[64] = {0}, buf[REPLY_LEN];
+	unsigned int id;
+	size_t len;
 	int ret, clen = 0;
 
-	UNUSED_PARAM(argc);
-	UNUSED_PARAM(argv);
-
 	clen = snprintf(cmd, sizeof(cmd), "AFC_SEND_SPECTRUM_REQUEST");
-	ret = afc_cli_ctrl_cmd(ctrl, cmd, clen);
+	ret = afc_cli_ctrl_request(ctrl, cmd, clen, buf, sizeof(buf));
 	if (ret < 0) {
 		printf("unable to send spectrum_request\n");
 		return ret;
 	}
 
-	return 0;
+	/* the reply carries the ID, "wait" blocks for the completion event */
+	if (argc < 1 || strcasecmp(argv[0], "wait"))
+		return 0;
+	if (sscanf(buf, "PENDING id=%u", &id) != 1)
+		return -1;
+
+	snprintf(cmd, sizeof(cmd), "<SPECTRUM_REQUEST_DONE id=%u ", id);
+	len = sizeof(buf);
+	ret = afc_ctrl_wait_event(ctrl, cmd, buf, &len, DEFAULT_CTRL_WAIT_MSG_TIMEOUT);
+	if (ret < 0) {
+		printf("no completion for spectrum_request id=%u\n", id);
+		return ret;
+	}
+	printf("%s\n", buf);
+
+	return strstr(buf, "status=SUCCESS") ? 0 : -1;
+}
+
+static int afc_cli_eloop_stats(struct afc_ctrl *ctrl, int argc, char *argv[])
+{
+	char cmd[32] = {0};
+	int clen;
+
+	if (argc > 0 && strcasecmp(argv[0], "reset")) {
+		cmd_usage("eloop_stats");
+		return -1;
+	}
+
+	clen = snprintf(cmd, sizeof(cmd), argc > 0 ? "ELOOP_STATS_RESET" : "ELOOP_STATS");
+	return afc_cli_ctrl_cmd(ctrl, cmd, clen);
+}
+
+/* forwards a read-only query with its arguments */
+static int afc_cli_query(struct afc_ctrl *ctrl, const char *name, int argc, char *argv[])
+{
+	char cmd[128];
+	int clen, idx, ret;
+
+	clen = snprintf(cmd, sizeof(cmd), "%s", name);
+	for (idx = 0; idx < argc; idx++) {
+		ret = snprintf(cmd + clen, sizeof(cmd) - clen, " %s", argv[idx]);
+		if (ret < 0 || ret >= (int)sizeof(cmd) - clen)
+			return -1;
+		clen += ret;
+	}
+
+	return afc_cli_ctrl_cmd(ctrl, cmd, clen);
+}
+
+static int afc_cli_status(struct afc_ctrl *ctrl, int argc, char *argv[])
+{
+	return afc_cli_query(ctrl, "STATUS", argc, argv);
+}
+
+static int afc_cli_get_grant(struct afc_ctrl *ctrl, int argc, char *argv[])
+{
+	return afc_cli_query(ctrl, "GET_GRANT", argc, argv);
+}
+
+static int afc_cli_get_channel(struct afc_ctrl *ctrl, int argc, char *argv[])
+{
+	if (argc != 2) {
+		cmd_usage("get_channel");
+		return -1;
+	}
+
+	return afc_cli_query(ctrl, "GET_CHANNEL", argc, argv);
+}
+
+static int afc_cli_get_psd(struct afc_ctrl *ctrl, int argc, char *argv[])
+{
+	if (argc != 1) {
+		cmd_usage("get_psd");
+		return -1;
+	}
+
+	return afc_cli_query(ctrl, "GET_PSD", argc, argv);
+}
+
+static int afc_cli_get_expiry(struct afc_ctrl *ctrl, int argc, char *argv[])
+{
+	return afc_cli_query(ctrl, "GET_EXPIRY", argc, argv);
+}
+
+static int afc_cli_get_metrics(struct afc_ctrl *ctrl, int argc, char *argv[])
+{
+	return afc_cli_query(ctrl, "GET_METRICS", argc, argv);
+}
+
+static void cli_ctrl_iface_receive(int sock, void *priv, void *user_data);
+static void afc_cli_eof_cb(int sig, void *ctx);
+/* stops the events, the socket is left to the caller */
+static int afc_cli_detach(struct afc_ctrl *ctrl)
+{
+	char buf[8];
+	int ret, len;
+
+	len = snprintf(buf, sizeof(buf), "DETACH");
+
+	ret = afc_cli_ctrl_cmd(ctrl, buf, len);
+	if (ret < 0)
+		printf("unable to detach from afcd\n");
+
+	return ret;
+}
+
+/* stays attached until interrupted, events arrive through
+cli_ctrl_iface_receive */
+static int afc_cli_watch(struct afc_ctrl *ctrl, int argc, char *argv[])
+{
+	char cmd[128], buf[REPLY_LEN];
+	size_t len = sizeof(buf) - 1;
+	int clen, ret;
+
+	if (interactive || batch.ctrl) {
+		printf("watch runs on its own, events are shown in interactive mode\n");
+		return -1;
+	}
+
+	if (argc > 1) {
+		cmd_usage("watch");
+		return -1;
+	}
+
+	if (argc)
+		clen = snprintf(cmd, sizeof(cmd), "ATTACH events=%s", argv[0]);
+	else
+		clen = snprintf(cmd, sizeof(cmd), "ATTACH");
+
+	ret = afc_ctrl_request(ctrl, cmd, clen, buf, &len, afc_cli_msg_cb);
+	if (ret) {
+		printf("unable to attach with afcd\n");
+		return -1;
+	}
+
+	buf[len] = '\0';
+	if (strcmp(buf, "OK")) {
+		printf("unable to attach with afcd: %s\n", buf);
+		return -1;
+	}
+
+	if (eloop_init()) {
+		afc_cli_detach(ctrl);
+		return -1;
+	}
+
+	watching = 1;
+	eloop_register_read_sock(ctrl->soc, cli_ctrl_iface_receive, ctrl, NULL);
+	eloop_register_signal_terminate(afc_cli_eof_cb, NULL);
+	eloop_run();
+	eloop_unregister_read_sock(ctrl->soc);
+	watching = 0;
+
+	ret = afc_cli_detach(ctrl);
+	eloop_destroy();
+
+	return ret;
 }
 
 static int afc_cli_quit(struct afc_ctrl *ctrl, int argc, char *argv[])
@@ -121,7 +399,15 @@ static int afc_cli_quit(struct afc_ctrl *ctrl, int argc, char *argv[])
 
 static const struct afc_cli_cmd cli_cmds[] = {
 	{ "help", afc_cli_help, "= show command usage" },
-	{ "afc_send_spectrum_request", afc_cli_send_spectrum_req, "= send spectrum request to afc server" },
+	{ "afc_send_spectrum_request", afc_cli_send_spectrum_req, "[wait] = send spectrum request to afc server, wait for its completion" },
+	{ "status", afc_cli_status, "= show grant and inquiry state" },
+	{ "get_grant", afc_cli_get_grant, "[op_class] = list granted channels and PSD ranges" },
+	{ "get_channel", afc_cli_get_channel, "<op_class> <cfi> = show the grant of one channel" },
+	{ "get_psd", afc_cli_get_psd, "<freq_mhz> = show the PSD limit at a frequency" },
+	{ "get_expiry", afc_cli_get_expiry, "= show when the grant expires" },
+	{ "get_metrics", afc_cli_get_metrics, "= show inquiry, event loop and driver counters" },
+	{ "eloop_stats", afc_cli_eloop_stats, "[reset] = show or clear event loop latency statistics" },
+	{ "watch", afc_cli_watch, "[grant,request,inquiry] = print events with timestamps until interrupted" },
 	{ "quit", afc_cli_quit, "= exit from afcd_cli interactive session" },
 	{ NULL, NULL, NULL }
 };
@@ -137,6 +423,7 @@ int afc_exe_cli_cmd(struct afc_ctrl *ctrl, int argc, char *argv[])
 		cmd++;
 	}
 
+	afc_cli_batch_flush();
 	printf("unknown command '%s', try 'help'\n", argv[0]);
 	return -1;
 }
@@ -144,13 +431,13 @@ int afc_exe_cli_cmd(struct afc_ctrl *ctrl, int argc, char *argv[])
 int tokenize_cmd(char *cmd, char *argv[])
 {
 	int argc = 0;
-	char *temp = strtok(cmd, " ");
+	char *temp = strtok(cmd, " \t");
 
 	while (temp != NULL) {
 		if (argc == AFC_CLI_MAX_ARGUMENT_LIMIT)
 			return -1;
 		argv[argc] = temp;
-		temp = strtok(NULL, " ");
+		temp = strtok(NULL, " \t");
 		argc++;
 	}
 	return argc;
@@ -181,18 +468,76 @@ static void afc_cli_cmd_cb(void *ctx, char *cmd, struct afc_ctrl *ctrl)
 		afc_exe_cli_cmd(ctrl, argc, &argv[0]);
 }
 
+/* one command per line, blank lines and lines starting with '#' are
+skipped. commands share the connection and are pipelined */
+static int afc_cli_batch(struct afc_ctrl *ctrl, const char *path)
+{
+	char line[AFC_CLI_BATCH_LINE_LEN];
+	char *argv[AFC_CLI_MAX_ARGUMENT_LIMIT];
+	char *cmd;
+	FILE *f;
+	int argc;
+
+	f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!f) {
+		printf("unable to open '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	batch.ctrl = ctrl;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		cmd = line + strspn(line, " \t");
+		if (!*cmd || *cmd == '#')
+			continue;
+
+		argc = tokenize_cmd(cmd, argv);
+		if (argc == -1) {
+			afc_cli_batch_flush();
+			printf("maximum argument limit reached\n");
+			batch.failed = 1;
+			continue;
+		}
+
+		if (argc && afc_exe_cli_cmd(ctrl, argc, &argv[0]) < 0)
+			batch.failed = 1;
+	}
+
+	afc_cli_batch_flush();
+	batch.ctrl = NULL;
+
+	if (f != stdin)
+		fclose(f);
+
+	return batch.failed ? -1 : 0;
+}
+
+/* "2024-05-02 10:15:04.123 GRANT_UPDATED grant_seq=.." in local time */
+static void afc_cli_print_event(const char *event)
+{
+	struct timeval tv;
+	struct tm tm;
+	char ts[32];
+
+	gettimeofday(&tv, NULL);
+	localtime_r(&tv.tv_sec, &tm);
+	strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%03ld %s\n", ts, (long)tv.tv_usec / 1000, event);
+	fflush(stdout);
+}
+
 static void cli_ctrl_iface_receive(int sock, void *priv, void *user_data)
 {
 	struct sockaddr_storage from;
 	socklen_t fromlen = sizeof(from);
-	char buffer[4096], *buf = buffer;
+	static char buffer[AFC_CTRL_MSG_MAX];
+	char *buf = buffer;
 	int res = 0;
 
 	UNUSED_PARAM(priv);
 	UNUSED_PARAM(user_data);
 
-	res = recvfrom(sock, buffer, sizeof(buffer) - 1, 0,
-		       (struct sockaddr *)&from, &fromlen);
+	res = afc_ctrl_recv_msg(sock, buffer, sizeof(buffer) - 1, &from, &fromlen);
 
 	if (res < 0) {
 		printf("receive from ctrl_iface failed\n");
@@ -200,6 +545,10 @@ static void cli_ctrl_iface_receive(int sock, void *priv, void *user_data)
 	}
 
 	buf[res] = '\0';
+	if (watching && buf[0] == '<') {
+		afc_cli_print_event(buf + 1);
+		return;
+	}
 	printf("%s\n", buf);
 }
 
@@ -222,29 +571,47 @@ int afc_attach_interface(struct afc_ctrl *ctrl)
 
 int afc_detach_interface(struct afc_ctrl *ctrl)
 {
-	char buf[8];
-	int ret, len;
-
-	len = snprintf(buf, sizeof(buf), "DETACH");
+	int ret;
 
-	ret = afc_cli_ctrl_cmd(ctrl, buf, len);
-	if (ret < 0) {
-		printf("unable to detach from afcd\n");
+	ret = afc_cli_detach(ctrl);
+	if (ret < 0)
 		return ret;
-	}
 
 	eloop_unregister_read_sock(ctrl->soc);
 
 	return 0;
 }
 
+static void afc_cli_usage(const char *prog)
+{
+	printf("usage: %s [-f <file>|-] [command [args]]\n"
+	       "  -f  run the commands of a file, - for stdin, over one connection\n", prog);
+}
+
 int main(int argc, char *argv[])
 {
 	struct afc_ctrl *ctrl;
 	char local_path[UNIX_PATH_MAX];
 	char dest_path[UNIX_PATH_MAX];
+	const char *batch_path = NULL;
+	int c, ret = 0;
+
+	for (;;) {
+		/* options end at the command, its arguments are left alone */
+		c = getopt(argc, argv, "+f:h");
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'f':
+			batch_path = optarg;
+			break;
+		default:
+			afc_cli_usage(argv[0]);
+			return -1;
+		}
+	}
 
-	if (argc == 1)
+	if (optind == argc && !batch_path)
 		interactive = 1;
 
 	snprintf(local_path, sizeof(local_path), AFC_CLI_SOCKET_PATH "%d", (int) getpid());
@@ -272,6 +639,9 @@ int main(int argc, char *argv[])
 		afc_detach_interface(ctrl);
 		command_deinit();
 		eloop_destroy();
+	} else if (batch_path) {
+		req_confidential_reply = 1;
+		ret = afc_cli_batch(ctrl, batch_path);
 	} else {
 		req_confidential_reply = 1;
 		afc_exe_cli_cmd(ctrl, argc - optind, &argv[optind]);
@@ -279,5 +649,5 @@ int main(int argc, char *argv[])
 
 	afc_ctrl_disconnect(ctrl);
 
-	return 0;
+	return ret;
 }
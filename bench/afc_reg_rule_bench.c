@@ -0,0 +1,319 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "afc.h"
+#include "afc_reg_rule.h"
+#include "afc_driver.h"
+#include "afc_drv_mock.h"
+
+#define BENCH_DEFAULT_ITERATIONS 20000
+/* ns/rule ceiling of a case is its baseline times this factor */
+#define BENCH_DEFAULT_MAX_SLOWDOWN 3.0
+#define BENCH_MAX_CHAN_INFO 5
+
+/* allocation counters, malloc family is wrapped at link time (--wrap) */
+static unsigned long bench_allocs;
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	bench_allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	bench_allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	bench_allocs++;
+	return __real_realloc(ptr, size);
+}
+
+struct bench_case {
+	const char *name;
+	struct afc_spectrum_inquiry_resp resp;
+	struct afc_resp_freq_info freq_info[AFC_6GHZ_NUM_SUBCHAN];
+	struct afc_resp_chan_info chan_info[BENCH_MAX_CHAN_INFO];
+	uint8_t cfi[BENCH_MAX_CHAN_INFO][AFC_6GHZ_NUM_SUBCHAN];
+	double eirp[BENCH_MAX_CHAN_INFO][AFC_6GHZ_NUM_SUBCHAN];
+	uint32_t expected_rules;
+	/* x86-64 at -O2, best of 35 runs */
+	double baseline_ns_per_rule;
+};
+
+static const struct {
+	uint16_t global_op_class;
+	uint8_t first_cfi;
+	uint8_t cfi_step;
+	uint8_t num_chan;
+	double bw_db;
+} bench_op_class[BENCH_MAX_CHAN_INFO] = {
+	{ 131, 1, 4, 59, 13.0103 },
+	{ 132, 3, 8, 29, 16.0206 },
+	{ 133, 7, 16, 14, 19.0309 },
+	{ 134, 15, 32, 7, 22.0412 },
+	{ 137, 31, 32, 6, 25.0515 },
+};
+
+static void bench_add_freq(struct bench_case *bc, uint16_t low, uint16_t high, double psd)
+{
+	struct afc_resp_freq_info *fi = &bc->freq_info[bc->resp.num_freq_info++];
+
+	fi->freq_range.low_frequency = low;
+	fi->freq_range.high_frequency = high;
+	fi->max_psd = psd;
+}
+
+/* channel list for the op class, EIRP follows the PSD used by bench_add_freq
+so combined responses carry exact duplicates for the dedupe stage */
+static void bench_add_chan(struct bench_case *bc, int op_idx, int num_chan)
+{
+	int idx = bc->resp.num_chan_info++;
+	int chan;
+
+	bc->chan_info[idx].global_op_class = bench_op_class[op_idx].global_op_class;
+	bc->chan_info[idx].num_chan_cfi = num_chan;
+	bc->chan_info[idx].channel_cfi = bc->cfi[idx];
+	bc->chan_info[idx].max_eirp = bc->eirp[idx];
+	for (chan = 0; chan < num_chan; chan++) {
+		bc->cfi[idx][chan] = bench_op_class[op_idx].first_cfi + chan * bench_op_class[op_idx].cfi_step;
+		bc->eirp[idx][chan] = (chan % 8) + bench_op_class[op_idx].bw_db;
+	}
+}
+
+static void bench_setup(struct bench_case *bc, const char *name)
+{
+	memset(bc, 0, sizeof(*bc));
+	bc->name = name;
+	bc->resp.freq_info = bc->freq_info;
+	bc->resp.chan_info = bc->chan_info;
+	memcpy(bc->resp.country, "US", 2);
+}
+
+static void bench_build_cases(struct bench_case *cases, int *num_cases)
+{
+	int idx, subchan;
+	struct bench_case *bc;
+
+	idx = 0;
+
+	bc = &cases[idx++];
+	bench_setup(bc, "tiny");
+	bench_add_freq(bc, 5945, 5965, 0);
+	bench_add_chan(bc, 0, 2);
+	bc->expected_rules = 2;
+	bc->baseline_ns_per_rule = 20.5;
+
+	bc = &cases[idx++];
+	bench_setup(bc, "chan_full");
+	for (subchan = 0; subchan < BENCH_MAX_CHAN_INFO; subchan++)
+		bench_add_chan(bc, subchan, bench_op_class[subchan].num_chan);
+	bc->expected_rules = 115;
+	bc->baseline_ns_per_rule = 7.1;
+
+	bc = &cases[idx++];
+	bench_setup(bc, "freq_derive");
+	for (subchan = 0; subchan < AFC_6GHZ_NUM_SUBCHAN; subchan++)
+		bench_add_freq(bc, AFC_6GHZ_BAND_START_MHZ + subchan * AFC_6GHZ_SUBCHAN_MHZ,
+					   AFC_6GHZ_BAND_START_MHZ + (subchan + 1) * AFC_6GHZ_SUBCHAN_MHZ, subchan % 8);
+	bc->expected_rules = 115;
+	bc->baseline_ns_per_rule = 28.7;
+
+	/* worst case for the dedupe stage: every frequency rule duplicates a channel rule */
+	bc = &cases[idx++];
+	bench_setup(bc, "freq_chan_dedupe");
+	for (subchan = 0; subchan < AFC_6GHZ_NUM_SUBCHAN; subchan++)
+		bench_add_freq(bc, AFC_6GHZ_BAND_START_MHZ + subchan * AFC_6GHZ_SUBCHAN_MHZ,
+					   AFC_6GHZ_BAND_START_MHZ + (subchan + 1) * AFC_6GHZ_SUBCHAN_MHZ, subchan % 8);
+	for (subchan = 0; subchan < BENCH_MAX_CHAN_INFO; subchan++)
+		bench_add_chan(bc, subchan, bench_op_class[subchan].num_chan);
+	bc->expected_rules = 115;
+	bc->baseline_ns_per_rule = 17.1;
+
+	*num_cases = idx;
+}
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long bench_peak_rss_kb(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage))
+		return -1;
+
+	return usage.ru_maxrss;
+}
+
+/* the mock must hold exactly what the pipeline sent, and a rejected apply
+must fail the construction and be counted */
+static int bench_check_apply(struct bench_case *bc)
+{
+	const struct afc_drv_mock_stats *mock = afc_drv_mock_get_stats();
+	const uint8_t *sent, *applied;
+	size_t sent_len, applied_len;
+	uint32_t rejected = mock->rejected;
+	int ret = 0;
+
+	sent = afc_reg_rule_get_payload(&sent_len);
+	applied = afc_drv_mock_last_payload(&applied_len);
+	if (!sent || !applied || sent_len != applied_len || memcmp(sent, applied, sent_len)) {
+		printf("GATE %s: applied regdomain differs from the constructed one\n", bc->name);
+		ret = -1;
+	}
+
+	afc_drv_mock_fail_next(1);
+	if (afc_construct_regrule_from_afc_response(&bc->resp) != AFC_STATUS_FAILURE ||
+		mock->rejected != rejected + 1) {
+		printf("GATE %s: rejected apply was not reported\n", bc->name);
+		ret = -1;
+	}
+	if (afc_construct_regrule_from_afc_response(&bc->resp) != AFC_STATUS_SUCCESS) {
+		printf("GATE %s: apply after a rejection failed\n", bc->name);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static int bench_run_case(struct bench_case *bc, int iterations, double max_slowdown, int gate)
+{
+	int iter;
+	uint64_t start, elapsed;
+	unsigned long allocs;
+	double ns_per_call, ns_per_rule, max_ns_per_rule;
+	const struct afc_drv_mock_stats *mock = afc_drv_mock_get_stats();
+	int ret = 0;
+
+	/* warm up, grows the regdomain buffer to this case's capacity */
+	if (afc_construct_regrule_from_afc_response(&bc->resp)) {
+		printf("%-18s construct failed\n", bc->name);
+		return -1;
+	}
+
+	allocs = bench_allocs;
+	start = bench_now_ns();
+	for (iter = 0; iter < iterations; iter++)
+		afc_construct_regrule_from_afc_response(&bc->resp);
+	elapsed = bench_now_ns() - start;
+	allocs = bench_allocs - allocs;
+
+	ns_per_call = (double)elapsed / iterations;
+	ns_per_rule = mock->last_n_rules ? ns_per_call / mock->last_n_rules : ns_per_call;
+
+	printf("%-18s %6u %8zu %12.1f %10.1f %10.3f\n", bc->name, mock->last_n_rules, mock->last_len,
+		   ns_per_call, ns_per_rule, (double)allocs / iterations);
+
+	if (!gate)
+		return 0;
+
+	if (mock->last_n_rules != bc->expected_rules) {
+		printf("GATE %s: %u rules, expected %u\n", bc->name, mock->last_n_rules, bc->expected_rules);
+		ret = -1;
+	}
+	if (allocs) {
+		printf("GATE %s: %lu allocations in steady state\n", bc->name, allocs);
+		ret = -1;
+	}
+	max_ns_per_rule = bc->baseline_ns_per_rule * max_slowdown;
+	if (ns_per_rule > max_ns_per_rule) {
+		printf("GATE %s: %.1f ns/rule exceeds %.1f\n", bc->name, ns_per_rule, max_ns_per_rule);
+		ret = -1;
+	}
+	if (bench_check_apply(bc))
+		ret = -1;
+
+	return ret;
+}
+
+static void bench_usage(const char *prog)
+{
+	printf("usage: %s [-n iterations] [-g] [-t max_slowdown]\n"
+		   "  -g  regression gate, exit non-zero on rule count, allocation,\n"
+		   "      ns/rule or driver apply regressions\n"
+		   "  -t  ns/rule ceiling as a multiple of each case's baseline\n"
+		   "      (default %.1f)\n", prog, BENCH_DEFAULT_MAX_SLOWDOWN);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct bench_case cases[4];
+	int num_cases, idx, c;
+	int iterations = BENCH_DEFAULT_ITERATIONS;
+	double max_slowdown = BENCH_DEFAULT_MAX_SLOWDOWN;
+	int gate = 0, ret = 0;
+
+	for (;;) {
+		c = getopt(argc, argv, "n:gt:h");
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'g':
+			gate = 1;
+			break;
+		case 't':
+			max_slowdown = atof(optarg);
+			break;
+		default:
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (iterations <= 0 || max_slowdown <= 0) {
+		bench_usage(argv[0]);
+		return 1;
+	}
+
+	/* keep the pipeline's own logging out of the measurement */
+	afc_debug_level = MSG_ERROR + 1;
+
+	/* regdomains are applied to the in-memory backend, which copies
+	them like the netlink path does */
+	if (afc_driver_select("mock") || afc_driver_init())
+		return 1;
+
+	bench_build_cases(cases, &num_cases);
+
+	printf("%-18s %6s %8s %12s %10s %10s\n", "case", "rules", "bytes", "ns/call", "ns/rule", "allocs");
+	for (idx = 0; idx < num_cases; idx++) {
+		if (bench_run_case(&cases[idx], iterations, max_slowdown, gate))
+			ret = 1;
+	}
+	printf("peak RSS: %ld kB\n", bench_peak_rss_kb());
+
+	afc_reg_rule_deinit();
+	afc_driver_deinit();
+
+	if (gate)
+		printf("regression gate: %s\n", ret ? "FAILED" : "passed");
+
+	return ret;
+}
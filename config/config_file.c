@@ -20,7 +20,7 @@ int afc_read_req_configs(struct afc_config *config)
 	int chan_cfi_idx = 0;
 	int len, parsed_value;
 	char *token, *value, *pos;
-	char *freq_range_token, *cfi_token;
+	char *freq_range_token, *cfi_token, *ifname_token;
 	char line[MAX_NUM_OF_ENTRIES];
 	FILE *fp;
 
@@ -169,12 +169,30 @@ int afc_read_req_configs(struct afc_config *config)
 			config->verify_cert = (uint8_t)atoi(value);
 		} else if (strcmp(token, "afc_url") == 0) {
 			strncpy(config->afc_server_url, value, sizeof(config->afc_server_url) - 1);
+		} else if (strcmp(token, "ifname") == 0) {
+			ifname_token = strtok(value, " '");
+			while (ifname_token != NULL) {
+				if (config->num_ifnames == AFC_MAX_RADIOS) {
+					afc_printf(MSG_ERROR, "only %d interfaces are supported, ignoring %s",
+							   AFC_MAX_RADIOS, ifname_token);
+					break;
+				}
+				strncpy(config->ifnames[config->num_ifnames], ifname_token, IFNAMSIZ - 1);
+				config->num_ifnames++;
+				ifname_token = strtok(NULL, " '");
+			}
 		} else if (strcmp(token, "country_code") == 0) {
 			if (value[0] < 'A' || value[0] > 'Z' || value[1] < 'A' || value[1] > 'Z') {
 				afc_printf(MSG_ERROR, "invalid country_code %s", value);
 				goto fail;
 			}
 			memcpy(config->country, value, 2);
+		} else if (strcmp(token, "min_query_interval") == 0) {
+			if (atoi(value) < 0) {
+				afc_printf(MSG_ERROR, "invalid min_query_interval %s", value);
+				goto fail;
+			}
+			config->min_query_interval = atoi(value);
 		}
 	}
 
@@ -7,6 +7,7 @@ this software module.
 
 *******************************************************************************/
 #include <stdint.h>
+#include <net/if.h>
 
 #define STARTING_FREQ_6GHZ 5925
 #define ENDING_FREQ_6GHZ 7125
@@ -16,6 +17,7 @@ this software module.
 #define DISABLE_CERT_VERIFICATION 0
 #define MAX_NUM_OF_ENTRIES 2000
 #define AFCD_CONFIG_FILE "/etc/config/afc_config.conf"
+#define AFC_MAX_RADIOS 4
 
 struct afc_req_device_descriptor {
 	char serial_number[20];
@@ -78,6 +80,11 @@ struct afc_config {
 	uint8_t verify_cert;
 	char afc_server_url[256];
 	char country[3];
+	/* 6GHz interfaces the grant is applied to */
+	char ifnames[AFC_MAX_RADIOS][IFNAMSIZ];
+	uint8_t num_ifnames;
+	/* seconds between the starts of two server queries, 0 for no limit */
+	uint32_t min_query_interval;
 };
 
 int afc_read_req_configs (struct afc_config *config);
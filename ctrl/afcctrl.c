@@ -0,0 +1,448 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#include "eloop.h"
+#include "afc.h"
+#include "ctrl.h"
+#include "afcctrl.h"
+
+#define AFCCTRL_SOCKET_PATH "/tmp/afcctrl_"
+
+struct afcctrl {
+	struct afc_ctrl *ctrl;
+	afcctrl_event_cb event_cb;
+	void *event_ctx;
+};
+
+enum afcctrl_field_type {
+	AFCCTRL_U32,
+	AFCCTRL_S32,
+	AFCCTRL_U64,
+	AFCCTRL_S64,
+	AFCCTRL_STR,
+	AFCCTRL_STATE,
+	AFCCTRL_RESULT,
+};
+
+struct afcctrl_field {
+	const char *key;
+	enum afcctrl_field_type type;
+	size_t offset;
+	size_t size;
+};
+
+#define AFCCTRL_FIELD(type, name, field) \
+	{ #name, field, offsetof(type, name), sizeof(((type *)0)->name) }
+
+static const struct afcctrl_field afcctrl_status_fields[] = {
+	AFCCTRL_FIELD(struct afcctrl_status, state, AFCCTRL_STATE),
+	AFCCTRL_FIELD(struct afcctrl_status, backend, AFCCTRL_STR),
+	AFCCTRL_FIELD(struct afcctrl_status, grant_seq, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_status, country, AFCCTRL_STR),
+	AFCCTRL_FIELD(struct afcctrl_status, rule_set_id, AFCCTRL_STR),
+	AFCCTRL_FIELD(struct afcctrl_status, resp_status, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_status, publish_time, AFCCTRL_S64),
+	AFCCTRL_FIELD(struct afcctrl_status, expire_time, AFCCTRL_S64),
+	AFCCTRL_FIELD(struct afcctrl_status, num_chan, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_status, num_psd, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_status, inquiry_in_flight, AFCCTRL_S32),
+	AFCCTRL_FIELD(struct afcctrl_status, last_success, AFCCTRL_S64),
+	AFCCTRL_FIELD(struct afcctrl_status, rejected_ifaces, AFCCTRL_U32),
+	{ NULL, 0, 0, 0 }
+};
+
+static const struct afcctrl_field afcctrl_metrics_fields[] = {
+	AFCCTRL_FIELD(struct afcctrl_metrics, query_requests, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, query_joined, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, query_inquiries, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, query_failures, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, query_deferred, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, query_last_exchange_ms, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, grant_seq, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, eloop_iterations, AFCCTRL_U64),
+	AFCCTRL_FIELD(struct afcctrl_metrics, eloop_callbacks, AFCCTRL_U64),
+	AFCCTRL_FIELD(struct afcctrl_metrics, eloop_stalls, AFCCTRL_U64),
+	AFCCTRL_FIELD(struct afcctrl_metrics, nl80211_tx, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, nl80211_acked, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, nl80211_errors, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, nl80211_timeouts, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, nl80211_send_errors, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, nl80211_ext_ack, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, mock_applied, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, mock_rejected, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_metrics, mock_last_n_rules, AFCCTRL_U32),
+	{ NULL, 0, 0, 0 }
+};
+
+static const struct afcctrl_field afcctrl_event_fields[] = {
+	AFCCTRL_FIELD(struct afcctrl_event, id, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_event, inquiry, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_event, status, AFCCTRL_RESULT),
+	AFCCTRL_FIELD(struct afcctrl_event, queue_ms, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_event, exchange_ms, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_event, grant_seq, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_event, expire_time, AFCCTRL_S64),
+	AFCCTRL_FIELD(struct afcctrl_event, remaining_sec, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_event, requests, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_event, retry_sec, AFCCTRL_U32),
+	AFCCTRL_FIELD(struct afcctrl_event, ifaces, AFCCTRL_U32),
+	{ NULL, 0, 0, 0 }
+};
+
+static const char *const afcctrl_states[] = {
+	[AFCCTRL_STATE_UNKNOWN] = "",
+	[AFCCTRL_STATE_NONE] = "NONE",
+	[AFCCTRL_STATE_EXPIRED] = "EXPIRED",
+	[AFCCTRL_STATE_DENIED] = "DENIED",
+	[AFCCTRL_STATE_GRANTED] = "GRANTED",
+};
+
+static void afcctrl_store(const struct afcctrl_field *field, const char *value, void *out)
+{
+	char *dst = (char *)out + field->offset;
+	unsigned int idx;
+
+	switch (field->type) {
+	case AFCCTRL_U32:
+		*(uint32_t *)dst = strtoul(value, NULL, 10);
+		break;
+	case AFCCTRL_S32:
+		*(int32_t *)dst = strtol(value, NULL, 10);
+		break;
+	case AFCCTRL_U64:
+		*(uint64_t *)dst = strtoull(value, NULL, 10);
+		break;
+	case AFCCTRL_S64:
+		*(int64_t *)dst = strtoll(value, NULL, 10);
+		break;
+	case AFCCTRL_STR:
+		snprintf(dst, field->size, "%s", value);
+		break;
+	case AFCCTRL_STATE:
+		*(enum afcctrl_state *)dst = AFCCTRL_STATE_UNKNOWN;
+		for (idx = 1; idx < sizeof(afcctrl_states) / sizeof(afcctrl_states[0]); idx++) {
+			if (!strcmp(value, afcctrl_states[idx]))
+				*(enum afcctrl_state *)dst = idx;
+		}
+		break;
+	case AFCCTRL_RESULT:
+		*(int32_t *)dst = strcmp(value, "SUCCESS") ? -1 : 0;
+		break;
+	}
+}
+
+/* key=value pairs separated by sep, unknown keys are skipped so newer
+afcd versions can add fields */
+static void afcctrl_parse_fields(const char *text, const char *sep,
+				 const struct afcctrl_field *fields, void *out)
+{
+	const struct afcctrl_field *field;
+	const char *end, *eq;
+	char value[64];
+	size_t len;
+
+	while (*text) {
+		end = text + strcspn(text, sep);
+		eq = memchr(text, '=', end - text);
+		if (eq) {
+			len = eq - text;
+			for (field = fields; field->key; field++) {
+				if (strlen(field->key) == len && !strncmp(field->key, text, len))
+					break;
+			}
+			if (field->key) {
+				len = end - eq - 1;
+				if (len >= sizeof(value))
+					len = sizeof(value) - 1;
+				memcpy(value, eq + 1, len);
+				value[len] = '\0';
+				afcctrl_store(field, value, out);
+			}
+		}
+		text = *end ? end + 1 : end;
+	}
+}
+
+int afcctrl_parse_status(const char *reply, struct afcctrl_status *status)
+{
+	memset(status, 0, sizeof(*status));
+	if (afc_ctrl_reply_failed(reply))
+		return -1;
+
+	afcctrl_parse_fields(reply, "\n", afcctrl_status_fields, status);
+	return 0;
+}
+
+int afcctrl_parse_metrics(const char *reply, struct afcctrl_metrics *metrics)
+{
+	memset(metrics, 0, sizeof(*metrics));
+	if (afc_ctrl_reply_failed(reply))
+		return -1;
+
+	afcctrl_parse_fields(reply, "\n", afcctrl_metrics_fields, metrics);
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	enum afcctrl_event_type type;
+} afcctrl_event_types[] = {
+	{ "<SPECTRUM_REQUEST_DONE ", AFCCTRL_EVENT_REQUEST_DONE },
+	{ "<GRANT_UPDATED ", AFCCTRL_EVENT_GRANT_UPDATED },
+	{ "<GRANT_EXPIRING ", AFCCTRL_EVENT_GRANT_EXPIRING },
+	{ "<INQUIRY_STARTED ", AFCCTRL_EVENT_INQUIRY_STARTED },
+	{ "<INQUIRY_FAILED ", AFCCTRL_EVENT_INQUIRY_FAILED },
+	{ "<GRANT_REJECTED ", AFCCTRL_EVENT_GRANT_REJECTED },
+};
+
+int afcctrl_parse_event(const char *msg, struct afcctrl_event *event)
+{
+	const char *args;
+	size_t idx;
+
+	memset(event, 0, sizeof(*event));
+	event->raw = msg;
+	for (idx = 0; idx < sizeof(afcctrl_event_types) / sizeof(afcctrl_event_types[0]); idx++) {
+		if (!strncmp(msg, afcctrl_event_types[idx].name, strlen(afcctrl_event_types[idx].name))) {
+			event->type = afcctrl_event_types[idx].type;
+			break;
+		}
+	}
+	if (event->type == AFCCTRL_EVENT_OTHER)
+		return -1;
+
+	args = strchr(msg, ' ');
+	afcctrl_parse_fields(args + 1, " ", afcctrl_event_fields, event);
+	return 0;
+}
+
+/* "chan=op_class,cfi,start_mhz,end_mhz,max_eirp_mbm" and
+"psd=low_mhz,high_mhz,max_psd_mbm" lines, see GET_GRANT */
+int afcctrl_parse_grant(const char *reply, struct afcctrl_grant *grant)
+{
+	unsigned int num_chan = 0, num_psd = 0, v[4];
+	const char *line;
+	int eirp;
+
+	memset(grant, 0, sizeof(*grant));
+	if (afc_ctrl_reply_failed(reply))
+		return -1;
+
+	for (line = reply; *line; line += strcspn(line, "\n"), line += *line ? 1 : 0) {
+		if (!strncmp(line, "chan=", 5))
+			num_chan++;
+		else if (!strncmp(line, "psd=", 4))
+			num_psd++;
+	}
+
+	grant->chan = num_chan ? calloc(num_chan, sizeof(*grant->chan)) : NULL;
+	grant->psd = num_psd ? calloc(num_psd, sizeof(*grant->psd)) : NULL;
+	if ((num_chan && !grant->chan) || (num_psd && !grant->psd)) {
+		afcctrl_grant_free(grant);
+		return -1;
+	}
+
+	for (line = reply; *line; line += strcspn(line, "\n"), line += *line ? 1 : 0) {
+		if (sscanf(line, "chan=%u,%u,%u,%u,%d", &v[0], &v[1], &v[2], &v[3], &eirp) == 5) {
+			grant->chan[grant->num_chan].op_class = v[0];
+			grant->chan[grant->num_chan].cfi = v[1];
+			grant->chan[grant->num_chan].start_mhz = v[2];
+			grant->chan[grant->num_chan].end_mhz = v[3];
+			grant->chan[grant->num_chan].max_eirp_mbm = eirp;
+			grant->num_chan++;
+		} else if (sscanf(line, "psd=%u,%u,%d", &v[0], &v[1], &eirp) == 3) {
+			grant->psd[grant->num_psd].low_mhz = v[0];
+			grant->psd[grant->num_psd].high_mhz = v[1];
+			grant->psd[grant->num_psd].max_psd_mbm = eirp;
+			grant->num_psd++;
+		} else if (sscanf(line, "grant_seq=%u", &v[0]) == 1) {
+			grant->grant_seq = v[0];
+		} else if (!strncmp(line, "truncated=1", 11)) {
+			grant->truncated = 1;
+		}
+	}
+
+	return 0;
+}
+
+void afcctrl_grant_free(struct afcctrl_grant *grant)
+{
+	free(grant->chan);
+	free(grant->psd);
+	grant->chan = NULL;
+	grant->psd = NULL;
+	grant->num_chan = 0;
+	grant->num_psd = 0;
+}
+
+struct afcctrl *afcctrl_open(const char *path)
+{
+	static unsigned int count;
+	char local[UNIX_PATH_MAX], dest[UNIX_PATH_MAX];
+	struct afcctrl *ctrl;
+
+	ctrl = zalloc(sizeof(*ctrl));
+	if (!ctrl)
+		return NULL;
+
+	/* one local socket per connection, a process may open several */
+	snprintf(local, sizeof(local), AFCCTRL_SOCKET_PATH "%d_%u", (int)getpid(), count++);
+	snprintf(dest, sizeof(dest), "%s", path ? path : AFCD_SOCKET_PATH);
+	ctrl->ctrl = afc_ctrl_connect(local, dest);
+	if (!ctrl->ctrl) {
+		free(ctrl);
+		return NULL;
+	}
+
+	return ctrl;
+}
+
+void afcctrl_close(struct afcctrl *ctrl)
+{
+	if (!ctrl)
+		return;
+
+	afc_ctrl_disconnect(ctrl->ctrl);
+	free(ctrl);
+}
+
+int afcctrl_fd(struct afcctrl *ctrl)
+{
+	return ctrl->ctrl->soc;
+}
+
+int afcctrl_request(struct afcctrl *ctrl, const char *cmd, afcctrl_reply_cb cb, void *ctx)
+{
+	return afc_ctrl_send_request(ctrl->ctrl, cmd, cb, ctx);
+}
+
+int afcctrl_subscribe(struct afcctrl *ctrl, const char *events, afcctrl_event_cb cb,
+		      void *ctx, afcctrl_reply_cb done)
+{
+	char cmd[64];
+
+	if (events)
+		snprintf(cmd, sizeof(cmd), "ATTACH events=%s", events);
+	else
+		snprintf(cmd, sizeof(cmd), "ATTACH");
+
+	ctrl->event_cb = cb;
+	ctrl->event_ctx = ctx;
+
+	return afc_ctrl_send_request(ctrl->ctrl, cmd, done, ctx);
+}
+
+int afcctrl_unsubscribe(struct afcctrl *ctrl)
+{
+	ctrl->event_cb = NULL;
+	ctrl->event_ctx = NULL;
+
+	return afc_ctrl_send_request(ctrl->ctrl, "DETACH", NULL, NULL);
+}
+
+static void afcctrl_msg(char *msg, size_t len, void *ctx)
+{
+	struct afcctrl *ctrl = ctx;
+	struct afcctrl_event event;
+
+	UNUSED_PARAM(len);
+
+	if (!ctrl->event_cb || msg[0] != '<')
+		return;
+
+	afcctrl_parse_event(msg, &event);
+	ctrl->event_cb(&event, ctrl->event_ctx);
+}
+
+int afcctrl_process(struct afcctrl *ctrl)
+{
+	return afc_ctrl_process(ctrl->ctrl, afcctrl_msg, ctrl);
+}
+
+int afcctrl_wait(struct afcctrl *ctrl, int timeout_sec)
+{
+	return afc_ctrl_wait(ctrl->ctrl, timeout_sec, afcctrl_msg, ctrl);
+}
+
+struct afcctrl_call {
+	int done;
+	int ret;
+	void *out;
+	int (*parse)(struct afcctrl_call *call, const char *reply);
+};
+
+static int afcctrl_call_status(struct afcctrl_call *call, const char *reply)
+{
+	return afcctrl_parse_status(reply, call->out);
+}
+
+static int afcctrl_call_grant(struct afcctrl_call *call, const char *reply)
+{
+	return afcctrl_parse_grant(reply, call->out);
+}
+
+static int afcctrl_call_metrics(struct afcctrl_call *call, const char *reply)
+{
+	return afcctrl_parse_metrics(reply, call->out);
+}
+
+static void afcctrl_call_reply(int status, char *reply, size_t len, void *ctx)
+{
+	struct afcctrl_call *call = ctx;
+
+	UNUSED_PARAM(len);
+
+	call->done = 1;
+	call->ret = status ? status : call->parse(call, reply);
+}
+
+/* other requests in flight complete meanwhile */
+static int afcctrl_call(struct afcctrl *ctrl, const char *cmd, struct afcctrl_call *call)
+{
+	int tag;
+
+	tag = afc_ctrl_send_request(ctrl->ctrl, cmd, afcctrl_call_reply, call);
+	if (tag < 0)
+		return -1;
+
+	while (!call->done) {
+		if (afcctrl_wait(ctrl, AFC_CTRL_REQUEST_TIMEOUT + 1) < 0 && !call->done) {
+			afc_ctrl_cancel(ctrl->ctrl, tag);
+			return -2;
+		}
+	}
+
+	return call->ret;
+}
+
+int afcctrl_get_status(struct afcctrl *ctrl, struct afcctrl_status *status)
+{
+	struct afcctrl_call call = { 0, 0, status, afcctrl_call_status };
+
+	return afcctrl_call(ctrl, "STATUS", &call);
+}
+
+int afcctrl_get_grant(struct afcctrl *ctrl, int op_class, struct afcctrl_grant *grant)
+{
+	struct afcctrl_call call = { 0, 0, grant, afcctrl_call_grant };
+	char cmd[32];
+
+	if (op_class)
+		snprintf(cmd, sizeof(cmd), "GET_GRANT %d", op_class);
+	else
+		snprintf(cmd, sizeof(cmd), "GET_GRANT");
+
+	return afcctrl_call(ctrl, cmd, &call);
+}
+
+int afcctrl_get_metrics(struct afcctrl *ctrl, struct afcctrl_metrics *metrics)
+{
+	struct afcctrl_call call = { 0, 0, metrics, afcctrl_call_metrics };
+
+	return afcctrl_call(ctrl, "GET_METRICS", &call);
+}
@@ -0,0 +1,166 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#ifndef AFCCTRL_H
+#define AFCCTRL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libafcctrl, client library for the afcd control socket.
+ *
+ * Requests are pipelined: afcctrl_request() returns once the request is
+ * sent and its callback runs from afcctrl_process() when the reply is in.
+ * Event loops watch afcctrl_fd() for input and call afcctrl_process(),
+ * tools without one call afcctrl_wait(). Replies are "key=value" lines,
+ * afcctrl_parse_*() decode them. Reply and event buffers are only valid
+ * during the callback.
+ *
+ *	ctrl = afcctrl_open(NULL);
+ *	afcctrl_subscribe(ctrl, "grant", grant_changed, ctx, NULL);
+ *	afcctrl_request(ctrl, "STATUS", status_reply, ctx);
+ *	...
+ *	afcctrl_process(ctrl);	(socket readable)
+ */
+
+struct afcctrl;
+
+enum afcctrl_state {
+	AFCCTRL_STATE_UNKNOWN,
+	AFCCTRL_STATE_NONE, /* no grant yet */
+	AFCCTRL_STATE_EXPIRED,
+	AFCCTRL_STATE_DENIED, /* grant without usable spectrum */
+	AFCCTRL_STATE_GRANTED,
+};
+
+struct afcctrl_status {
+	enum afcctrl_state state;
+	char backend[16];
+	uint32_t grant_seq;
+	char country[4];
+	char rule_set_id[40];
+	uint32_t resp_status;
+	int64_t publish_time; /* seconds since epoch */
+	int64_t expire_time;
+	uint32_t num_chan;
+	uint32_t num_psd;
+	int32_t inquiry_in_flight;
+	int64_t last_success;
+	uint32_t rejected_ifaces; /* interfaces whose driver refused the grant */
+};
+
+struct afcctrl_channel {
+	uint16_t op_class;
+	uint8_t cfi;
+	uint16_t start_mhz;
+	uint16_t end_mhz;
+	int32_t max_eirp_mbm;
+};
+
+struct afcctrl_psd {
+	uint16_t low_mhz;
+	uint16_t high_mhz;
+	int32_t max_psd_mbm;
+};
+
+/* arrays are allocated by afcctrl_parse_grant(), see afcctrl_grant_free() */
+struct afcctrl_grant {
+	uint32_t grant_seq;
+	unsigned int num_chan;
+	struct afcctrl_channel *chan;
+	unsigned int num_psd;
+	struct afcctrl_psd *psd;
+	int truncated;
+};
+
+/* counters of backends afcd was built without stay 0 */
+struct afcctrl_metrics {
+	uint32_t query_requests;
+	uint32_t query_joined;
+	uint32_t query_inquiries;
+	uint32_t query_failures;
+	uint32_t query_deferred;
+	uint32_t query_last_exchange_ms;
+	uint32_t grant_seq;
+	uint64_t eloop_iterations;
+	uint64_t eloop_callbacks;
+	uint64_t eloop_stalls;
+	uint32_t nl80211_tx;
+	uint32_t nl80211_acked;
+	uint32_t nl80211_errors;
+	uint32_t nl80211_timeouts;
+	uint32_t nl80211_send_errors;
+	uint32_t nl80211_ext_ack;
+	uint32_t mock_applied;
+	uint32_t mock_rejected;
+	uint32_t mock_last_n_rules;
+};
+
+enum afcctrl_event_type {
+	AFCCTRL_EVENT_OTHER,
+	AFCCTRL_EVENT_REQUEST_DONE, /* <SPECTRUM_REQUEST_DONE */
+	AFCCTRL_EVENT_GRANT_UPDATED, /* <GRANT_UPDATED */
+	AFCCTRL_EVENT_GRANT_EXPIRING, /* <GRANT_EXPIRING */
+	AFCCTRL_EVENT_INQUIRY_STARTED, /* <INQUIRY_STARTED */
+	AFCCTRL_EVENT_INQUIRY_FAILED, /* <INQUIRY_FAILED */
+	AFCCTRL_EVENT_GRANT_REJECTED, /* <GRANT_REJECTED */
+};
+
+struct afcctrl_event {
+	enum afcctrl_event_type type;
+	uint32_t id;
+	uint32_t inquiry;
+	int32_t status; /* 0 on success */
+	uint32_t queue_ms;
+	uint32_t exchange_ms;
+	uint32_t grant_seq;
+	int64_t expire_time;
+	uint32_t remaining_sec; /* until expire_time */
+	uint32_t requests; /* served by the inquiry */
+	uint32_t retry_sec; /* until the failed inquiry is retried */
+	uint32_t ifaces; /* refusing the grant */
+	const char *raw;
+};
+
+/* status 0 with the reply, -1 if the connection closed, -2 on timeout */
+typedef void (*afcctrl_reply_cb)(int status, char *reply, size_t len, void *ctx);
+typedef void (*afcctrl_event_cb)(const struct afcctrl_event *event, void *ctx);
+
+/* path NULL for the default afcd socket */
+struct afcctrl *afcctrl_open(const char *path);
+void afcctrl_close(struct afcctrl *ctrl);
+int afcctrl_fd(struct afcctrl *ctrl);
+
+/* returns the request tag, -1 on error (errno EAGAIN if the socket is full) */
+int afcctrl_request(struct afcctrl *ctrl, const char *cmd, afcctrl_reply_cb cb, void *ctx);
+/* events NULL for all classes, else a comma separated list of "grant",
+"request" and "inquiry";
+done reports the ATTACH reply and may be NULL */
+int afcctrl_subscribe(struct afcctrl *ctrl, const char *events, afcctrl_event_cb cb,
+		      void *ctx, afcctrl_reply_cb done);
+int afcctrl_unsubscribe(struct afcctrl *ctrl);
+/* handles whatever has arrived without blocking, returns the number of
+messages or -1 */
+int afcctrl_process(struct afcctrl *ctrl);
+/* blocks until no request is in flight, -2 on timeout */
+int afcctrl_wait(struct afcctrl *ctrl, int timeout_sec);
+
+/* decoders return 0, or -1 for a FAIL reply */
+int afcctrl_parse_status(const char *reply, struct afcctrl_status *status);
+int afcctrl_parse_grant(const char *reply, struct afcctrl_grant *grant);
+void afcctrl_grant_free(struct afcctrl_grant *grant);
+int afcctrl_parse_metrics(const char *reply, struct afcctrl_metrics *metrics);
+int afcctrl_parse_event(const char *msg, struct afcctrl_event *event);
+
+/* blocking helpers, op_class 0 for the whole grant */
+int afcctrl_get_status(struct afcctrl *ctrl, struct afcctrl_status *status);
+int afcctrl_get_grant(struct afcctrl *ctrl, int op_class, struct afcctrl_grant *grant);
+int afcctrl_get_metrics(struct afcctrl *ctrl, struct afcctrl_metrics *metrics);
+
+#endif /* AFCCTRL_H */
@@ -7,16 +7,275 @@ this software module.
 
 *******************************************************************************/
 
-#include <sys/stat.h>
+#include <poll.h>
 #include "eloop.h"
-#include "afc_debug.h"
 #include "ctrl.h"
 
+static const struct {
+	const char *name;
+	unsigned int mask;
+} afc_ctrl_events[] = {
+	{ "request", AFC_CTRL_EVENT_REQUEST },
+	{ "grant", AFC_CTRL_EVENT_GRANT },
+	{ "inquiry", AFC_CTRL_EVENT_INQUIRY },
+	{ "all", AFC_CTRL_EVENT_ALL },
+};
+
+unsigned int afc_ctrl_event_mask(const char *names)
+{
+	unsigned int mask = 0;
+	size_t i, len;
+
+	while (*names) {
+		len = strcspn(names, ",");
+		for (i = 0; i < sizeof(afc_ctrl_events) / sizeof(afc_ctrl_events[0]); i++) {
+			if (strlen(afc_ctrl_events[i].name) == len &&
+			    !strncmp(afc_ctrl_events[i].name, names, len))
+				break;
+		}
+		if (i == sizeof(afc_ctrl_events) / sizeof(afc_ctrl_events[0]))
+			return 0;
+		mask |= afc_ctrl_events[i].mask;
+		names += len;
+		if (*names == ',')
+			names++;
+	}
+
+	return mask;
+}
+
+int afc_ctrl_reply_failed(const char *reply)
+{
+	return !strncmp(reply, "FAIL", 4) || !strncmp(reply, "Invalid", 7) ||
+	       !strncmp(reply, "RETRY", 5);
+}
+
+static int afc_ctrl_wait_chunk(int sock)
+{
+	struct timeval tv;
+	fd_set rfds;
+	int res;
+
+	for (;;) {
+		tv.tv_sec = AFC_CTRL_CHUNK_TIMEOUT_MS / 1000;
+		tv.tv_usec = (AFC_CTRL_CHUNK_TIMEOUT_MS % 1000) * 1000;
+		FD_ZERO(&rfds);
+		FD_SET(sock, &rfds);
+		res = select(sock + 1, &rfds, NULL, NULL, &tv);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0)
+			return res;
+		return res ? 0 : -2;
+	}
+}
+
+int afc_ctrl_recv_msg(int sock, char *buf, size_t size,
+		      struct sockaddr_storage *from, socklen_t *fromlen)
+{
+	struct msghdr mh;
+	struct iovec iov[2];
+	size_t len;
+	char mark;
+	int res;
+
+	res = recvfrom(sock, buf, size, MSG_DONTWAIT, (struct sockaddr *)from, fromlen);
+	if (res <= 0 || buf[0] != AFC_CTRL_CHUNK_MORE)
+		return res;
+
+	len = res - 1;
+	memmove(buf, buf + 1, len);
+
+	/* the marker goes to its own iovec, the payload lands in place */
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
+	iov[0].iov_base = &mark;
+	iov[0].iov_len = 1;
+
+	for (;;) {
+		iov[1].iov_base = buf + len;
+		iov[1].iov_len = size - len;
+		res = recvmsg(sock, &mh, MSG_DONTWAIT);
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			res = afc_ctrl_wait_chunk(sock);
+			if (res < 0)
+				return res;
+			continue;
+		}
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -1;
+		if (mark != AFC_CTRL_CHUNK_MORE && mark != AFC_CTRL_CHUNK_LAST)
+			return -1;
+		len += res - 1;
+		if (mark == AFC_CTRL_CHUNK_LAST)
+			break;
+	}
+
+	return len;
+}
+
+struct afc_ctrl_pending_req {
+	struct dl_list list;
+	unsigned int tag;
+	afc_ctrl_reply_cb cb;
+	void *ctx;
+	struct reltime sent;
+};
+
+int afc_ctrl_send_request(struct afc_ctrl *ctrl, const char *cmd,
+			  afc_ctrl_reply_cb cb, void *ctx)
+{
+	struct afc_ctrl_pending_req *req;
+	char msg[256];
+	int len;
+
+	/* tags stay positive to be returned as int */
+	if (++ctrl->next_tag > 0x7fffffff)
+		ctrl->next_tag = 1;
+
+	len = snprintf(msg, sizeof(msg), "%c%u %s", AFC_CTRL_TAG, ctrl->next_tag, cmd);
+	if (len < 0 || len >= (int)sizeof(msg)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	req = zalloc(sizeof(*req));
+	if (!req)
+		return -1;
+
+	if (send(ctrl->soc, msg, len, MSG_DONTWAIT) < 0) {
+		free(req);
+		return -1;
+	}
+
+	req->tag = ctrl->next_tag;
+	req->cb = cb;
+	req->ctx = ctx;
+	get_reltime(&req->sent);
+	dl_list_add_tail(&ctrl->pending, &req->list);
+
+	return req->tag;
+}
+
+static void afc_ctrl_complete(struct afc_ctrl_pending_req *req, int status,
+			      char *reply, size_t len)
+{
+	dl_list_del(&req->list);
+	if (req->cb)
+		req->cb(status, reply, len, req->ctx);
+	free(req);
+}
+
+/* msg is a nul terminated tagged reply */
+static void afc_ctrl_dispatch(struct afc_ctrl *ctrl, char *msg, size_t len)
+{
+	struct afc_ctrl_pending_req *req;
+	unsigned long tag;
+	char *end;
+
+	tag = strtoul(msg + 1, &end, 10);
+	if (*end != ' ')
+		return;
+	end++;
+
+	dl_list_for_each(req, &ctrl->pending, struct afc_ctrl_pending_req, list) {
+		if (req->tag == tag) {
+			afc_ctrl_complete(req, 0, end, len - (end - msg));
+			return;
+		}
+	}
+	/* late reply of an expired request */
+}
+
+int afc_ctrl_process(struct afc_ctrl *ctrl, afc_ctrl_msg_cb msg_cb, void *ctx)
+{
+	struct afc_ctrl_pending_req *req, *next;
+	struct reltime now;
+	int res, count = 0;
+
+	if (!ctrl->rbuf) {
+		ctrl->rbuf = malloc(AFC_CTRL_MSG_MAX);
+		if (!ctrl->rbuf)
+			return -1;
+	}
+
+	for (;;) {
+		res = afc_ctrl_recv_msg(ctrl->soc, ctrl->rbuf, AFC_CTRL_MSG_MAX - 1, NULL, NULL);
+		if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (res < 0)
+			return res;
+		ctrl->rbuf[res] = '\0';
+		count++;
+		if (ctrl->rbuf[0] == AFC_CTRL_TAG)
+			afc_ctrl_dispatch(ctrl, ctrl->rbuf, res);
+		else if (msg_cb)
+			msg_cb(ctrl->rbuf, res, ctx);
+	}
+
+	get_reltime(&now);
+	dl_list_for_each_safe(req, next, &ctrl->pending, struct afc_ctrl_pending_req, list) {
+		if (reltime_expired(&now, &req->sent, AFC_CTRL_REQUEST_TIMEOUT))
+			afc_ctrl_complete(req, -2, NULL, 0);
+	}
+
+	return count;
+}
+
+int afc_ctrl_pending(struct afc_ctrl *ctrl)
+{
+	return dl_list_len(&ctrl->pending);
+}
+
+void afc_ctrl_cancel(struct afc_ctrl *ctrl, int tag)
+{
+	struct afc_ctrl_pending_req *req;
+
+	dl_list_for_each(req, &ctrl->pending, struct afc_ctrl_pending_req, list) {
+		if (req->tag == (unsigned int)tag) {
+			dl_list_del(&req->list);
+			free(req);
+			return;
+		}
+	}
+}
+
+int afc_ctrl_wait(struct afc_ctrl *ctrl, int timeout_sec,
+		  afc_ctrl_msg_cb msg_cb, void *ctx)
+{
+	struct reltime start, now;
+	struct pollfd pfd;
+	int res;
+
+	get_reltime(&start);
+	while (!dl_list_empty(&ctrl->pending)) {
+		get_reltime(&now);
+		if (reltime_expired(&now, &start, timeout_sec))
+			return -2;
+		pfd.fd = ctrl->soc;
+		pfd.events = POLLIN;
+		res = poll(&pfd, 1, 1000);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0)
+			return res;
+		/* also runs on poll timeouts to expire requests */
+		if (afc_ctrl_process(ctrl, msg_cb, ctx) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
 int afc_ctrl_request(struct afc_ctrl *ctrl, const char *cmd, size_t cmd_len,
 		     char *reply, size_t *reply_len,
 		     void (*msg_cb)(char *msg, size_t len))
 {
 	struct reltime started_at;
+	struct pollfd pfd;
 	struct timeval tv;
 	fd_set rfds;
 	int res;
@@ -42,7 +301,10 @@ retry_send:
 				if (reltime_expired(&n, &started_at, 5))
 					goto send_err;
 			}
-			sleep(1);
+			/* wait for room at the peer rather than sleeping */
+			pfd.fd = ctrl->soc;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, 1000);
 			goto retry_send;
 		}
 		if (errno == ENOTCONN || errno == ECONNREFUSED) {
@@ -63,9 +325,17 @@ retry_send:
 		if (res < 0)
 			return res;
 		if (FD_ISSET(ctrl->soc, &rfds)) {
-			res = recv(ctrl->soc, reply, *reply_len, 0);
+			res = afc_ctrl_recv_msg(ctrl->soc, reply, *reply_len, NULL, NULL);
 			if (res < 0)
 				return res;
+			if (res > 0 && reply[0] == AFC_CTRL_TAG) {
+				/* reply to a pipelined request in flight */
+				if ((size_t) res == *reply_len)
+					res = (*reply_len) - 1;
+				reply[res] = '\0';
+				afc_ctrl_dispatch(ctrl, reply, res);
+				continue;
+			}
 			if (res > 0 && reply[0] == '<') {
 				/* This is an unsolicited message from
 				 * afcd, not the reply to the request.
@@ -91,6 +361,41 @@ retry_send:
 	return 0;
 }
 
+int afc_ctrl_wait_event(struct afc_ctrl *ctrl, const char *prefix,
+			char *buf, size_t *len, int timeout_sec)
+{
+	struct reltime start, now;
+	struct timeval tv;
+	fd_set rfds;
+	int res;
+
+	get_reltime(&start);
+	for (;;) {
+		get_reltime(&now);
+		if (reltime_expired(&now, &start, timeout_sec))
+			return -2;
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		FD_ZERO(&rfds);
+		FD_SET(ctrl->soc, &rfds);
+		res = select(ctrl->soc + 1, &rfds, NULL, NULL, &tv);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0)
+			return res;
+		if (!res)
+			continue;
+		res = afc_ctrl_recv_msg(ctrl->soc, buf, *len - 1, NULL, NULL);
+		if (res < 0)
+			return res;
+		buf[res] = '\0';
+		if (!strncmp(buf, prefix, strlen(prefix))) {
+			*len = res;
+			return 0;
+		}
+	}
+}
+
 struct afc_ctrl *afc_ctrl_connect(char *src_path, char *dest_path)
 {
 	struct afc_ctrl *ctrl;
@@ -103,6 +408,7 @@ struct afc_ctrl *afc_ctrl_connect(char *src_path, char *dest_path)
 	ctrl = zalloc(sizeof(*ctrl));
 	if (!ctrl)
 		return NULL;
+	dl_list_init(&ctrl->pending);
 
 	ctrl->local.sun_family = AF_UNIX;
 	snprintf(ctrl->local.sun_path, UNIX_PATH_MAX - 1, "%s", src_path);
@@ -156,66 +462,19 @@ fail:
 
 void afc_ctrl_disconnect(struct afc_ctrl *ctrl)
 {
+	struct afc_ctrl_pending_req *req;
+
 	if (!ctrl)
 		return;
 
+	while (!dl_list_empty(&ctrl->pending)) {
+		req = dl_list_first(&ctrl->pending, struct afc_ctrl_pending_req, list);
+		afc_ctrl_complete(req, -1, NULL, 0);
+	}
+	free(ctrl->rbuf);
+
         unlink(ctrl->local.sun_path);
         if (ctrl->soc >= 0)
                 close(ctrl->soc);
         free(ctrl);
 }
-
-int afc_ctrl_iface_init(int *cli_sock, struct sockaddr_un *cli_addr, char *src_path)
-{
-	int len, try_cnt = 0;
-
-	*cli_sock = socket(PF_UNIX, SOCK_DGRAM, 0);
-	if (*cli_sock < 0) {
-		afc_printf(MSG_ERROR, "failed to create control socket");
-		return -1;
-	}
-
-	memset(cli_addr, 0, sizeof(*cli_addr));
-	cli_addr->sun_family = AF_UNIX;
-	len = snprintf(cli_addr->sun_path, sizeof(cli_addr->sun_path), "%s", src_path);
-	if (len < 0 || len >= (int)sizeof(cli_addr->sun_path))
-		goto fail;;
-
-try_again:
-	if (bind(*cli_sock, (struct sockaddr *)cli_addr, sizeof(*cli_addr)) < 0) {
-		afc_printf(MSG_ERROR, "control interface bind failed: %s", strerror(errno));
-
-		unlink(cli_addr->sun_path);
-
-		if (try_cnt++ > MAX_BIND_RETRY_CNT)
-			goto fail;
-
-		goto try_again;
-	}
-
-	afc_printf(MSG_ERROR, "control interface bind success");
-
-	if (chmod(cli_addr->sun_path, S_IRWXU | S_IRWXG) < 0) {
-		afc_printf(MSG_ERROR, "chmod ctrl_iface failed: %s", strerror(errno));
-		goto fail;
-	}
-
-	return 0;
-fail:
-	unlink(cli_addr->sun_path);
-	if (*cli_sock >= 0)
-		close(*cli_sock);
-	*cli_sock = -1;
-
-	return -1;
-}
-
-void afc_ctrl_iface_deinit(int *cli_sock, char *src_path)
-{
-	if (*cli_sock < 0)
-		return;
-
-	unlink(src_path);
-	close(*cli_sock);
-	*cli_sock = 0;
-}
\ No newline at end of file
@@ -20,26 +20,77 @@ this software module.
 
 #define DEFAULT_CTRL_WAIT_MSG_TIMEOUT 90
 #define REPLY_LEN 4096
+/* largest message reassembled from chunks, datagrams stay at REPLY_LEN */
+#define AFC_CTRL_MSG_MAX (64 * 1024)
+/* a message longer than REPLY_LEN, or one starting with AFC_CTRL_CHUNK_MORE,
+is sent as chunks: every chunk carries AFC_CTRL_CHUNK_MORE as first byte
+except the last one, which carries AFC_CTRL_CHUNK_LAST */
+#define AFC_CTRL_CHUNK_MORE '+'
+#define AFC_CTRL_CHUNK_LAST '$'
+/* chunks of a message are sent back to back, a missing one is an error */
+#define AFC_CTRL_CHUNK_TIMEOUT_MS 1000
 #define MAX_BIND_RETRY_CNT 5
+/* pipelined requests are sent as "#<tag> <command>" and answered with
+"#<tag> <reply>", tags are decimal and chosen by the client */
+#define AFC_CTRL_TAG '#'
+#define AFC_CTRL_TAG_MAX 11
+/* pipelined requests without a reply by then complete with -2 */
+#define AFC_CTRL_REQUEST_TIMEOUT 15
 
 struct afc_ctrl
 {
 	int soc;
 	struct sockaddr_un local;
 	struct sockaddr_un dest;
+	struct dl_list pending; /* pipelined requests waiting for their reply */
+	unsigned int next_tag;
+	char *rbuf; /* AFC_CTRL_MSG_MAX, allocated on first use */
 };
 
-struct ctrl_client {
-	struct dl_list list;
-	struct sockaddr_storage addr;
-	socklen_t addrlen;
-	unsigned char errors;
-};
+/* completion of a pipelined request: status 0 with the reply, the tag is
+stripped and the reply nul terminated; -1 if the connection is closed,
+-2 on timeout */
+typedef void (*afc_ctrl_reply_cb)(int status, char *reply, size_t len, void *ctx);
+/* unsolicited message, nul terminated */
+typedef void (*afc_ctrl_msg_cb)(char *msg, size_t len, void *ctx);
+
+/* event classes, a monitor picks them with "ATTACH events=grant,request" */
+#define AFC_CTRL_EVENT_REQUEST 0x1 /* <SPECTRUM_REQUEST_DONE */
+#define AFC_CTRL_EVENT_GRANT 0x2 /* <GRANT_UPDATED, <GRANT_EXPIRING, <GRANT_REJECTED */
+#define AFC_CTRL_EVENT_INQUIRY 0x4 /* <INQUIRY_STARTED, <INQUIRY_FAILED */
+#define AFC_CTRL_EVENT_ALL (AFC_CTRL_EVENT_REQUEST | AFC_CTRL_EVENT_GRANT | AFC_CTRL_EVENT_INQUIRY)
+/* afcd's replies for rejected commands start with FAIL (also FAILURE),
+Invalid or RETRY */
+int afc_ctrl_reply_failed(const char *reply);
+/* "grant,request,inquiry" or "all" to an AFC_CTRL_EVENT_* mask, 0 if a name is unknown */
+unsigned int afc_ctrl_event_mask(const char *names);
 
+/* receives one message and reassembles it if chunked, whatever does not
+fit in size is dropped. does not wait for the first datagram. returns the
+length, -1 on error (errno EAGAIN if nothing is queued), -2 if a chunk
+does not arrive in time */
+int afc_ctrl_recv_msg(int sock, char *buf, size_t size,
+		      struct sockaddr_storage *from, socklen_t *fromlen);
+/* Pipelining: afc_ctrl_send_request() sends a tagged request without
+waiting, any number can be in flight on one connection. afc_ctrl_process()
+reads whatever has arrived without blocking, completes requests by tag and
+hands unsolicited messages to msg_cb; eloop based callers run it from a
+read handler on ctrl->soc. afc_ctrl_wait() blocks until every request
+completed. Returns the tag, or -1 with errno EAGAIN if the socket is full */
+int afc_ctrl_send_request(struct afc_ctrl *ctrl, const char *cmd,
+			  afc_ctrl_reply_cb cb, void *ctx);
+int afc_ctrl_process(struct afc_ctrl *ctrl, afc_ctrl_msg_cb msg_cb, void *ctx);
+int afc_ctrl_pending(struct afc_ctrl *ctrl);
+/* drops a request in flight, its callback is not called */
+void afc_ctrl_cancel(struct afc_ctrl *ctrl, int tag);
+int afc_ctrl_wait(struct afc_ctrl *ctrl, int timeout_sec,
+		  afc_ctrl_msg_cb msg_cb, void *ctx);
 int afc_ctrl_request(struct afc_ctrl *ctrl, const char *cmd, size_t cmd_len,
 		     char *reply, size_t *reply_len,
 		     void (*msg_cb)(char *msg, size_t len));
+/* waits for an unsolicited message starting with prefix, others are dropped,
+returns -2 on timeout */
+int afc_ctrl_wait_event(struct afc_ctrl *ctrl, const char *prefix,
+			char *buf, size_t *len, int timeout_sec);
 struct afc_ctrl *afc_ctrl_connect(char *src_path, char *dest_path);
 void afc_ctrl_disconnect(struct afc_ctrl *ctrl);
-int afc_ctrl_iface_init(int *cli_sock, struct sockaddr_un *cli_addr, char *src_path);
-void afc_ctrl_iface_deinit(int *cli_sock, char *src_path);
\ No newline at end of file
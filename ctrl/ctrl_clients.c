@@ -0,0 +1,530 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#define _GNU_SOURCE /* sendmmsg */
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "afc.h"
+#include "eloop.h"
+#include "ctrl.h"
+#include "ctrl_clients.h"
+
+/* event or reply datagram waiting in a client queue */
+struct ctrl_event {
+	struct dl_list list;
+	int reply; /* a chunk of a reply is never dropped alone */
+	size_t len;
+	char msg[];
+};
+
+static void afc_ctrl_iface_flush(void *eloop_ctx, void *user_ctx);
+static void afc_ctrl_clients_check(void *eloop_ctx, void *user_ctx);
+
+/* FNV-1a over the socket path */
+static uint32_t afc_ctrl_client_key(const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+	const struct sockaddr_un *un = (const struct sockaddr_un *)addr;
+	const unsigned char *path = (const unsigned char *)un->sun_path;
+	size_t idx, len;
+	uint32_t key = 2166136261u;
+
+	len = addrlen > offsetof(struct sockaddr_un, sun_path) ?
+	      addrlen - offsetof(struct sockaddr_un, sun_path) : 0;
+	for (idx = 0; idx < len; idx++) {
+		key ^= path[idx];
+		key *= 16777619u;
+	}
+
+	return key;
+}
+
+static struct dl_list *afc_ctrl_client_bucket(struct afc_ctrl_iface *iface, uint32_t key)
+{
+	return &iface->buckets[key & (AFC_CTRL_CLIENT_BUCKETS - 1)];
+}
+
+void afc_ctrl_clients_init(struct afc_ctrl_iface *iface)
+{
+	int idx;
+
+	dl_list_init(&iface->clients);
+	for (idx = 0; idx < AFC_CTRL_CLIENT_BUCKETS; idx++)
+		dl_list_init(&iface->buckets[idx]);
+	iface->num_clients = 0;
+}
+
+static void afc_ctrl_client_free(struct afc_ctrl_iface *iface, struct ctrl_client *dst)
+{
+	struct ctrl_event *ev, *next;
+
+	dl_list_for_each_safe(ev, next, &dst->queue, struct ctrl_event, list) {
+		dl_list_del(&ev->list);
+		free(ev);
+	}
+	dl_list_del(&dst->list);
+	dl_list_del(&dst->hash);
+	iface->num_clients--;
+	free(dst);
+}
+
+void afc_ctrl_clients_deinit(struct afc_ctrl_iface *iface)
+{
+	struct ctrl_client *dst, *next;
+
+	eloop_cancel_timeout(afc_ctrl_iface_flush, iface, NULL);
+	eloop_cancel_timeout(afc_ctrl_clients_check, iface, NULL);
+	dl_list_for_each_safe(dst, next, &iface->clients, struct ctrl_client, list)
+		afc_ctrl_client_free(iface, dst);
+}
+
+struct ctrl_client *afc_ctrl_client_find(struct afc_ctrl_iface *iface,
+					 const struct sockaddr_storage *from, socklen_t fromlen)
+{
+	struct ctrl_client *dst;
+	const struct sockaddr_un *a, *b;
+	uint32_t key = afc_ctrl_client_key(from, fromlen);
+
+	a = (const struct sockaddr_un *)from;
+	dl_list_for_each(dst, afc_ctrl_client_bucket(iface, key), struct ctrl_client, hash) {
+		b = (const struct sockaddr_un *)&dst->addr;
+		if (dst->key == key && fromlen == dst->addrlen &&
+		    !memcmp(a->sun_path, b->sun_path, fromlen - offsetof(struct sockaddr_un, sun_path)))
+			return dst;
+	}
+
+	return NULL;
+}
+
+/* clients without events are requesters whose replies are backlogged,
+they are removed once the backlog is sent */
+static struct ctrl_client *afc_ctrl_client_get(struct afc_ctrl_iface *iface,
+					       const struct sockaddr_storage *from,
+					       socklen_t fromlen)
+{
+	struct ctrl_client *dst;
+
+	/* unnamed sockets cannot be sent to */
+	if (fromlen <= offsetof(struct sockaddr_un, sun_path))
+		return NULL;
+
+	dst = afc_ctrl_client_find(iface, from, fromlen);
+	if (dst)
+		return dst;
+
+	dst = zalloc(sizeof(*dst));
+	if (dst == NULL)
+		return NULL;
+	memcpy(&dst->addr, from, fromlen);
+	dst->addrlen = fromlen;
+	dst->key = afc_ctrl_client_key(from, fromlen);
+	dl_list_init(&dst->queue);
+	get_reltime(&dst->last_sent);
+	dl_list_add(&iface->clients, &dst->list);
+	dl_list_add(afc_ctrl_client_bucket(iface, dst->key), &dst->hash);
+	iface->num_clients++;
+	if (!eloop_is_timeout_registered(afc_ctrl_clients_check, iface, NULL))
+		eloop_register_timeout(AFC_CTRL_CLIENT_CHECK_SEC, 0,
+				       afc_ctrl_clients_check, iface, NULL);
+
+	return dst;
+}
+
+int afc_ctrl_client_attach(struct afc_ctrl_iface *iface, const struct sockaddr_storage *from,
+			   socklen_t fromlen, unsigned int events)
+{
+	struct ctrl_client *dst;
+
+	dst = afc_ctrl_client_get(iface, from, fromlen);
+	if (dst == NULL)
+		return -1;
+	dst->events = events;
+
+	return 0;
+}
+
+/* replies still queued for the client go out first */
+void afc_ctrl_client_detach(struct afc_ctrl_iface *iface, const struct sockaddr_storage *from,
+			    socklen_t fromlen)
+{
+	struct ctrl_client *dst;
+
+	dst = afc_ctrl_client_find(iface, from, fromlen);
+	if (dst == NULL)
+		return;
+
+	dst->events = 0;
+	if (!dst->queue_len)
+		afc_ctrl_client_free(iface, dst);
+}
+
+/* monitors exit without DETACH, their socket file goes away with them;
+a monitor that stopped reading keeps its events queued. a queue counts as
+stuck once it has been non-empty for AFC_CTRL_CLIENT_STALL_SEC with
+nothing sent meanwhile */
+static void afc_ctrl_clients_check(void *eloop_ctx, void *user_ctx)
+{
+	struct afc_ctrl_iface *iface = eloop_ctx;
+	struct ctrl_client *dst, *next;
+	struct sockaddr_un *un;
+	struct reltime now;
+	struct stat st;
+
+	UNUSED_PARAM(user_ctx);
+
+	get_reltime(&now);
+	dl_list_for_each_safe(dst, next, &iface->clients, struct ctrl_client, list) {
+		un = (struct sockaddr_un *)&dst->addr;
+		/* abstract addresses have no file */
+		if (un->sun_path[0] && stat(un->sun_path, &st) < 0 && errno == ENOENT) {
+			afc_printf(MSG_DEBUG, "CTRL_IFACE client %s is gone", un->sun_path);
+			afc_ctrl_client_free(iface, dst);
+		} else if (dst->queue_len &&
+			   reltime_expired(&now, &dst->queued_since, AFC_CTRL_CLIENT_STALL_SEC) &&
+			   reltime_expired(&now, &dst->last_sent, AFC_CTRL_CLIENT_STALL_SEC)) {
+			afc_printf(MSG_INFO, "CTRL_IFACE client %s stalled with %u events queued",
+				   un->sun_path, dst->queue_len);
+			afc_ctrl_client_free(iface, dst);
+		}
+	}
+
+	if (iface->num_clients)
+		eloop_register_timeout(AFC_CTRL_CLIENT_CHECK_SEC, 0, afc_ctrl_clients_check, iface, NULL);
+}
+
+static int afc_ctrl_would_block(int err)
+{
+	return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS;
+}
+
+static int afc_ctrl_client_queue_msg(struct ctrl_client *dst, int reply,
+				     const char *mark, const char *buf, size_t len)
+{
+	struct ctrl_event *ev;
+	size_t mark_len = mark ? 1 : 0;
+
+	ev = malloc(sizeof(*ev) + mark_len + len);
+	if (!ev) {
+		dst->dropped++;
+		return -1;
+	}
+	if (mark)
+		ev->msg[0] = *mark;
+	memcpy(ev->msg + mark_len, buf, len);
+	ev->len = mark_len + len;
+	ev->reply = reply;
+	if (!dst->queue_len)
+		get_reltime(&dst->queued_since);
+	dl_list_add_tail(&dst->queue, &ev->list);
+	dst->queue_len++;
+
+	return 0;
+}
+
+/* a full queue drops its oldest event, the monitor sees a gap rather than
+holding up the daemon */
+static void afc_ctrl_client_queue(struct ctrl_client *dst, const char *buf, size_t len)
+{
+	struct ctrl_event *ev;
+
+	if (dst->queue_len >= AFC_CTRL_CLIENT_QUEUE_LEN) {
+		dl_list_for_each(ev, &dst->queue, struct ctrl_event, list) {
+			if (!ev->reply)
+				break;
+		}
+		dst->dropped++;
+		/* nothing but replies queued, the new event goes */
+		if (&ev->list == &dst->queue)
+			return;
+		dl_list_del(&ev->list);
+		free(ev);
+		dst->queue_len--;
+	}
+
+	afc_ctrl_client_queue_msg(dst, 0, NULL, buf, len);
+}
+
+static void afc_ctrl_client_sent(struct ctrl_client *dst, struct reltime *now)
+{
+	dst->errors = 0;
+	dst->last_sent = *now;
+}
+
+/* returns 1 if the client was removed */
+static int afc_ctrl_client_error(struct afc_ctrl_iface *iface, struct ctrl_client *dst, int err)
+{
+	afc_printf(MSG_DEBUG, "CTRL_IFACE sendto failed: %s", strerror(err));
+	dst->errors++;
+	if (dst->errors > 10 || err == ENOENT || err == ECONNREFUSED) {
+		afc_ctrl_client_free(iface, dst);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void afc_ctrl_iface_schedule_flush(struct afc_ctrl_iface *iface)
+{
+	if (!eloop_is_timeout_registered(afc_ctrl_iface_flush, iface, NULL))
+		eloop_register_timeout(0, AFC_CTRL_FLUSH_MS * 1000, afc_ctrl_iface_flush, iface, NULL);
+}
+
+static void afc_ctrl_iface_flush(void *eloop_ctx, void *user_ctx)
+{
+	struct afc_ctrl_iface *iface = eloop_ctx;
+	struct ctrl_client *dst, *next;
+	struct ctrl_event *ev;
+	struct reltime now;
+	int res, err, removed, pending = 0;
+
+	UNUSED_PARAM(user_ctx);
+
+	get_reltime(&now);
+	dl_list_for_each_safe(dst, next, &iface->clients, struct ctrl_client, list) {
+		removed = 0;
+		while (!dl_list_empty(&dst->queue)) {
+			ev = dl_list_first(&dst->queue, struct ctrl_event, list);
+			res = sendto(iface->sock, ev->msg, ev->len, MSG_DONTWAIT,
+				     (struct sockaddr *)&dst->addr, dst->addrlen);
+			err = errno;
+			if (res < 0 && afc_ctrl_would_block(err)) {
+				pending = 1;
+				break;
+			}
+			dl_list_del(&ev->list);
+			free(ev);
+			dst->queue_len--;
+			if (res >= 0)
+				afc_ctrl_client_sent(dst, &now);
+			else if ((removed = afc_ctrl_client_error(iface, dst, err)))
+				break;
+		}
+		if (!removed && !dst->events && !dst->queue_len)
+			afc_ctrl_client_free(iface, dst);
+	}
+
+	if (pending)
+		afc_ctrl_iface_schedule_flush(iface);
+}
+
+/* sends to a batch of clients, returns 1 if some had to queue the event */
+static int afc_ctrl_iface_send_batch(struct afc_ctrl_iface *iface, struct mmsghdr *msgs,
+				     struct ctrl_client **batch, int num,
+				     const char *buf, size_t len)
+{
+	int idx = 0, sent, queued = 0;
+	struct reltime now;
+
+	get_reltime(&now);
+	while (idx < num) {
+		sent = sendmmsg(iface->sock, &msgs[idx], num - idx, MSG_DONTWAIT);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent > 0) {
+			while (sent--)
+				afc_ctrl_client_sent(batch[idx++], &now);
+			continue;
+		}
+		/* msgs[idx] failed, the ones after it are tried again */
+		if (sent < 0 && afc_ctrl_would_block(errno)) {
+			afc_ctrl_client_queue(batch[idx], buf, len);
+			queued = 1;
+		} else {
+			afc_ctrl_client_error(iface, batch[idx], sent < 0 ? errno : EIO);
+		}
+		idx++;
+	}
+
+	return queued;
+}
+
+/* events fit one datagram and go out with sendmmsg to the monitors
+subscribed to the class, never blocking: a monitor whose socket is full
+gets the event queued and retried from a timer */
+void afc_ctrl_iface_send(struct afc_ctrl_iface *iface, unsigned int event,
+			 const char *buf, size_t len)
+{
+	struct mmsghdr msgs[AFC_CTRL_SEND_BATCH];
+	struct ctrl_client *batch[AFC_CTRL_SEND_BATCH];
+	struct ctrl_client *dst, *next;
+	struct iovec iov;
+	int num = 0, queued = 0;
+
+	if (len > REPLY_LEN)
+		len = REPLY_LEN;
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+
+	dl_list_for_each_safe(dst, next, &iface->clients, struct ctrl_client, list) {
+		if (!(dst->events & event))
+			continue;
+		/* behind the events already waiting for this client */
+		if (dst->queue_len) {
+			afc_ctrl_client_queue(dst, buf, len);
+			queued = 1;
+			continue;
+		}
+		memset(&msgs[num], 0, sizeof(msgs[num]));
+		msgs[num].msg_hdr.msg_name = &dst->addr;
+		msgs[num].msg_hdr.msg_namelen = dst->addrlen;
+		msgs[num].msg_hdr.msg_iov = &iov;
+		msgs[num].msg_hdr.msg_iovlen = 1;
+		batch[num++] = dst;
+		if (num == AFC_CTRL_SEND_BATCH) {
+			queued |= afc_ctrl_iface_send_batch(iface, msgs, batch, num, buf, len);
+			num = 0;
+		}
+	}
+	if (num)
+		queued |= afc_ctrl_iface_send_batch(iface, msgs, batch, num, buf, len);
+
+	if (queued)
+		afc_ctrl_iface_schedule_flush(iface);
+}
+
+/* replies go out like events: a datagram that does not fit the client's
+socket is queued with the rest of the reply and retried from the flush
+timer, so a client that keeps requests in flight without reading cannot
+block afcd. A reply finding AFC_CTRL_CLIENT_QUEUE_LEN datagrams queued
+is dropped, the client times the request out. chunk framing is described
+in ctrl.h */
+int afc_ctrl_iface_reply(struct afc_ctrl_iface *iface, const char *msg, size_t len,
+			 const struct sockaddr_storage *to, socklen_t tolen)
+{
+	struct ctrl_client *dst;
+	struct msghdr mh;
+	struct iovec iov[2];
+	size_t chunk, count;
+	int chunked, first = 1;
+	char mark = AFC_CTRL_CHUNK_LAST;
+
+	chunked = len > REPLY_LEN || (len && msg[0] == AFC_CTRL_CHUNK_MORE);
+	count = chunked ? (len + REPLY_LEN - 2) / (REPLY_LEN - 1) : 1;
+	if (chunked && count < 2)
+		count = 2;
+
+	/* behind the datagrams already waiting for this client */
+	dst = afc_ctrl_client_find(iface, to, tolen);
+	if (dst && dst->queue_len) {
+		if (dst->queue_len + count > AFC_CTRL_CLIENT_QUEUE_LEN) {
+			dst->dropped++;
+			afc_printf(MSG_DEBUG, "CTRL_IFACE reply dropped, %u datagrams queued",
+				   dst->queue_len);
+			return -1;
+		}
+	} else {
+		dst = NULL;
+	}
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = (void *)to;
+	mh.msg_namelen = tolen;
+	mh.msg_iov = iov;
+
+	/* the first chunk always announces more, so a short message that
+	starts with the marker itself is followed by an empty last chunk */
+	do {
+		if (chunked) {
+			chunk = len < REPLY_LEN - 1 ? len : REPLY_LEN - 1;
+			mark = (first || chunk < len) ? AFC_CTRL_CHUNK_MORE : AFC_CTRL_CHUNK_LAST;
+			iov[0].iov_base = &mark;
+			iov[0].iov_len = 1;
+			iov[1].iov_base = (void *)msg;
+			iov[1].iov_len = chunk;
+			mh.msg_iovlen = 2;
+		} else {
+			chunk = len;
+			iov[0].iov_base = (void *)msg;
+			iov[0].iov_len = len;
+			mh.msg_iovlen = 1;
+		}
+
+		if (dst == NULL) {
+			if (sendmsg(iface->sock, &mh, MSG_DONTWAIT) >= 0)
+				goto next;
+			if (!afc_ctrl_would_block(errno)) {
+				afc_printf(MSG_DEBUG, "CTRL_IFACE reply failed: %s", strerror(errno));
+				return -1;
+			}
+			dst = afc_ctrl_client_get(iface, to, tolen);
+			if (dst == NULL)
+				return -1;
+			afc_ctrl_iface_schedule_flush(iface);
+		}
+		if (afc_ctrl_client_queue_msg(dst, 1, chunked ? &mark : NULL, msg, chunk))
+			return -1;
+next:
+		msg += chunk;
+		len -= chunk;
+		first = 0;
+	} while (mark == AFC_CTRL_CHUNK_MORE);
+
+	return 0;
+}
+
+int afc_ctrl_iface_init(int *cli_sock, struct sockaddr_un *cli_addr, char *src_path)
+{
+	int len, try_cnt = 0;
+
+	*cli_sock = socket(PF_UNIX, SOCK_DGRAM, 0);
+	if (*cli_sock < 0) {
+		afc_printf(MSG_ERROR, "failed to create control socket");
+		return -1;
+	}
+
+	memset(cli_addr, 0, sizeof(*cli_addr));
+	cli_addr->sun_family = AF_UNIX;
+	len = snprintf(cli_addr->sun_path, sizeof(cli_addr->sun_path), "%s", src_path);
+	if (len < 0 || len >= (int)sizeof(cli_addr->sun_path))
+		goto fail;;
+
+try_again:
+	if (bind(*cli_sock, (struct sockaddr *)cli_addr, sizeof(*cli_addr)) < 0) {
+		afc_printf(MSG_ERROR, "control interface bind failed: %s", strerror(errno));
+
+		unlink(cli_addr->sun_path);
+
+		if (try_cnt++ > MAX_BIND_RETRY_CNT)
+			goto fail;
+
+		goto try_again;
+	}
+
+	afc_printf(MSG_ERROR, "control interface bind success");
+
+	/* afcd never waits for a client */
+	if (fcntl(*cli_sock, F_SETFL, fcntl(*cli_sock, F_GETFL) | O_NONBLOCK) < 0) {
+		afc_printf(MSG_ERROR, "control socket O_NONBLOCK failed: %s", strerror(errno));
+		goto fail;
+	}
+
+	if (chmod(cli_addr->sun_path, S_IRWXU | S_IRWXG) < 0) {
+		afc_printf(MSG_ERROR, "chmod ctrl_iface failed: %s", strerror(errno));
+		goto fail;
+	}
+
+	return 0;
+fail:
+	unlink(cli_addr->sun_path);
+	if (*cli_sock >= 0)
+		close(*cli_sock);
+	*cli_sock = -1;
+
+	return -1;
+}
+
+void afc_ctrl_iface_deinit(int *cli_sock, char *src_path)
+{
+	if (*cli_sock < 0)
+		return;
+
+	unlink(src_path);
+	close(*cli_sock);
+	*cli_sock = 0;
+}
@@ -0,0 +1,85 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#ifndef CTRL_CLIENTS_H
+#define CTRL_CLIENTS_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include "list.h"
+#include "eloop.h" /* struct reltime */
+
+/*
+ * Monitors ATTACHed to the afcd control socket, and requesters while
+ * replies to them are queued. Clients sit on a list for broadcasts and in
+ * a hash on their socket path, so ATTACH, DETACH and the lookups on send
+ * errors cost the same with one client or hundreds.
+ *
+ * A timer checks the clients every AFC_CTRL_CLIENT_CHECK_SEC: a client
+ * whose socket file is gone, or whose queued events have not moved for
+ * AFC_CTRL_CLIENT_STALL_SEC, is detached.
+ */
+#define AFC_CTRL_CLIENT_BUCKETS 256 /* power of two */
+#define AFC_CTRL_CLIENT_CHECK_SEC 30
+#define AFC_CTRL_CLIENT_STALL_SEC 120
+
+/* events held for a monitor whose socket is full, the oldest is dropped
+when the queue is full. queues are retried every AFC_CTRL_FLUSH_MS */
+#define AFC_CTRL_CLIENT_QUEUE_LEN 64
+#define AFC_CTRL_FLUSH_MS 100
+/* clients per sendmmsg call */
+#define AFC_CTRL_SEND_BATCH 32
+/* requests served per wakeup of the control socket */
+#define AFC_CTRL_RECV_BATCH 16
+
+struct ctrl_client {
+	struct dl_list list;
+	struct dl_list hash;
+	uint32_t key;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	unsigned char errors;
+	unsigned int events; /* AFC_CTRL_EVENT_* mask, 0 for requesters */
+	struct dl_list queue;
+	unsigned int queue_len;
+	unsigned long dropped;
+	struct reltime last_sent; /* attach time until the first event goes out */
+	struct reltime queued_since; /* the queue last went from empty to non-empty */
+};
+
+/* control socket and the monitors ATTACHed to it */
+struct afc_ctrl_iface {
+	int sock;
+	struct dl_list clients;
+	struct dl_list buckets[AFC_CTRL_CLIENT_BUCKETS];
+	unsigned int num_clients;
+};
+
+struct sockaddr_un;
+
+/* binds the afcd end of the control socket at src_path */
+int afc_ctrl_iface_init(int *cli_sock, struct sockaddr_un *cli_addr, char *src_path);
+void afc_ctrl_iface_deinit(int *cli_sock, char *src_path);
+void afc_ctrl_clients_init(struct afc_ctrl_iface *iface);
+void afc_ctrl_clients_deinit(struct afc_ctrl_iface *iface);
+struct ctrl_client *afc_ctrl_client_find(struct afc_ctrl_iface *iface,
+					 const struct sockaddr_storage *from, socklen_t fromlen);
+/* attaching again only changes the event mask */
+int afc_ctrl_client_attach(struct afc_ctrl_iface *iface, const struct sockaddr_storage *from,
+			   socklen_t fromlen, unsigned int events);
+void afc_ctrl_client_detach(struct afc_ctrl_iface *iface, const struct sockaddr_storage *from,
+			    socklen_t fromlen);
+/* sends a reply, chunked if needed, without blocking; what does not fit
+the client's socket is queued. -1 if the reply was dropped */
+int afc_ctrl_iface_reply(struct afc_ctrl_iface *iface, const char *msg, size_t len,
+			 const struct sockaddr_storage *to, socklen_t tolen);
+/* sends an event of class event to the clients subscribed to it */
+void afc_ctrl_iface_send(struct afc_ctrl_iface *iface, unsigned int event,
+			 const char *buf, size_t len);
+
+#endif /* CTRL_CLIENTS_H */
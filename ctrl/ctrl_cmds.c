@@ -0,0 +1,362 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include "afc.h"
+#include "eloop.h"
+#include "afc_grant.h"
+#include "afc_driver.h"
+#include "afc_reg_rule.h"
+#ifdef CONFIG_DRIVER_NL80211
+#include "afc_nl80211.h"
+#endif /* CONFIG_DRIVER_NL80211 */
+#ifdef CONFIG_DRIVER_MOCK
+#include "afc_drv_mock.h"
+#endif /* CONFIG_DRIVER_MOCK */
+#include "ctrl_cmds.h"
+
+/* room kept for the "truncated=1" line */
+#define AFC_CTRL_REPLY_RESERVE 16
+
+struct afc_ctrl_reply {
+	char *buf;
+	size_t size;
+	size_t len;
+	int truncated;
+};
+
+struct afc_ctrl_cmd {
+	const char *cmd;
+	void (*handler)(char *args, struct afc_ctrl_reply *reply);
+};
+
+static void afc_ctrl_reply_add(struct afc_ctrl_reply *reply, const char *fmt, ...) PRINTF_FORMAT(2, 3);
+
+/* a line that does not fit is dropped whole and the reply marked truncated */
+static void afc_ctrl_reply_add(struct afc_ctrl_reply *reply, const char *fmt, ...)
+{
+	size_t room = reply->size - AFC_CTRL_REPLY_RESERVE - reply->len;
+	va_list ap;
+	int ret;
+
+	if (reply->truncated)
+		return;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(reply->buf + reply->len, room, fmt, ap);
+	va_end(ap);
+
+	if (ret < 0 || (size_t)ret >= room) {
+		reply->buf[reply->len] = '\0';
+		reply->truncated = 1;
+		return;
+	}
+	reply->len += ret;
+}
+
+/* afcd is the only writer of the grant table and runs single threaded,
+so it is read here without the seqlock */
+static const struct afc_grant_table *afc_ctrl_grant(struct afc_ctrl_reply *reply)
+{
+	const struct afc_grant_table *table = afc_grant_get();
+
+	if (!table)
+		afc_ctrl_reply_add(reply, "FAIL no grant table\n");
+
+	return table;
+}
+
+static const char *afc_ctrl_grant_state(const struct afc_grant_table *table, time_t now)
+{
+	size_t len;
+
+	if (!table->grant_seq)
+		return "NONE";
+	if (table->expire_time && table->expire_time <= now)
+		return "EXPIRED";
+	if (!afc_reg_rule_get_payload(&len))
+		return "DENIED";
+
+	return "GRANTED";
+}
+
+static const struct afc_grant_chan *afc_ctrl_find_chan(const struct afc_grant_table *table,
+						       uint16_t op_class, uint8_t cfi)
+{
+	int low = 0, high = table->num_chan - 1, mid;
+	const struct afc_grant_chan *chan;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		chan = &table->chan[mid];
+		if (chan->global_op_class == op_class && chan->cfi == cfi)
+			return chan;
+		if (chan->global_op_class < op_class ||
+		    (chan->global_op_class == op_class && chan->cfi < cfi))
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	return NULL;
+}
+
+/* last range starting at or below freq, ranges do not overlap */
+static const struct afc_grant_psd *afc_ctrl_find_psd(const struct afc_grant_table *table,
+						     uint16_t freq)
+{
+	int low = 0, high = table->num_psd - 1, mid, found = -1;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (table->psd[mid].low_freq_mhz <= freq) {
+			found = mid;
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+
+	if (found < 0 || freq > table->psd[found].high_freq_mhz)
+		return NULL;
+
+	return &table->psd[found];
+}
+
+static void afc_ctrl_cmd_status(char *args, struct afc_ctrl_reply *reply)
+{
+	const struct afc_grant_table *table = afc_ctrl_grant(reply);
+	const struct afc_query_stats *query = afc_query_get_stats();
+	time_t now = time(NULL);
+
+	UNUSED_PARAM(args);
+
+	if (!table)
+		return;
+
+	afc_ctrl_reply_add(reply, "state=%s\nbackend=%s\ngrant_seq=%u\ncountry=%s\nrule_set_id=%s\n"
+			   "resp_status=%u\npublish_time=%lld\nexpire_time=%lld\nnum_chan=%u\nnum_psd=%u\n"
+			   "inquiry_in_flight=%d\nlast_success=%lld\nrejected_ifaces=%u\n",
+			   afc_ctrl_grant_state(table, now), afc_driver_name(), table->grant_seq,
+			   table->country, table->rule_set_id, table->resp_status,
+			   (long long)table->publish_time, (long long)table->expire_time,
+			   table->num_chan, table->num_psd, query->in_flight,
+			   (long long)query->last_success, table->rejected_ifaces);
+}
+
+static void afc_ctrl_cmd_get_grant(char *args, struct afc_ctrl_reply *reply)
+{
+	const struct afc_grant_table *table = afc_ctrl_grant(reply);
+	int op_class = args ? atoi(args) : 0;
+	uint16_t idx;
+
+	if (!table)
+		return;
+
+	afc_ctrl_reply_add(reply, "grant_seq=%u\nchan_fields=op_class,cfi,start_mhz,end_mhz,max_eirp_mbm\n",
+			   table->grant_seq);
+	for (idx = 0; idx < table->num_chan; idx++) {
+		if (op_class && table->chan[idx].global_op_class != op_class)
+			continue;
+		afc_ctrl_reply_add(reply, "chan=%u,%u,%u,%u,%d\n", table->chan[idx].global_op_class,
+				   table->chan[idx].cfi, table->chan[idx].start_freq_mhz,
+				   table->chan[idx].end_freq_mhz, table->chan[idx].max_eirp_mbm);
+	}
+
+	/* the PSD map is not per operating class */
+	if (op_class)
+		return;
+
+	afc_ctrl_reply_add(reply, "psd_fields=low_mhz,high_mhz,max_psd_mbm\n");
+	for (idx = 0; idx < table->num_psd; idx++)
+		afc_ctrl_reply_add(reply, "psd=%u,%u,%d\n", table->psd[idx].low_freq_mhz,
+				   table->psd[idx].high_freq_mhz, table->psd[idx].max_psd_mbm);
+}
+
+static void afc_ctrl_cmd_get_channel(char *args, struct afc_ctrl_reply *reply)
+{
+	const struct afc_grant_table *table;
+	const struct afc_grant_chan *chan;
+	int op_class, cfi;
+
+	if (!args || sscanf(args, "%d %d", &op_class, &cfi) != 2) {
+		afc_ctrl_reply_add(reply, "FAIL usage: GET_CHANNEL <op_class> <cfi>\n");
+		return;
+	}
+
+	table = afc_ctrl_grant(reply);
+	if (!table)
+		return;
+
+	chan = afc_ctrl_find_chan(table, op_class, cfi);
+	if (!chan) {
+		afc_ctrl_reply_add(reply, "FAIL channel %d/%d not granted\n", op_class, cfi);
+		return;
+	}
+
+	afc_ctrl_reply_add(reply, "op_class=%u\ncfi=%u\nstart_mhz=%u\nend_mhz=%u\nmax_eirp_mbm=%d\n",
+			   chan->global_op_class, chan->cfi, chan->start_freq_mhz,
+			   chan->end_freq_mhz, chan->max_eirp_mbm);
+}
+
+static void afc_ctrl_cmd_get_psd(char *args, struct afc_ctrl_reply *reply)
+{
+	const struct afc_grant_table *table;
+	const struct afc_grant_psd *psd;
+	int freq;
+
+	if (!args || sscanf(args, "%d", &freq) != 1) {
+		afc_ctrl_reply_add(reply, "FAIL usage: GET_PSD <freq_mhz>\n");
+		return;
+	}
+
+	table = afc_ctrl_grant(reply);
+	if (!table)
+		return;
+
+	psd = freq > 0 && freq <= UINT16_MAX ? afc_ctrl_find_psd(table, freq) : NULL;
+	if (!psd) {
+		afc_ctrl_reply_add(reply, "FAIL no PSD for %d MHz\n", freq);
+		return;
+	}
+
+	afc_ctrl_reply_add(reply, "freq_mhz=%d\nlow_mhz=%u\nhigh_mhz=%u\nmax_psd_mbm=%d\n",
+			   freq, psd->low_freq_mhz, psd->high_freq_mhz, psd->max_psd_mbm);
+}
+
+static void afc_ctrl_cmd_get_expiry(char *args, struct afc_ctrl_reply *reply)
+{
+	const struct afc_grant_table *table = afc_ctrl_grant(reply);
+	time_t now = time(NULL);
+
+	UNUSED_PARAM(args);
+
+	if (!table)
+		return;
+
+	afc_ctrl_reply_add(reply, "expire_time=%lld\nexpires_in=%lld\n",
+			   (long long)table->expire_time,
+			   table->expire_time ? (long long)(table->expire_time - now) : 0LL);
+}
+
+static void afc_ctrl_cmd_get_metrics(char *args, struct afc_ctrl_reply *reply)
+{
+	const struct afc_query_stats *query = afc_query_get_stats();
+	const struct eloop_stats *loop = eloop_get_stats();
+	const struct afc_grant_table *table = afc_grant_get();
+#ifdef CONFIG_DRIVER_NL80211
+	const struct afc_nl80211_stats *nl = afc_nl80211_get_stats();
+#endif /* CONFIG_DRIVER_NL80211 */
+#ifdef CONFIG_DRIVER_MOCK
+	const struct afc_drv_mock_stats *mock = afc_drv_mock_get_stats();
+#endif /* CONFIG_DRIVER_MOCK */
+
+	UNUSED_PARAM(args);
+
+	afc_ctrl_reply_add(reply, "query_requests=%u\nquery_joined=%u\nquery_inquiries=%u\n"
+			   "query_failures=%u\nquery_deferred=%u\nquery_last_exchange_ms=%u\n",
+			   query->requests, query->joined, query->inquiries, query->failures,
+			   query->deferred, query->last_exchange_ms);
+	afc_ctrl_reply_add(reply, "grant_seq=%u\n", table ? table->grant_seq : 0);
+	afc_ctrl_reply_add(reply, "eloop_iterations=%llu\neloop_callbacks=%llu\neloop_stalls=%llu\n",
+			   loop->iterations, loop->callbacks, loop->stalls);
+#ifdef CONFIG_DRIVER_NL80211
+	afc_ctrl_reply_add(reply, "nl80211_tx=%u\nnl80211_acked=%u\nnl80211_errors=%u\n"
+			   "nl80211_timeouts=%u\nnl80211_send_errors=%u\nnl80211_ext_ack=%u\n",
+			   nl->tx, nl->acked, nl->errors, nl->timeouts, nl->send_errors, nl->ext_ack);
+#endif /* CONFIG_DRIVER_NL80211 */
+#ifdef CONFIG_DRIVER_MOCK
+	afc_ctrl_reply_add(reply, "mock_applied=%u\nmock_rejected=%u\nmock_last_n_rules=%u\n",
+			   mock->applied, mock->rejected, mock->last_n_rules);
+#endif /* CONFIG_DRIVER_MOCK */
+}
+
+static void afc_ctrl_hist(struct afc_ctrl_reply *reply, const char *name, const unsigned long *hist)
+{
+	char line[ELOOP_STATS_BUCKETS * 21];
+	int pos = 0, i;
+
+	for (i = 0; i < ELOOP_STATS_BUCKETS; i++)
+		pos += snprintf(line + pos, sizeof(line) - pos, "%s%lu", i ? "," : "", hist[i]);
+
+	afc_ctrl_reply_add(reply, "%s=%s\n", name, line);
+}
+
+/* histogram bucket i counts [2^(i-1), 2^i) us */
+static void afc_ctrl_cmd_eloop_stats(char *args, struct afc_ctrl_reply *reply)
+{
+	const struct eloop_stats *stats = eloop_get_stats();
+	const struct eloop_slow_handler *slow;
+	int i;
+
+	UNUSED_PARAM(args);
+
+	afc_ctrl_reply_add(reply, "iterations=%llu\ncallbacks=%llu\nstalls=%llu\nstall_threshold_ms=%d\n"
+			   "wait_usec=%llu\nbusy_usec=%llu\n",
+			   stats->iterations, stats->callbacks, stats->stalls, AFC_ELOOP_STALL_MS,
+			   stats->wait_usec, stats->busy_usec);
+	afc_ctrl_hist(reply, "wait_hist", stats->wait_hist);
+	afc_ctrl_hist(reply, "busy_hist", stats->busy_hist);
+
+	for (i = 0; i < stats->num_slowest; i++) {
+		slow = &stats->slowest[i];
+		afc_ctrl_reply_add(reply, "slow%d=%s handler=%p site=%p max_usec=%llu\n",
+				   i, slow->kind, slow->handler, slow->site, slow->usec);
+	}
+}
+
+static const struct afc_ctrl_cmd afc_ctrl_cmds[] = {
+	{ "STATUS", afc_ctrl_cmd_status },
+	{ "GET_GRANT", afc_ctrl_cmd_get_grant },
+	{ "GET_CHANNEL", afc_ctrl_cmd_get_channel },
+	{ "GET_PSD", afc_ctrl_cmd_get_psd },
+	{ "GET_EXPIRY", afc_ctrl_cmd_get_expiry },
+	{ "GET_METRICS", afc_ctrl_cmd_get_metrics },
+	{ "ELOOP_STATS", afc_ctrl_cmd_eloop_stats },
+	{ NULL, NULL }
+};
+
+int afc_ctrl_cmd_process(char *cmd, char *reply_buf, size_t reply_size)
+{
+	const struct afc_ctrl_cmd *entry;
+	struct afc_ctrl_reply reply;
+	char *args;
+	size_t len;
+
+	if (reply_size <= AFC_CTRL_REPLY_RESERVE)
+		return 0;
+
+	args = strchr(cmd, ' ');
+	len = args ? (size_t)(args - cmd) : strlen(cmd);
+	if (args)
+		args++;
+
+	for (entry = afc_ctrl_cmds; entry->cmd; entry++) {
+		if (strlen(entry->cmd) == len && !strncmp(entry->cmd, cmd, len))
+			break;
+	}
+	if (!entry->cmd)
+		return 0;
+
+	reply.buf = reply_buf;
+	reply.size = reply_size;
+	reply.len = 0;
+	reply.truncated = 0;
+	reply_buf[0] = '\0';
+
+	entry->handler(args, &reply);
+
+	if (reply.truncated)
+		reply.len += snprintf(reply_buf + reply.len, reply_size - reply.len, "truncated=1\n");
+
+	return reply.len;
+}
@@ -0,0 +1,31 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#ifndef CTRL_CMDS_H
+#define CTRL_CMDS_H
+
+#include <stddef.h>
+
+/*
+ * Read-only control commands of afcd, answered from in-memory state without
+ * touching disk or the AFC server. Replies are "key=value" lines, lookups
+ * are binary searches in the sorted grant table.
+ *
+ *	STATUS
+ *	GET_GRANT [op_class]
+ *	GET_CHANNEL <op_class> <cfi>
+ *	GET_PSD <freq_mhz>
+ *	GET_EXPIRY
+ *	GET_METRICS
+ *	ELOOP_STATS
+ */
+
+/* returns the reply length, 0 if cmd is not a read-only command */
+int afc_ctrl_cmd_process(char *cmd, char *reply, size_t reply_size);
+
+#endif /* CTRL_CMDS_H */
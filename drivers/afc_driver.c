@@ -0,0 +1,104 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include "afc.h"
+#include "afc_driver.h"
+
+/* compiled in backends, the first one is the default */
+static const struct afc_driver_ops *const afc_drivers[] = {
+#ifdef CONFIG_DRIVER_NL80211
+	&afc_driver_nl80211_ops,
+#endif
+#ifdef CONFIG_DRIVER_MOCK
+	&afc_driver_mock_ops,
+#endif
+	NULL
+};
+
+static const struct afc_driver_ops *drv;
+
+static const struct afc_driver_ops *afc_driver_get(void)
+{
+	if (!drv)
+		drv = afc_drivers[0];
+
+	return drv;
+}
+
+int afc_driver_select(const char *name)
+{
+	int idx;
+
+	for (idx = 0; afc_drivers[idx]; idx++) {
+		if (!strcmp(afc_drivers[idx]->name, name)) {
+			drv = afc_drivers[idx];
+			return AFC_STATUS_SUCCESS;
+		}
+	}
+
+	afc_printf(MSG_ERROR, "unknown driver backend : %s", name);
+	return AFC_STATUS_FAILURE;
+}
+
+const char *afc_driver_name(void)
+{
+	return afc_driver_get() ? drv->name : "none";
+}
+
+void afc_driver_list(FILE *stream)
+{
+	int idx;
+
+	for (idx = 0; afc_drivers[idx]; idx++)
+		fprintf(stream, "%s%s", idx ? " " : "", afc_drivers[idx]->name);
+	fprintf(stream, "\n");
+}
+
+int afc_driver_init(void)
+{
+	if (!afc_driver_get()) {
+		afc_printf(MSG_ERROR, "no driver backend compiled in");
+		return AFC_STATUS_FAILURE;
+	}
+
+	afc_printf(MSG_INFO, "driver backend : %s", drv->name);
+
+	return drv->init ? drv->init() : AFC_STATUS_SUCCESS;
+}
+
+int afc_driver_start(void)
+{
+	if (!afc_driver_get() || !drv->start)
+		return AFC_STATUS_SUCCESS;
+
+	return drv->start();
+}
+
+void afc_driver_deinit(void)
+{
+	if (afc_driver_get() && drv->deinit)
+		drv->deinit();
+}
+
+int afc_driver_set_ifaces(char ifnames[][IFNAMSIZ], int num_ifnames)
+{
+	if (!afc_driver_get() || !drv->set_ifaces)
+		return AFC_STATUS_SUCCESS;
+
+	return drv->set_ifaces(ifnames, num_ifnames);
+}
+
+int afc_driver_apply(const uint8_t *data, size_t length)
+{
+	if (!afc_driver_get())
+		return AFC_STATUS_FAILURE;
+
+	return drv->apply(data, length);
+}
@@ -0,0 +1,47 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#ifndef AFC_DRIVER_H
+#define AFC_DRIVER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <net/if.h>
+
+/* Regulatory output backend. The payload handed to apply() is the
+struct mxl_ieee80211_regdomain built by afc_reg_rule.c. */
+struct afc_driver_ops {
+	const char *name;
+	/* open driver handles, called before the event loop exists */
+	int (*init)(void);
+	/* register sockets and timers, called once the event loop is up */
+	int (*start)(void);
+	void (*deinit)(void);
+	int (*set_ifaces)(char ifnames[][IFNAMSIZ], int num_ifnames);
+	int (*apply)(const uint8_t *data, size_t length);
+};
+
+#ifdef CONFIG_DRIVER_NL80211
+extern const struct afc_driver_ops afc_driver_nl80211_ops;
+#endif
+
+#ifdef CONFIG_DRIVER_MOCK
+extern const struct afc_driver_ops afc_driver_mock_ops;
+#endif
+
+int afc_driver_select(const char *name);
+const char *afc_driver_name(void);
+void afc_driver_list(FILE *stream);
+int afc_driver_init(void);
+int afc_driver_start(void);
+void afc_driver_deinit(void);
+int afc_driver_set_ifaces(char ifnames[][IFNAMSIZ], int num_ifnames);
+int afc_driver_apply(const uint8_t *data, size_t length);
+
+#endif /* AFC_DRIVER_H */
@@ -0,0 +1,109 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "afc.h"
+#include "afc_reg_rule.h"
+#include "afc_driver.h"
+#include "afc_drv_mock.h"
+
+/* In-memory backend: keeps a copy of the last applied regdomain so the
+whole pipeline can run, be inspected and be benchmarked without the
+MaxLinear driver. */
+static uint8_t *payload;
+static size_t payload_capacity;
+static struct afc_drv_mock_stats stats;
+static uint32_t fail_count;
+
+static void afc_drv_mock_dump(const struct mxl_ieee80211_regdomain *regd)
+{
+	uint32_t idx;
+	const struct ieee80211_reg_rule *rule;
+
+	afc_printf(MSG_DEBUG, "mock: regdomain %.2s, %u rules", regd->alpha2, regd->n_reg_rules);
+	for (idx = 0; idx < regd->n_reg_rules; idx++) {
+		rule = &regd->reg_rules[idx];
+		afc_printf(MSG_DEBUG, "mock:  %u - %u kHz @ %u kHz, %u mBm",
+				   rule->freq_range.start_freq_khz, rule->freq_range.end_freq_khz,
+				   rule->freq_range.max_bandwidth_khz, rule->power_rule.max_eirp);
+	}
+}
+
+static int afc_drv_mock_apply(const uint8_t *data, size_t length)
+{
+	const struct mxl_ieee80211_regdomain *regd = (const struct mxl_ieee80211_regdomain *)data;
+	uint8_t *buf;
+
+	if (length < sizeof(*regd) ||
+		length < sizeof(*regd) + regd->n_reg_rules * sizeof(regd->reg_rules[0])) {
+		afc_printf(MSG_ERROR, "mock: truncated regdomain, %zu bytes", length);
+		stats.rejected++;
+		return AFC_STATUS_FAILURE;
+	}
+
+	if (fail_count) {
+		fail_count--;
+		stats.rejected++;
+		return AFC_STATUS_FAILURE;
+	}
+
+	if (length > payload_capacity) {
+		buf = realloc(payload, length);
+		if (!buf) {
+			afc_printf(MSG_ERROR, "mock: failed to allocate %zu bytes", length);
+			stats.rejected++;
+			return AFC_STATUS_FAILURE;
+		}
+		payload = buf;
+		payload_capacity = length;
+	}
+
+	memcpy(payload, data, length);
+	stats.applied++;
+	stats.last_len = length;
+	stats.last_n_rules = regd->n_reg_rules;
+
+	if (afc_debug_level <= MSG_DEBUG)
+		afc_drv_mock_dump(regd);
+
+	return AFC_STATUS_SUCCESS;
+}
+
+void afc_drv_mock_reset(void)
+{
+	free(payload);
+	payload = NULL;
+	payload_capacity = 0;
+	fail_count = 0;
+	memset(&stats, 0, sizeof(stats));
+}
+
+const uint8_t *afc_drv_mock_last_payload(size_t *length)
+{
+	*length = stats.applied ? stats.last_len : 0;
+	return stats.applied ? payload : NULL;
+}
+
+const struct afc_drv_mock_stats *afc_drv_mock_get_stats(void)
+{
+	return &stats;
+}
+
+/* make the next count apply() calls fail, to exercise the retry paths */
+void afc_drv_mock_fail_next(uint32_t count)
+{
+	fail_count = count;
+}
+
+const struct afc_driver_ops afc_driver_mock_ops = {
+	.name = "mock",
+	.deinit = afc_drv_mock_reset,
+	.apply = afc_drv_mock_apply,
+};
@@ -0,0 +1,22 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+
+struct afc_drv_mock_stats {
+	uint32_t applied;
+	uint32_t rejected;
+	uint32_t last_n_rules;
+	size_t last_len;
+};
+
+const uint8_t *afc_drv_mock_last_payload(size_t *length);
+const struct afc_drv_mock_stats *afc_drv_mock_get_stats(void);
+void afc_drv_mock_fail_next(uint32_t count);
+void afc_drv_mock_reset(void);
@@ -0,0 +1,109 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <net/if.h>
+#include <linux/rtnetlink.h>
+#include <netlink/netlink.h>
+#include <netlink/msg.h>
+#include <netlink/attr.h>
+#include "afc.h"
+#include "afc_nl80211.h"
+#include "afc_link_monitor.h"
+#include "eloop.h"
+
+/* RTNLGRP_LINK listener, keeps the nl80211 ifindex cache in sync with
+interfaces torn down and recreated by hostapd restarts and recovery flows */
+static struct nl_sock *rtnl_sock;
+
+static int afc_link_monitor_valid_handler(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
+	struct nlattr *tb[IFLA_MAX + 1];
+	struct ifinfomsg *ifi;
+
+	UNUSED_PARAM(arg);
+
+	if (nlh->nlmsg_type != RTM_NEWLINK && nlh->nlmsg_type != RTM_DELLINK)
+		return NL_SKIP;
+
+	if (nlmsg_parse(nlh, sizeof(*ifi), tb, IFLA_MAX, NULL) < 0 || !tb[IFLA_IFNAME])
+		return NL_SKIP;
+
+	ifi = nlmsg_data(nlh);
+	afc_nl80211_link_event(nla_get_string(tb[IFLA_IFNAME]), ifi->ifi_index,
+			       nlh->nlmsg_type == RTM_NEWLINK, !!(ifi->ifi_flags & IFF_UP));
+
+	return NL_OK;
+}
+
+static void afc_link_monitor_receive(int sock, void *eloop_ctx, void *sock_ctx)
+{
+	int ret;
+
+	UNUSED_PARAM(sock);
+	UNUSED_PARAM(eloop_ctx);
+	UNUSED_PARAM(sock_ctx);
+
+	ret = nl_recvmsgs_default(rtnl_sock);
+	if (ret == -NLE_NOMEM) {
+		/* socket overrun, link events were lost */
+		afc_printf(MSG_WARNING, "link monitor overrun, resolving interfaces again");
+		afc_nl80211_resync_ifaces();
+	} else if (ret < 0 && ret != -NLE_AGAIN) {
+		afc_printf(MSG_ERROR, "link monitor receive failed : %d", ret);
+	}
+}
+
+int afc_link_monitor_init(void)
+{
+	rtnl_sock = nl_socket_alloc();
+	if (!rtnl_sock) {
+		afc_printf(MSG_ERROR, "failed to allocate rtnetlink socket");
+		return AFC_STATUS_FAILURE;
+	}
+
+	nl_socket_disable_seq_check(rtnl_sock);
+	nl_socket_modify_cb(rtnl_sock, NL_CB_VALID, NL_CB_CUSTOM, afc_link_monitor_valid_handler, NULL);
+
+	if (nl_connect(rtnl_sock, NETLINK_ROUTE)) {
+		afc_printf(MSG_ERROR, "failed to connect to rtnetlink");
+		goto fail;
+	}
+
+	if (nl_socket_add_membership(rtnl_sock, RTNLGRP_LINK)) {
+		afc_printf(MSG_ERROR, "failed to join RTNLGRP_LINK");
+		goto fail;
+	}
+
+	nl_socket_set_nonblocking(rtnl_sock);
+
+	if (eloop_register_read_sock(nl_socket_get_fd(rtnl_sock), afc_link_monitor_receive,
+				     NULL, NULL) < 0) {
+		afc_printf(MSG_ERROR, "eloop register link monitor failed");
+		goto fail;
+	}
+
+	return AFC_STATUS_SUCCESS;
+
+fail:
+	nl_socket_free(rtnl_sock);
+	rtnl_sock = NULL;
+	return AFC_STATUS_FAILURE;
+}
+
+void afc_link_monitor_deinit(void)
+{
+	if (!rtnl_sock)
+		return;
+
+	eloop_unregister_read_sock(nl_socket_get_fd(rtnl_sock));
+	nl_socket_free(rtnl_sock);
+	rtnl_sock = NULL;
+}
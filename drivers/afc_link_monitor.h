@@ -0,0 +1,11 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+
+int afc_link_monitor_init(void);
+void afc_link_monitor_deinit(void);
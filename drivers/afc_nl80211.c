@@ -24,6 +24,9 @@ this software module.
 #include "afc_nl80211.h"
 #include "afc.h"
 #include "afc_reg_rule.h"
+#include "eloop.h"
+#include "afc_driver.h"
+#include "afc_link_monitor.h"
 
 typedef unsigned long long int u64;
 typedef uint32_t u32;
@@ -40,11 +43,60 @@ typedef int8_t s8;
 
 #include "vendor_cmds_copy.h"
 
+/* extended ack definitions, missing from older kernel headers */
+#ifndef NLM_F_CAPPED
+#define NLM_F_CAPPED 0x100
+#endif
+
+#ifndef NLM_F_ACK_TLVS
+#define NLM_F_ACK_TLVS 0x200
+#endif
+
+#ifndef NETLINK_EXT_ACK
+#define NETLINK_EXT_ACK 11
+enum nlmsgerr_attrs {
+	NLMSGERR_ATTR_UNUSED,
+	NLMSGERR_ATTR_MSG,
+	NLMSGERR_ATTR_OFFS,
+	NLMSGERR_ATTR_COOKIE,
+	__NLMSGERR_ATTR_MAX,
+	NLMSGERR_ATTR_MAX = __NLMSGERR_ATTR_MAX - 1
+};
+#endif
+
 struct nl80211_state state;
 
+/* requests waiting for the driver's ack, matched on the netlink sequence */
+struct afc_nl80211_pending {
+	bool active;
+	uint32_t seq;
+	int iface_idx;
+	int ifindex;
+	uint32_t payload_gen;
+	eloop_timer_id timer;
+};
+
+static struct afc_nl80211_pending pending[AFC_NL80211_MAX_PENDING];
+static struct afc_nl80211_stats stats;
+/* bumped for every new regdomain, acks of older ones do not count against
+the published grant */
+static uint32_t payload_gen;
+static bool eloop_registered;
+
+static void afc_nl80211_ack_timeout(void *eloop_ctx, void *user_ctx);
+
+static void afc_nl80211_event_deinit(void);
+
 void afc_nl80211_cleanup()
 {
+	afc_nl80211_event_deinit();
+	if (eloop_registered) {
+		eloop_cancel_timeout(afc_nl80211_ack_timeout, ELOOP_ALL_CTX, ELOOP_ALL_CTX);
+		eloop_unregister_read_sock(nl_socket_get_fd(state.nl_sock));
+		eloop_registered = false;
+	}
 	nl_socket_free(state.nl_sock);
+	state.nl_sock = NULL;
 }
 
 int afc_nl80211_init(void)
@@ -82,22 +134,412 @@ out_handle_destroy:
 	return AFC_STATUS_FAILURE;
 }
 
-int afc_nl80211_send_afc_info_to_drv(const uint8_t *data, size_t length)
+int afc_nl80211_set_ifaces(char ifnames[][IFNAMSIZ], int num_ifnames)
+{
+	int idx;
+
+	if (num_ifnames > AFC_NL80211_MAX_IFACES)
+		num_ifnames = AFC_NL80211_MAX_IFACES;
+
+	/* keep the cached ifindexes as long as the interface set is unchanged */
+	if (num_ifnames == state.num_ifaces) {
+		for (idx = 0; idx < num_ifnames; idx++) {
+			if (strncmp(state.ifaces[idx].ifname, ifnames[idx], IFNAMSIZ))
+				break;
+		}
+		if (idx == num_ifnames)
+			return AFC_STATUS_SUCCESS;
+	}
+
+	memset(state.ifaces, 0, sizeof(state.ifaces));
+	for (idx = 0; idx < num_ifnames; idx++) {
+		strncpy(state.ifaces[idx].ifname, ifnames[idx], IFNAMSIZ - 1);
+		state.ifaces[idx].up = -1;
+		state.ifaces[idx].power_mode = -1;
+		afc_printf(MSG_INFO, "AFC interface %d : %s", idx, state.ifaces[idx].ifname);
+	}
+	state.num_ifaces = num_ifnames;
+
+	return AFC_STATUS_SUCCESS;
+}
+
+static int afc_nl80211_iface_index(struct afc_nl80211_iface *iface)
+{
+	if (!iface->ifindex) {
+		iface->ifindex = if_nametoindex(iface->ifname);
+		afc_printf(MSG_INFO, "%s ifindex : %d", iface->ifname, iface->ifindex);
+	}
+
+	return iface->ifindex;
+}
+
+static struct afc_nl80211_pending *afc_nl80211_pending_get(uint32_t seq)
+{
+	int idx;
+
+	for (idx = 0; idx < AFC_NL80211_MAX_PENDING; idx++) {
+		if (pending[idx].active && pending[idx].seq == seq)
+			return &pending[idx];
+	}
+
+	return NULL;
+}
+
+static struct afc_nl80211_pending *afc_nl80211_pending_alloc(void)
+{
+	int idx;
+
+	for (idx = 0; idx < AFC_NL80211_MAX_PENDING; idx++) {
+		if (!pending[idx].active)
+			return &pending[idx];
+	}
+
+	return NULL;
+}
+
+static const char *afc_nl80211_pending_ifname(struct afc_nl80211_pending *req)
+{
+	if (req->iface_idx < state.num_ifaces)
+		return state.ifaces[req->iface_idx].ifname;
+
+	return "?";
+}
+
+static unsigned int afc_nl80211_rejected_ifaces(void)
+{
+	unsigned int count = 0;
+	int idx;
+
+	for (idx = 0; idx < state.num_ifaces; idx++) {
+		if (state.ifaces[idx].rejected)
+			count++;
+	}
+
+	return count;
+}
+
+static void afc_nl80211_pending_done(struct afc_nl80211_pending *req, bool acked)
+{
+	struct afc_nl80211_iface *iface = NULL;
+
+	eloop_cancel_timer(req->timer);
+	req->active = false;
+
+	if (req->iface_idx < state.num_ifaces)
+		iface = &state.ifaces[req->iface_idx];
+
+	/* re-apply on the next link up if the driver did not take the grant */
+	if (!acked && iface && iface->ifindex == req->ifindex)
+		iface->needs_push = true;
+
+	/* the published grant is flagged while an interface refuses it */
+	if (iface && req->payload_gen == payload_gen && iface->rejected == acked) {
+		iface->rejected = !acked;
+		afc_grant_rejected(afc_nl80211_rejected_ifaces());
+	}
+}
+
+static void afc_nl80211_ack_timeout(void *eloop_ctx, void *user_ctx)
+{
+	struct afc_nl80211_pending *req = user_ctx;
+
+	UNUSED_PARAM(eloop_ctx);
+
+	if (!req->active)
+		return;
+
+	stats.timeouts++;
+	afc_printf(MSG_ERROR, "no ack for AFC info on %s (seq %u) within %d s",
+			   afc_nl80211_pending_ifname(req), req->seq, AFC_NL80211_ACK_TIMEOUT_SEC);
+	afc_nl80211_pending_done(req, false);
+}
+
+/* Decodes the NETLINK_EXT_ACK TLVs following an nlmsgerr, in the layout used
+by iw: the original request is echoed back unless the kernel capped it. */
+static void afc_nl80211_log_ext_ack(struct nlmsghdr *nlh, struct nlmsgerr *err, uint32_t seq)
+{
+	struct nlattr *tb[NLMSGERR_ATTR_MAX + 1];
+	struct nlattr *attrs;
+	int len = nlh->nlmsg_len;
+	int ack_len = sizeof(*nlh) + sizeof(int) + sizeof(*nlh);
+
+	if (!(nlh->nlmsg_flags & NLM_F_ACK_TLVS))
+		return;
+
+	if (!(nlh->nlmsg_flags & NLM_F_CAPPED))
+		ack_len += err->msg.nlmsg_len - sizeof(*nlh);
+
+	if (len <= ack_len)
+		return;
+
+	attrs = (struct nlattr *)((unsigned char *)nlh + ack_len);
+	len -= ack_len;
+	if (nla_parse(tb, NLMSGERR_ATTR_MAX, attrs, len, NULL) < 0)
+		return;
+
+	if (tb[NLMSGERR_ATTR_MSG]) {
+		len = strnlen((char *)nla_data(tb[NLMSGERR_ATTR_MSG]), nla_len(tb[NLMSGERR_ATTR_MSG]));
+		stats.ext_ack++;
+		afc_printf(err->error ? MSG_ERROR : MSG_WARNING, "kernel reports (seq %u): %.*s",
+				   seq, len, (char *)nla_data(tb[NLMSGERR_ATTR_MSG]));
+	}
+
+	if (tb[NLMSGERR_ATTR_OFFS])
+		afc_printf(MSG_DEBUG, "offending attribute at offset %u", nla_get_u32(tb[NLMSGERR_ATTR_OFFS]));
+}
+
+static int afc_nl80211_ack_handler(struct nl_msg *msg, void *arg)
+{
+	struct nlmsghdr *nlh = nlmsg_hdr(msg);
+	struct nlmsgerr *err = nlmsg_data(nlh);
+	struct afc_nl80211_pending *req;
+
+	UNUSED_PARAM(arg);
+
+	/* a successful request may still carry an ext ack warning */
+	afc_nl80211_log_ext_ack(nlh, err, nlh->nlmsg_seq);
+
+	req = afc_nl80211_pending_get(nlh->nlmsg_seq);
+	if (!req) {
+		afc_printf(MSG_DEBUG, "ack for unknown seq %u", nlh->nlmsg_seq);
+		return NL_OK;
+	}
+
+	stats.acked++;
+	afc_printf(MSG_INFO, "AFC info applied on %s (seq %u)", afc_nl80211_pending_ifname(req), req->seq);
+	afc_nl80211_pending_done(req, true);
+
+	return NL_OK;
+}
+
+static int afc_nl80211_error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+{
+	struct nlmsghdr *nlh = (struct nlmsghdr *)err - 1;
+	struct afc_nl80211_pending *req;
+
+	UNUSED_PARAM(nla);
+	UNUSED_PARAM(arg);
+
+	afc_nl80211_log_ext_ack(nlh, err, err->msg.nlmsg_seq);
+
+	req = afc_nl80211_pending_get(err->msg.nlmsg_seq);
+	if (!req) {
+		afc_printf(MSG_DEBUG, "error %d for unknown seq %u", err->error, err->msg.nlmsg_seq);
+		return NL_SKIP;
+	}
+
+	stats.errors++;
+	afc_printf(MSG_ERROR, "driver rejected AFC info on %s (seq %u) : %d",
+			   afc_nl80211_pending_ifname(req), req->seq, err->error);
+	afc_nl80211_pending_done(req, false);
+
+	return NL_SKIP;
+}
+
+static void afc_nl80211_receive(int sock, void *eloop_ctx, void *sock_ctx)
 {
 	int ret;
-	int ifidx;
-	char master_ifname[IFNAMSIZ] = VAP_NAME_6GHZ; /* TODO: Need to fetch the ifname */
-	struct nl_msg *msg;
-	size_t nlmsg_sz;
 
-	if (!state.nl_sock)
+	UNUSED_PARAM(sock);
+	UNUSED_PARAM(eloop_ctx);
+	UNUSED_PARAM(sock_ctx);
+
+	ret = nl_recvmsgs_default(state.nl_sock);
+	if (ret < 0 && ret != -NLE_AGAIN)
+		afc_printf(MSG_ERROR, "failed to receive NL: %d", ret);
+}
+
+static struct afc_nl80211_iface *afc_nl80211_iface_by_index(int ifindex)
+{
+	int idx;
+
+	for (idx = 0; idx < state.num_ifaces; idx++) {
+		if (state.ifaces[idx].ifindex == ifindex)
+			return &state.ifaces[idx];
+	}
+
+	return NULL;
+}
+
+static void afc_nl80211_repush(struct afc_nl80211_iface *iface);
+
+/* The driver reports the regdb source after every update: SERVER once a
+grant we pushed is in effect, which needs nothing, DEFAULT after a regdb
+reload, which only needs the grant we already hold. A power mode change
+needs a new inquiry. */
+static void afc_nl80211_regdb_event(struct afc_nl80211_iface *iface,
+				    const struct mxl_update_power_reg_info *info)
+{
+	size_t length;
+
+	afc_printf(MSG_INFO, "%s regdb update : flags %u oper_power_mode %u curr_power_mode %u",
+			   iface->ifname, info->flags, info->oper_power_mode, info->curr_power_mode);
+
+	if (iface->power_mode >= 0 && iface->power_mode != info->curr_power_mode) {
+		iface->power_mode = info->curr_power_mode;
+		afc_schedule_refresh("power mode change");
+		return;
+	}
+	iface->power_mode = info->curr_power_mode;
+
+	/* our own apply reports back, refreshing here would loop */
+	if (info->flags == AFC_UPDATE_STATUS_SERVER)
+		return;
+
+	if (afc_reg_rule_get_payload(&length))
+		afc_nl80211_repush(iface);
+	else
+		afc_schedule_refresh("regdb reset without grant");
+}
+
+static int afc_nl80211_event_handler(struct nl_msg *msg, void *arg)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *tb[NL80211_ATTR_MAX + 1];
+	struct afc_nl80211_iface *iface;
+
+	UNUSED_PARAM(arg);
+
+	if (gnlh->cmd != NL80211_CMD_VENDOR)
+		return NL_SKIP;
+
+	if (genlmsg_parse(nlmsg_hdr(msg), 0, tb, NL80211_ATTR_MAX, NULL) < 0)
+		return NL_SKIP;
+
+	if (!tb[NL80211_ATTR_VENDOR_ID] || !tb[NL80211_ATTR_VENDOR_SUBCMD] || !tb[NL80211_ATTR_IFINDEX])
+		return NL_SKIP;
+
+	if (nla_get_u32(tb[NL80211_ATTR_VENDOR_ID]) != OUI_LTQ ||
+		nla_get_u32(tb[NL80211_ATTR_VENDOR_SUBCMD]) != LTQ_NL80211_VENDOR_EVENT_REGDB_INFO_UPDATE)
+		return NL_SKIP;
+
+	iface = afc_nl80211_iface_by_index(nla_get_u32(tb[NL80211_ATTR_IFINDEX]));
+	if (!iface)
+		return NL_SKIP;
+
+	if (!tb[NL80211_ATTR_VENDOR_DATA] ||
+		nla_len(tb[NL80211_ATTR_VENDOR_DATA]) < (int)sizeof(struct mxl_update_power_reg_info)) {
+		afc_printf(MSG_ERROR, "malformed regdb update event on %s", iface->ifname);
+		return NL_SKIP;
+	}
+
+	afc_nl80211_regdb_event(iface, nla_data(tb[NL80211_ATTR_VENDOR_DATA]));
+
+	return NL_OK;
+}
+
+static void afc_nl80211_event_receive(int sock, void *eloop_ctx, void *sock_ctx)
+{
+	int ret;
+
+	UNUSED_PARAM(sock);
+	UNUSED_PARAM(eloop_ctx);
+	UNUSED_PARAM(sock_ctx);
+
+	ret = nl_recvmsgs_default(state.nl_event);
+	if (ret < 0 && ret != -NLE_AGAIN)
+		afc_printf(MSG_ERROR, "failed to receive NL event: %d", ret);
+}
+
+static int afc_nl80211_event_init(void)
+{
+	int grp_id;
+
+	state.nl_event = nl_socket_alloc();
+	if (!state.nl_event) {
+		afc_printf(MSG_ERROR, "failed to allocate netlink event socket");
 		return AFC_STATUS_FAILURE;
+	}
+
+	nl_socket_disable_seq_check(state.nl_event);
+	nl_socket_modify_cb(state.nl_event, NL_CB_VALID, NL_CB_CUSTOM, afc_nl80211_event_handler, NULL);
+
+	if (genl_connect(state.nl_event)) {
+		afc_printf(MSG_ERROR, "failed to connect netlink event socket");
+		goto fail;
+	}
+
+	grp_id = genl_ctrl_resolve_grp(state.nl_event, "nl80211", "vendor");
+	if (grp_id < 0) {
+		afc_printf(MSG_ERROR, "nl80211 vendor multicast group not found : %d", grp_id);
+		goto fail;
+	}
+
+	if (nl_socket_add_membership(state.nl_event, grp_id)) {
+		afc_printf(MSG_ERROR, "failed to join nl80211 vendor group");
+		goto fail;
+	}
+
+	if (nl_socket_set_nonblocking(state.nl_event) < 0) {
+		afc_printf(MSG_ERROR, "failed to set netlink event socket nonblocking");
+		goto fail;
+	}
+
+	if (eloop_register_read_sock(nl_socket_get_fd(state.nl_event), afc_nl80211_event_receive,
+				     NULL, NULL) < 0) {
+		afc_printf(MSG_ERROR, "eloop register netlink event sock failed");
+		goto fail;
+	}
+
+	return AFC_STATUS_SUCCESS;
+
+fail:
+	nl_socket_free(state.nl_event);
+	state.nl_event = NULL;
+	return AFC_STATUS_FAILURE;
+}
+
+static void afc_nl80211_event_deinit(void)
+{
+	if (!state.nl_event)
+		return;
+
+	eloop_unregister_read_sock(nl_socket_get_fd(state.nl_event));
+	nl_socket_free(state.nl_event);
+	state.nl_event = NULL;
+}
+
+int afc_nl80211_register_eloop(void)
+{
+	int fd = nl_socket_get_fd(state.nl_sock);
+
+	/* acks are matched against the pending table, not libnl's expected seq */
+	nl_socket_disable_seq_check(state.nl_sock);
+	nl_socket_modify_cb(state.nl_sock, NL_CB_ACK, NL_CB_CUSTOM, afc_nl80211_ack_handler, NULL);
+	nl_socket_modify_err_cb(state.nl_sock, NL_CB_CUSTOM, afc_nl80211_error_handler, NULL);
+
+	if (nl_socket_set_nonblocking(state.nl_sock) < 0) {
+		afc_printf(MSG_ERROR, "failed to set netlink socket nonblocking");
+		return AFC_STATUS_FAILURE;
+	}
+
+	if (eloop_register_read_sock(fd, afc_nl80211_receive, NULL, NULL) < 0) {
+		afc_printf(MSG_ERROR, "eloop register netlink sock failed");
+		return AFC_STATUS_FAILURE;
+	}
+	eloop_registered = true;
+
+	if (afc_nl80211_event_init())
+		afc_printf(MSG_ERROR, "vendor events unavailable, driver cannot request refreshes");
+
+	return AFC_STATUS_SUCCESS;
+}
+
+const struct afc_nl80211_stats *afc_nl80211_get_stats(void)
+{
+	return &stats;
+}
+
+static struct nl_msg *afc_nl80211_build_afc_info_msg(int ifidx, const uint8_t *data, size_t length)
+{
+	struct nl_msg *msg;
+	size_t nlmsg_sz;
 
 	nlmsg_sz = nlmsg_total_size(length + SIZE_OF_NLMSG_HDR);
 	msg = nlmsg_alloc_size(nlmsg_sz);
 	if (!msg) {
 		afc_printf(MSG_ERROR, "failed to allocate netlink message");
-		return AFC_STATUS_FAILURE;
+		return NULL;
 	}
 
 	if (!genlmsg_put(msg, NL_AUTO_PORT, NL_AUTO_SEQ, state.nl80211_id, 0, 0,
@@ -106,11 +548,6 @@ int afc_nl80211_send_afc_info_to_drv(const uint8_t *data, size_t length)
 		goto nla_put_failure;
 	}
 
-	ifidx = if_nametoindex(master_ifname);
-	afc_printf(MSG_INFO, "ifindex : %d", ifidx);
-	if (!ifidx)
-		goto nla_put_failure;
-
 	NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, ifidx);
 	NLA_PUT_U32(msg, NL80211_ATTR_VENDOR_ID, OUI_LTQ);
 	NLA_PUT_U32(msg, NL80211_ATTR_VENDOR_SUBCMD, LTQ_NL80211_VENDOR_SUBCMD_UPDATE_AFC_INFO);
@@ -122,22 +559,189 @@ int afc_nl80211_send_afc_info_to_drv(const uint8_t *data, size_t length)
 		goto nla_put_failure;
 	}
 
-	ret = nl_send_auto_complete(state.nl_sock, msg);
-	if (ret < 0) {
-		afc_printf(MSG_ERROR, "failed to send NL msg : %d", ret);
-		goto nla_put_failure;
+	return msg;
+
+nla_put_failure:
+	nlmsg_free(msg);
+	return NULL;
+}
+
+/* The same regdomain is queued to the selected 6GHz interfaces. Acks are
+collected from the event loop, the send only fails if nothing was queued. */
+static int afc_nl80211_send_batch(const uint8_t *data, size_t length, struct afc_nl80211_iface *only)
+{
+	int ret;
+	int idx, ifidx, queued = 0;
+	struct nl_msg *msg;
+	struct afc_nl80211_iface *iface;
+	struct afc_nl80211_pending *req;
+
+	for (idx = 0; idx < state.num_ifaces; idx++) {
+		iface = &state.ifaces[idx];
+		if (only && iface != only)
+			continue;
+
+		ifidx = afc_nl80211_iface_index(iface);
+		if (!ifidx) {
+			afc_printf(MSG_ERROR, "interface %s not found", iface->ifname);
+			continue;
+		}
+
+		req = afc_nl80211_pending_alloc();
+		if (!req) {
+			afc_printf(MSG_ERROR, "too many AFC info requests pending, skipping %s", iface->ifname);
+			iface->needs_push = true;
+			continue;
+		}
+
+		msg = afc_nl80211_build_afc_info_msg(ifidx, data, length);
+		if (!msg)
+			continue;
+
+		ret = nl_send_auto_complete(state.nl_sock, msg);
+		if (ret < 0) {
+			nlmsg_free(msg);
+			stats.send_errors++;
+			afc_printf(MSG_ERROR, "failed to send NL msg to %s : %d", iface->ifname, ret);
+			/* index may be stale if the interface was recreated */
+			iface->ifindex = 0;
+			continue;
+		}
+
+		req->active = true;
+		req->seq = nlmsg_hdr(msg)->nlmsg_seq;
+		req->iface_idx = idx;
+		req->ifindex = ifidx;
+		req->payload_gen = payload_gen;
+		nlmsg_free(msg);
+
+		req->timer = eloop_register_timer(AFC_NL80211_ACK_TIMEOUT_SEC, 0, afc_nl80211_ack_timeout, NULL, req);
+		if (req->timer == ELOOP_TIMER_NONE)
+			afc_printf(MSG_ERROR, "failed to arm ack timeout for seq %u", req->seq);
+
+		stats.tx++;
+		iface->needs_push = false;
+		queued++;
+		afc_printf(MSG_DEBUG, "AFC info queued to %s (seq %u)", iface->ifname, req->seq);
 	}
 
-	ret = nl_recvmsgs_default(state.nl_sock);
-	if (ret < 0) {
-		afc_printf(MSG_ERROR, "failed to receive NL: %d", ret);
-		goto nla_put_failure;
+	return queued ? AFC_STATUS_SUCCESS : AFC_STATUS_FAILURE;
+}
+
+int afc_nl80211_send_afc_info_to_drv(const uint8_t *data, size_t length)
+{
+	int idx;
+
+	if (!state.nl_sock)
+		return AFC_STATUS_FAILURE;
+
+	/* a new regdomain is published as a new grant, nobody has refused it yet */
+	payload_gen++;
+	for (idx = 0; idx < state.num_ifaces; idx++)
+		state.ifaces[idx].rejected = false;
+
+	if (!state.num_ifaces) {
+		strncpy(state.ifaces[0].ifname, VAP_NAME_6GHZ, IFNAMSIZ - 1);
+		state.ifaces[0].up = -1;
+		state.ifaces[0].power_mode = -1;
+		state.num_ifaces = 1;
 	}
 
-	nlmsg_free(msg);
+	return afc_nl80211_send_batch(data, length, NULL);
+}
+
+static void afc_nl80211_repush(struct afc_nl80211_iface *iface)
+{
+	const uint8_t *data;
+	size_t length;
+
+	data = afc_reg_rule_get_payload(&length);
+	if (!data) {
+		afc_printf(MSG_DEBUG, "no grant to re-apply on %s", iface->ifname);
+		return;
+	}
+
+	afc_printf(MSG_INFO, "re-applying cached grant on %s (ifindex %d)", iface->ifname, iface->ifindex);
+	afc_nl80211_send_batch(data, length, iface);
+}
+
+void afc_nl80211_link_event(const char *ifname, int ifindex, int present, int up)
+{
+	int idx;
+	struct afc_nl80211_iface *iface = NULL;
+
+	for (idx = 0; idx < state.num_ifaces; idx++) {
+		if (!strncmp(state.ifaces[idx].ifname, ifname, IFNAMSIZ)) {
+			iface = &state.ifaces[idx];
+			break;
+		}
+	}
+
+	if (!iface)
+		return;
+
+	if (!present) {
+		if (iface->ifindex == ifindex || !iface->ifindex) {
+			afc_printf(MSG_INFO, "%s (ifindex %d) removed", ifname, ifindex);
+			iface->ifindex = 0;
+			iface->up = 0;
+			iface->needs_push = true;
+		}
+		return;
+	}
+
+	if (iface->ifindex != ifindex) {
+		afc_printf(MSG_INFO, "%s ifindex %d -> %d", ifname, iface->ifindex, ifindex);
+		if (iface->ifindex || iface->up >= 0)
+			iface->needs_push = true;
+		iface->ifindex = ifindex;
+	}
+
+	if (iface->up == 1 && !up)
+		iface->needs_push = true;
+	iface->up = up;
+
+	if (up && iface->needs_push)
+		afc_nl80211_repush(iface);
+}
+
+void afc_nl80211_resync_ifaces(void)
+{
+	int idx, ifidx;
+
+	for (idx = 0; idx < state.num_ifaces; idx++) {
+		ifidx = if_nametoindex(state.ifaces[idx].ifname);
+		if (ifidx != state.ifaces[idx].ifindex) {
+			state.ifaces[idx].ifindex = ifidx;
+			state.ifaces[idx].needs_push = true;
+		}
+		/* link state is unknown after an overrun, push on the next up event */
+		state.ifaces[idx].up = -1;
+	}
+}
+
+static int afc_nl80211_start(void)
+{
+	if (afc_nl80211_register_eloop())
+		return AFC_STATUS_FAILURE;
+
+	if (afc_link_monitor_init())
+		afc_printf(MSG_ERROR, "link monitor init failed, interfaces are not tracked");
+
 	return AFC_STATUS_SUCCESS;
+}
 
-nla_put_failure:
-	nlmsg_free(msg);
-	return AFC_STATUS_FAILURE;
+static void afc_nl80211_deinit(void)
+{
+	afc_link_monitor_deinit();
+	afc_nl80211_cleanup();
 }
+
+const struct afc_driver_ops afc_driver_nl80211_ops = {
+	.name = "nl80211",
+	.init = afc_nl80211_init,
+	.start = afc_nl80211_start,
+	.deinit = afc_nl80211_deinit,
+	.set_ifaces = afc_nl80211_set_ifaces,
+	.apply = afc_nl80211_send_afc_info_to_drv,
+};
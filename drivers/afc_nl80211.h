@@ -7,17 +7,47 @@ this software module.
 
 *******************************************************************************/
 #include <stdio.h>
+#include <stdbool.h>
 #include <net/if.h>
 #include "nl80211.h"
 
 #define VAP_NAME_6GHZ "wlan4"
 #define SIZE_OF_NLMSG_HDR 64
+#define AFC_NL80211_MAX_IFACES 4
+#define AFC_NL80211_MAX_PENDING 16
+#define AFC_NL80211_ACK_TIMEOUT_SEC 5
+
+struct afc_nl80211_iface {
+	char ifname[IFNAMSIZ];
+	int ifindex; /* 0 until resolved, reset when the interface goes away */
+	int up; /* -1 until reported by the link monitor */
+	bool needs_push; /* recreated or went down since the grant was applied */
+	int power_mode; /* last 6GHz power mode reported by the driver, -1 if none */
+	bool rejected; /* the driver rejected or did not ack the current regdomain */
+};
 
 struct nl80211_state {
 	struct nl_sock *nl_sock;
+	struct nl_sock *nl_event; /* vendor multicast events */
 	int nl80211_id;
+	struct afc_nl80211_iface ifaces[AFC_NL80211_MAX_IFACES];
+	int num_ifaces;
+};
+
+struct afc_nl80211_stats {
+	uint32_t tx;
+	uint32_t acked;
+	uint32_t errors;
+	uint32_t timeouts;
+	uint32_t send_errors;
+	uint32_t ext_ack;
 };
 
 int afc_nl80211_init(void);
+int afc_nl80211_register_eloop(void);
+const struct afc_nl80211_stats *afc_nl80211_get_stats(void);
+int afc_nl80211_set_ifaces(char ifnames[][IFNAMSIZ], int num_ifnames);
 int afc_nl80211_send_afc_info_to_drv(const uint8_t *data, size_t length);
+void afc_nl80211_link_event(const char *ifname, int ifindex, int present, int up);
+void afc_nl80211_resync_ifaces(void);
 void afc_nl80211_cleanup(void);
@@ -13,10 +13,40 @@ this software module.
 #include <string.h>
 #include "afc_reg_rule.h"
 #include "afc.h"
-#include "afc_nl80211.h"
+#include "afc_driver.h"
 #include "utils.h"
 
-struct mxl_ieee80211_regdomain *regd;
+/* regdomain buffer is kept across spectrum inquiries and only grows when a
+response carries more rules than the current capacity */
+static struct mxl_ieee80211_regdomain *regd;
+static uint32_t regd_capacity;
+/* size of the last regdomain handed to the driver, 0 while none is valid */
+static size_t regd_len;
+
+/* 10 * log10(bw_mhz) in mBm, indexed by enum afc_bw_class */
+static const double afc_bw_log_mbm[AFC_NUM_BW_CLASS] = {
+	1301.0299956639812,	/* 20 MHz */
+	1602.0599913279624,	/* 40 MHz */
+	1903.0899869919436,	/* 80 MHz */
+	2204.1199826559248,	/* 160 MHz */
+	2505.1499783199060,	/* 320 MHz */
+};
+
+/* Ref: IEEE 802.11-20/0646r0, 320 MHz channels are listed with both overlapping sets */
+static const struct afc_6ghz_op_class afc_6ghz_op_class_tbl[AFC_6GHZ_NUM_OP_CLASS] = {
+	{ 131, 1, 4, 59, AFC_BW_20MHZ },
+	{ 132, 3, 8, 29, AFC_BW_40MHZ },
+	{ 133, 7, 16, 14, AFC_BW_80MHZ },
+	{ 134, 15, 32, 7, AFC_BW_160MHZ },
+	{ 137, 31, 32, 6, AFC_BW_320MHZ },
+};
+
+/* scratch space for deriving channel grants from frequency based responses */
+static double afc_psd_per_mhz[AFC_6GHZ_BAND_WIDTH_MHZ];
+static double afc_psd_per_subchan[AFC_6GHZ_NUM_SUBCHAN];
+static double afc_chan_psd[AFC_6GHZ_NUM_SUBCHAN];
+static int32_t afc_chan_eirp[AFC_6GHZ_NUM_SUBCHAN];
+static uint8_t afc_chan_cfi[AFC_6GHZ_NUM_SUBCHAN];
 
 static uint32_t afc_global_op_class_to_bw_khz(uint16_t global_op_cls)
 {
@@ -70,35 +100,73 @@ static uint32_t afc_calculate_6ghz_bandwidth(uint16_t low_freq, uint16_t high_fr
 	return bw;
 }
 
-static uint32_t afc_calculate_psd_to_eirp(double psd, uint32_t bw)
+enum afc_bw_class afc_bw_khz_to_class(uint32_t bw_khz)
 {
-	uint32_t eirp;
+	switch (REGLIB_KHZ_TO_MHZ(bw_khz)) {
+	case 20:
+		return AFC_BW_20MHZ;
+	case 40:
+		return AFC_BW_40MHZ;
+	case 80:
+		return AFC_BW_80MHZ;
+	case 160:
+		return AFC_BW_160MHZ;
+	case 320:
+		return AFC_BW_320MHZ;
+	default:
+		return AFC_NUM_BW_CLASS;
+	}
+}
 
-	bw = REGLIB_KHZ_TO_MHZ(bw);
-	eirp = (uint32_t)(PSD_TO_EIRP_CONVERSION(psd,bw));
+/* a plain loop over non-aliasing arrays with the table lookup hoisted out,
+so the compiler can vectorize it for whichever SIMD unit the target has
+without per-arch intrinsics */
+static void afc_psd_to_eirp_bulk(const double *restrict psd, size_t count, enum afc_bw_class bw,
+								 int32_t *restrict eirp_mbm)
+{
+	size_t i;
+	const double bw_mbm = afc_bw_log_mbm[bw];
 
-	return eirp;
+	for (i = 0; i < count; i++)
+		eirp_mbm[i] = afc_round_mbm(psd[i] * EIRP_UNIT_CONVERSION + bw_mbm);
 }
 
-static void afc_add_regulatory_rule(uint32_t idx, uint32_t start_freq_khz,
-									uint32_t end_freq_khz, uint32_t bw, uint32_t eirp)
+static int32_t afc_calculate_psd_to_eirp(double psd, uint32_t bw)
 {
-	if (start_freq_khz && end_freq_khz && bw && eirp) {
-		regd->reg_rules[idx].freq_range.start_freq_khz = start_freq_khz;
-		regd->reg_rules[idx].freq_range.end_freq_khz = end_freq_khz;
-		regd->reg_rules[idx].freq_range.max_bandwidth_khz = bw;
-		regd->reg_rules[idx].power_rule.max_eirp = (eirp * EIRP_UNIT_CONVERSION);
-	}
+	int32_t eirp_mbm;
+	enum afc_bw_class bw_class = afc_bw_khz_to_class(bw);
+
+	if (bw_class == AFC_NUM_BW_CLASS)
+		return 0;
+
+	afc_psd_to_eirp_bulk(&psd, 1, bw_class, &eirp_mbm);
+
+	return eirp_mbm;
+}
+
+static bool afc_add_regulatory_rule(uint32_t idx, uint32_t start_freq_khz,
+									uint32_t end_freq_khz, uint32_t bw, int32_t eirp_mbm)
+{
+	/* the driver takes an unsigned EIRP, a non-positive grant is not usable */
+	if (!start_freq_khz || !end_freq_khz || !bw || eirp_mbm <= 0)
+		return false;
+
+	regd->reg_rules[idx].freq_range.start_freq_khz = start_freq_khz;
+	regd->reg_rules[idx].freq_range.end_freq_khz = end_freq_khz;
+	regd->reg_rules[idx].freq_range.max_bandwidth_khz = bw;
+	regd->reg_rules[idx].power_rule.max_eirp = (uint32_t)eirp_mbm;
+
+	return true;
 }
 
-static void afc_process_chan_regrule_info(struct afc_spectrum_inquiry_resp *afc_response)
+static uint32_t afc_process_chan_regrule_info(struct afc_spectrum_inquiry_resp *afc_response)
 {
 	uint32_t num_chan_arr;
 	uint32_t chan_idx, reg_idx = 0;
 	uint32_t bw_khz;
 	uint32_t start_freq_khz;
 	uint32_t end_freq_khz;
-	uint32_t max_eirp;
+	int32_t max_eirp;
 	uint32_t center_freq;
 
 	for (num_chan_arr = 0; num_chan_arr < afc_response->num_chan_info; num_chan_arr++) {
@@ -113,31 +181,30 @@ static void afc_process_chan_regrule_info(struct afc_spectrum_inquiry_resp *afc_
 
 			start_freq_khz = center_freq - (REGLIB_KHZ_TO_MHZ(bw_khz) / 2);
 			end_freq_khz = center_freq + (REGLIB_KHZ_TO_MHZ(bw_khz) / 2);
-			max_eirp = (uint32_t)(afc_response->chan_info[num_chan_arr].max_eirp[chan_idx]);
-			afc_add_regulatory_rule(reg_idx, REGLIB_MHZ_TO_KHZ(start_freq_khz),
-									REGLIB_MHZ_TO_KHZ(end_freq_khz), bw_khz, max_eirp);
-			reg_idx += 1;
+			max_eirp = afc_round_mbm(afc_response->chan_info[num_chan_arr].max_eirp[chan_idx] *
+									 EIRP_UNIT_CONVERSION);
+			if (afc_add_regulatory_rule(reg_idx, REGLIB_MHZ_TO_KHZ(start_freq_khz),
+										REGLIB_MHZ_TO_KHZ(end_freq_khz), bw_khz, max_eirp))
+				reg_idx += 1;
 		}
 	}
+
+	return reg_idx;
 }
 
-static int afc_process_freq_and_chan_info(struct afc_spectrum_inquiry_resp *afc_response)
+static uint32_t afc_process_freq_and_chan_info(struct afc_spectrum_inquiry_resp *afc_response)
 {
 	uint8_t rule_exist;
-	uint16_t next_num_rule;
-	uint32_t eirp;
-	uint32_t freq_iter, chan_iter, chan_idx;
+	uint32_t next_num_rule;
+	int32_t eirp;
+	uint32_t freq_iter, chan_iter;
 	uint32_t start_freq_khz;
 	uint32_t end_freq_khz;
 	uint32_t bw;
-	uint32_t chan_last_idx = 0;
-
-	for (chan_idx = 0; chan_idx < afc_response->num_chan_info; chan_idx++)
-		chan_last_idx += afc_response->chan_info[chan_idx].num_chan_cfi;
+	uint32_t chan_last_idx;
 
+	chan_last_idx = afc_process_chan_regrule_info(afc_response);
 	next_num_rule = chan_last_idx;
-	if (afc_response->num_chan_info)
-		afc_process_chan_regrule_info(afc_response);
 
 	for (freq_iter = 0; freq_iter <  afc_response->num_freq_info; freq_iter++) {
 		rule_exist = 0;
@@ -153,7 +220,7 @@ static int afc_process_freq_and_chan_info(struct afc_spectrum_inquiry_resp *afc_
 		/* below check is to avoid the duplicate regulatory rule in the regd because
 		there is a possibility to receive same data in channel and freq response */
 		for (chan_iter = 0; chan_iter < chan_last_idx; chan_iter++) {
-			if (eirp == (regd->reg_rules[chan_iter].power_rule.max_eirp/EIRP_UNIT_CONVERSION)) {
+			if ((uint32_t)eirp == regd->reg_rules[chan_iter].power_rule.max_eirp) {
 				if (start_freq_khz == regd->reg_rules[chan_iter].freq_range.start_freq_khz &&
 							end_freq_khz == regd->reg_rules[chan_iter].freq_range.end_freq_khz) {
 					rule_exist = 1;
@@ -162,32 +229,128 @@ static int afc_process_freq_and_chan_info(struct afc_spectrum_inquiry_resp *afc_
 			}
 		}
 
-		if (!rule_exist) {
-			afc_add_regulatory_rule(next_num_rule, start_freq_khz, end_freq_khz, bw, eirp);
+		if (!rule_exist &&
+			afc_add_regulatory_rule(next_num_rule, start_freq_khz, end_freq_khz, bw, eirp))
 			next_num_rule++;
-		}
 	}
-	return (next_num_rule - 1);
+
+	return next_num_rule;
 }
 
-static void afc_process_freq_regrule_info(struct afc_spectrum_inquiry_resp *afc_response)
+static void afc_build_subchan_psd_map(struct afc_spectrum_inquiry_resp *afc_response)
 {
 	int freq_idx;
-	uint32_t bw;
-	uint32_t eirp;
+	uint32_t freq, low, high, subchan, mhz;
+	double psd, min_psd, max_psd;
 
+	for (mhz = 0; mhz < AFC_6GHZ_BAND_WIDTH_MHZ; mhz++)
+		afc_psd_per_mhz[mhz] = AFC_PSD_UNAVAILABLE;
+
+	/* a frequency covered by several ranges takes the most restrictive PSD */
 	for (freq_idx = 0; freq_idx < afc_response->num_freq_info; freq_idx++) {
-		bw = afc_calculate_6ghz_bandwidth(afc_response->freq_info[freq_idx].freq_range.low_frequency,
-										  afc_response->freq_info[freq_idx].freq_range.high_frequency);
-		if (!bw)
+		low = afc_response->freq_info[freq_idx].freq_range.low_frequency;
+		high = afc_response->freq_info[freq_idx].freq_range.high_frequency;
+		psd = afc_response->freq_info[freq_idx].max_psd;
+
+		if (low < AFC_6GHZ_BAND_START_MHZ)
+			low = AFC_6GHZ_BAND_START_MHZ;
+		if (high > AFC_6GHZ_BAND_END_MHZ)
+			high = AFC_6GHZ_BAND_END_MHZ;
+
+		for (freq = low; freq < high; freq++) {
+			mhz = freq - AFC_6GHZ_BAND_START_MHZ;
+			if (psd < afc_psd_per_mhz[mhz])
+				afc_psd_per_mhz[mhz] = psd;
+		}
+	}
+
+	/* a 20 MHz subchannel is usable only if every MHz of it was granted */
+	for (subchan = 0; subchan < AFC_6GHZ_NUM_SUBCHAN; subchan++) {
+		min_psd = AFC_PSD_UNAVAILABLE;
+		max_psd = -AFC_PSD_UNAVAILABLE;
+		for (mhz = subchan * AFC_6GHZ_SUBCHAN_MHZ; mhz < (subchan + 1) * AFC_6GHZ_SUBCHAN_MHZ; mhz++) {
+			if (afc_psd_per_mhz[mhz] < min_psd)
+				min_psd = afc_psd_per_mhz[mhz];
+			if (afc_psd_per_mhz[mhz] > max_psd)
+				max_psd = afc_psd_per_mhz[mhz];
+		}
+		afc_psd_per_subchan[subchan] = (max_psd == AFC_PSD_UNAVAILABLE) ? AFC_PSD_UNAVAILABLE : min_psd;
+	}
+}
+
+static uint32_t afc_derive_op_class_regrules(const struct afc_6ghz_op_class *op_class, uint32_t reg_idx)
+{
+	uint32_t chan, subchan, first_subchan, num_subchan;
+	uint32_t num_usable = 0;
+	uint32_t center_freq, half_bw_mhz;
+	uint32_t bw_khz;
+	uint8_t cfi;
+	double psd;
+
+	/* each bandwidth class doubles the number of occupied 20 MHz subchannels */
+	num_subchan = 1 << op_class->bw;
+	bw_khz = REGLIB_MHZ_TO_KHZ(AFC_6GHZ_SUBCHAN_MHZ * num_subchan);
+	half_bw_mhz = (AFC_6GHZ_SUBCHAN_MHZ * num_subchan) / 2;
+
+	/* the channel PSD is the minimum PSD across its occupied subchannels */
+	for (chan = 0; chan < op_class->num_chan; chan++) {
+		cfi = op_class->first_cfi + chan * op_class->cfi_step;
+		first_subchan = (cfi - op_class->first_cfi) / AFC_6GHZ_CFI_PER_SUBCHAN;
+		psd = AFC_PSD_UNAVAILABLE;
+		for (subchan = first_subchan; subchan < first_subchan + num_subchan; subchan++) {
+			if (afc_psd_per_subchan[subchan] == AFC_PSD_UNAVAILABLE) {
+				psd = AFC_PSD_UNAVAILABLE;
+				break;
+			}
+			if (afc_psd_per_subchan[subchan] < psd)
+				psd = afc_psd_per_subchan[subchan];
+		}
+
+		if (psd == AFC_PSD_UNAVAILABLE)
 			continue;
 
-		eirp = afc_calculate_psd_to_eirp(afc_response->freq_info[freq_idx].max_psd, bw);
-		afc_add_regulatory_rule(freq_idx,
-				REGLIB_MHZ_TO_KHZ(afc_response->freq_info[freq_idx].freq_range.low_frequency),
-				REGLIB_MHZ_TO_KHZ(afc_response->freq_info[freq_idx].freq_range.high_frequency),
-				bw, eirp);
+		afc_chan_cfi[num_usable] = cfi;
+		afc_chan_psd[num_usable] = psd;
+		num_usable++;
+	}
+
+	afc_psd_to_eirp_bulk(afc_chan_psd, num_usable, op_class->bw, afc_chan_eirp);
+
+	for (chan = 0; chan < num_usable; chan++) {
+		center_freq = afc_6ghz_channel_to_freq(afc_chan_cfi[chan]);
+		if (afc_add_regulatory_rule(reg_idx, REGLIB_MHZ_TO_KHZ(center_freq - half_bw_mhz),
+									REGLIB_MHZ_TO_KHZ(center_freq + half_bw_mhz), bw_khz,
+									afc_chan_eirp[chan]))
+			reg_idx++;
 	}
+
+	return reg_idx;
+}
+
+/* AFC system returned only availableFrequencyInfo: derive the per-channel
+max EIRP for every 6GHz global operating class from the granted PSD ranges */
+static uint32_t afc_process_freq_regrule_info(struct afc_spectrum_inquiry_resp *afc_response)
+{
+	uint32_t op_class_idx;
+	uint32_t reg_idx = 0;
+
+	afc_build_subchan_psd_map(afc_response);
+
+	for (op_class_idx = 0; op_class_idx < AFC_6GHZ_NUM_OP_CLASS; op_class_idx++)
+		reg_idx = afc_derive_op_class_regrules(&afc_6ghz_op_class_tbl[op_class_idx], reg_idx);
+
+	return reg_idx;
+}
+
+static uint32_t afc_6ghz_max_chan_rules(void)
+{
+	uint32_t op_class_idx;
+	uint32_t num_chan = 0;
+
+	for (op_class_idx = 0; op_class_idx < AFC_6GHZ_NUM_OP_CLASS; op_class_idx++)
+		num_chan += afc_6ghz_op_class_tbl[op_class_idx].num_chan;
+
+	return num_chan;
 }
 
 static size_t afc_reglib_array_len(size_t baselen, unsigned int elemcount, size_t elemlen)
@@ -200,6 +363,34 @@ static size_t afc_reglib_array_len(size_t baselen, unsigned int elemcount, size_
 	return baselen + elemcount * elemlen;
 }
 
+static int afc_regd_reserve(uint32_t num_rules)
+{
+	size_t reg_size;
+
+	reg_size = afc_reglib_array_len(sizeof(struct mxl_ieee80211_regdomain),
+									num_rules, sizeof(struct ieee80211_reg_rule));
+	if (!reg_size)
+		return AFC_STATUS_FAILURE;
+
+	if (regd && num_rules <= regd_capacity) {
+		memset(regd, 0, reg_size);
+		return AFC_STATUS_SUCCESS;
+	}
+
+	/* previous rules are rebuilt from the response, so no need to preserve them */
+	free(regd);
+	regd = (struct mxl_ieee80211_regdomain *)zalloc(reg_size);
+	if (!regd) {
+		regd_capacity = 0;
+		return AFC_STATUS_FAILURE;
+	}
+
+	afc_printf(MSG_DEBUG, "regdomain buffer grown from %u to %u rules", regd_capacity, num_rules);
+	regd_capacity = num_rules;
+
+	return AFC_STATUS_SUCCESS;
+}
+
 static void afc_print_reg_rule_data(struct mxl_ieee80211_regdomain *regd)
 {
 	int reg_rule_idx;
@@ -209,76 +400,91 @@ static void afc_print_reg_rule_data(struct mxl_ieee80211_regdomain *regd)
 			   "max_bandwidth_mhz", "max_eirp_dbm");
 
 	for (reg_rule_idx = 0; reg_rule_idx < regd->n_reg_rules; reg_rule_idx++) {
-		afc_printf(MSG_INFO, "%-4d %-15d %-15d %-20d %-10d", reg_rule_idx,
+		afc_printf(MSG_INFO, "%-4d %-15d %-15d %-20d %-10.2f", reg_rule_idx,
 				   REGLIB_KHZ_TO_MHZ(regd->reg_rules[reg_rule_idx].freq_range.start_freq_khz),
 				   REGLIB_KHZ_TO_MHZ(regd->reg_rules[reg_rule_idx].freq_range.end_freq_khz),
 				   REGLIB_KHZ_TO_MHZ(regd->reg_rules[reg_rule_idx].freq_range.max_bandwidth_khz),
-				   regd->reg_rules[reg_rule_idx].power_rule.max_eirp/EIRP_UNIT_CONVERSION);
+				   (double)regd->reg_rules[reg_rule_idx].power_rule.max_eirp / EIRP_UNIT_CONVERSION);
 	}
 }
 
 int afc_construct_regrule_from_afc_response(void *data)
 {
 	int chan_idx;
-	int num_rules;
-	int new_num_rules;
+	uint32_t num_rules;
+	uint32_t num_chan_rules;
 	size_t reg_size;
 	struct afc_spectrum_inquiry_resp *afc_response = (struct afc_spectrum_inquiry_resp *)data;
 
-	/* calculating the number of reg rules from the sum of freq and channel resp.
+	/* calculating the upper bound of reg rules from the sum of freq and channel resp.
 	the values in the channel cfi is for each global_op_class of 6GHz, so iterate
 	through the loop of channel resp to find out the num of channel rule*/
-	num_rules = afc_response->num_freq_info;
+	num_chan_rules = 0;
 	for (chan_idx = 0; chan_idx < afc_response->num_chan_info; chan_idx++)
-		num_rules += afc_response->chan_info[chan_idx].num_chan_cfi;
+		num_chan_rules += afc_response->chan_info[chan_idx].num_chan_cfi;
 
-	reg_size = afc_reglib_array_len(sizeof(struct mxl_ieee80211_regdomain),
-									num_rules , sizeof(struct ieee80211_reg_rule));
-	afc_printf(MSG_INFO, "reg_size = %zu", reg_size);
-	if (!reg_size)
-		return AFC_STATUS_FAILURE;
+	num_rules = afc_response->num_freq_info + num_chan_rules;
 
-	regd = (struct mxl_ieee80211_regdomain *)zalloc(reg_size);
-	if (!regd)
+	/* frequency only response is expanded to every channel of every op class */
+	if (afc_response->num_freq_info && !afc_response->num_chan_info)
+		num_rules = afc_6ghz_max_chan_rules();
+
+	regd_len = 0;
+	if (afc_regd_reserve(num_rules))
 		return AFC_STATUS_FAILURE;
 
-	regd->n_reg_rules = num_rules;
 	memcpy(regd->alpha2, afc_response->country, 2);
 
 	afc_printf(MSG_INFO, "number of frequency information : %d", afc_response->num_freq_info);
-	afc_printf(MSG_INFO, "number of channel information : %d", (num_rules - afc_response->num_freq_info));
+	afc_printf(MSG_INFO, "number of channel information : %u", num_chan_rules);
 
 	if (afc_response->num_freq_info && afc_response->num_chan_info) {
 		afc_printf(MSG_INFO, "construct regulatory rule from frequency and channel based response");
-		new_num_rules = afc_process_freq_and_chan_info(afc_response);
-		/* update the num of reg rule after removing the duplicate data */
-		regd->n_reg_rules = new_num_rules;
-		reg_size = afc_reglib_array_len(sizeof(struct mxl_ieee80211_regdomain), new_num_rules,
-										sizeof(struct ieee80211_reg_rule));
-		if (!reg_size)
-			goto fail;
+		regd->n_reg_rules = afc_process_freq_and_chan_info(afc_response);
 	} else if (afc_response->num_freq_info) {
-		afc_printf(MSG_INFO, "construct regulatory rule from frequency based response");
-		afc_process_freq_regrule_info(afc_response);
+		afc_printf(MSG_INFO, "derive channel regulatory rules from frequency based response");
+		regd->n_reg_rules = afc_process_freq_regrule_info(afc_response);
 	} else if (afc_response->num_chan_info) {
 		afc_printf(MSG_INFO, "construct regulatory rule from channel based response");
-		afc_process_chan_regrule_info(afc_response);
+		regd->n_reg_rules = afc_process_chan_regrule_info(afc_response);
 	} else {
 		afc_printf(MSG_ERROR, "no valid data from AFC server,so "
 				   "sending number of regulatory rules as zero");
 		regd->n_reg_rules = 0;
 	}
 
+	/* only the populated rules are sent, skipped and duplicate entries are trimmed */
+	reg_size = afc_reglib_array_len(sizeof(struct mxl_ieee80211_regdomain), regd->n_reg_rules,
+									sizeof(struct ieee80211_reg_rule));
+	afc_printf(MSG_INFO, "reg_size = %zu", reg_size);
+	if (!reg_size)
+		return AFC_STATUS_FAILURE;
+
 	if (regd->n_reg_rules)
 		afc_print_reg_rule_data(regd);
 
-	if (afc_nl80211_send_afc_info_to_drv(regd, reg_size))
-		goto fail;
+	regd_len = reg_size;
+	if (afc_driver_apply((const uint8_t *)regd, reg_size))
+		return AFC_STATUS_FAILURE;
 
-	free(regd);
 	return AFC_STATUS_SUCCESS;
+}
+
+const uint8_t *afc_reg_rule_get_payload(size_t *length)
+{
+	*length = regd_len;
+	return regd_len ? (const uint8_t *)regd : NULL;
+}
 
-fail:
+const struct mxl_ieee80211_regdomain *afc_reg_rule_get_regd(void)
+{
+	return regd;
+}
+
+void afc_reg_rule_deinit(void)
+{
 	free(regd);
-	return AFC_STATUS_FAILURE;
+	regd = NULL;
+	regd_capacity = 0;
+	regd_len = 0;
 }
@@ -9,13 +9,49 @@ this software module.
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <math.h>
+#include <stddef.h>
 #include "nl80211.h"
 
 #define REGLIB_MHZ_TO_KHZ(freq) ((freq) * 1000)
 #define REGLIB_KHZ_TO_MHZ(freq) ((freq) / 1000)
-#define EIRP_UNIT_CONVERSION 100
-#define PSD_TO_EIRP_CONVERSION(psd,bw) (psd + (10 * (log10(bw))))
+#define EIRP_UNIT_CONVERSION 100 /* dBm to mBm */
+
+/* round to nearest without a branch: biasing by a positive offset makes the
+truncating conversion behave as floor() over the whole 6GHz power range */
+#define AFC_MBM_ROUND_BIAS 1048576
+
+static inline int32_t afc_round_mbm(double mbm)
+{
+	return (int32_t)(mbm + 0.5 + AFC_MBM_ROUND_BIAS) - AFC_MBM_ROUND_BIAS;
+}
+
+/* 6GHz channel widths, used as index into the 10*log10(bw) table */
+enum afc_bw_class {
+	AFC_BW_20MHZ,
+	AFC_BW_40MHZ,
+	AFC_BW_80MHZ,
+	AFC_BW_160MHZ,
+	AFC_BW_320MHZ,
+	AFC_NUM_BW_CLASS
+};
+
+/* 6GHz band is split in 20 MHz subchannels from channel 1 (5955 MHz) to 233 (7115 MHz) */
+#define AFC_6GHZ_BAND_START_MHZ 5945
+#define AFC_6GHZ_BAND_END_MHZ 7125
+#define AFC_6GHZ_BAND_WIDTH_MHZ (AFC_6GHZ_BAND_END_MHZ - AFC_6GHZ_BAND_START_MHZ)
+#define AFC_6GHZ_SUBCHAN_MHZ 20
+#define AFC_6GHZ_NUM_SUBCHAN (AFC_6GHZ_BAND_WIDTH_MHZ / AFC_6GHZ_SUBCHAN_MHZ)
+#define AFC_6GHZ_CFI_PER_SUBCHAN 4
+#define AFC_6GHZ_NUM_OP_CLASS 5
+#define AFC_PSD_UNAVAILABLE 1e9
+
+struct afc_6ghz_op_class {
+	uint16_t global_op_class;
+	uint8_t first_cfi;
+	uint8_t cfi_step;
+	uint8_t num_chan;
+	enum afc_bw_class bw;
+};
 
 struct ieee80211_freq_range {
 	uint32_t  start_freq_khz;
@@ -63,4 +99,8 @@ struct mxl_ieee80211_regdomain {
 	struct ieee80211_reg_rule reg_rules[];
 };
 
-int afc_construct_regrule_from_afc_response(void *data);
\ No newline at end of file
+enum afc_bw_class afc_bw_khz_to_class(uint32_t bw_khz);
+int afc_construct_regrule_from_afc_response(void *data);
+const struct mxl_ieee80211_regdomain *afc_reg_rule_get_regd(void);
+const uint8_t *afc_reg_rule_get_payload(size_t *length);
+void afc_reg_rule_deinit(void);
\ No newline at end of file
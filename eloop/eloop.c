@@ -1,11 +1,14 @@
 /*
- * Event loop based on select() loop
+ * Event loop based on select() loop, or epoll() with CONFIG_ELOOP_EPOLL.
+ * CONFIG_ELOOP_SIGNALFD and CONFIG_ELOOP_TIMERFD deliver signals and
+ * timeouts through descriptors dispatched like any other socket.
  * Copyright (c) 2002-2009, Jouni Malinen <j@w1.fi>
  *
  * This software may be distributed under the terms of the BSD license.
  */
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,28 +16,61 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/timerfd.h>
 #include "list.h"
 #include "eloop.h"
 
+#ifdef CONFIG_ELOOP_EPOLL
+#include <sys/epoll.h>
+#endif /* CONFIG_ELOOP_EPOLL */
+
+#ifdef CONFIG_ELOOP_SIGNALFD
+#include <sys/signalfd.h>
+#endif /* CONFIG_ELOOP_SIGNALFD */
+
 struct eloop_sock {
 	int sock;
 	void *eloop_data;
 	void *user_data;
 	eloop_sock_handler handler;
+	void *site; /* registration site, NULL for eloop's own fds */
 };
 
+/* Timeouts live in a slot array indexed by a binary min-heap. Slots are
+ * also chained per handler in a small hash, so lookups by handler and the
+ * handle based API do not need to scan all timeouts. */
+#define ELOOP_TIMEOUT_MIN_SLOTS 16
+#define ELOOP_TIMEOUT_HASH_SIZE 64
+
 struct eloop_timeout {
-	struct dl_list list;
 	struct reltime time;
+	unsigned long seq; /* registration order, FIFO among equal deadlines */
+	void *eloop_data;
+	void *user_data;
+	eloop_timeout_handler handler;
+	void *site;
+	unsigned int gen; /* bumped on every reuse of the slot */
+	int heap_idx; /* -1 while the slot is free */
+	int hash_prev;
+	int hash_next; /* also the free list link */
+};
+
+/* wall clock deadline, one CLOCK_REALTIME timerfd each */
+struct eloop_deadline {
+	struct dl_list list;
+	int fd;
+	time_t deadline;
 	void *eloop_data;
 	void *user_data;
 	eloop_timeout_handler handler;
+	void *site;
 };
 
 struct eloop_signal {
 	int sig;
 	void *user_data;
 	eloop_signal_handler handler;
+	void *site;
 	int signaled;
 };
 
@@ -45,42 +81,344 @@ struct eloop_sock_table {
 	int changed;
 };
 
+#ifdef CONFIG_ELOOP_EPOLL
+#define ELOOP_EPOLL_MIN_EVENTS 8
+
+/* per fd registrations, a socket may have a reader and a writer at once */
+struct eloop_fd {
+	struct eloop_sock sock[EVENT_TYPE_EXCEPTION + 1];
+	uint32_t events;
+};
+#endif /* CONFIG_ELOOP_EPOLL */
+
 struct eloop_data {
 	int max_sock;
+#ifdef CONFIG_ELOOP_EPOLL
+	int max_fd;
+	struct eloop_fd *fd_table;
+	int epollfd;
+	int epoll_max_event_num;
+	struct epoll_event *epoll_events;
+#endif /* CONFIG_ELOOP_EPOLL */
 
 	int count; /* sum of all table counts */
 	struct eloop_sock_table readers;
 	struct eloop_sock_table writers;
 	struct eloop_sock_table exceptions;
 
-	struct dl_list timeout;
+	struct eloop_timeout *timers;
+	int timer_slots;
+	int timer_free;
+	int *timer_heap;
+	int timer_count;
+	int timer_hash[ELOOP_TIMEOUT_HASH_SIZE];
+	unsigned long timer_seq;
+
+	struct dl_list deadlines;
 
 	int signal_count;
 	struct eloop_signal *signals;
 	int signaled;
 	int pending_terminate;
+#ifdef CONFIG_ELOOP_SIGNALFD
+	int signal_fd;
+	sigset_t signal_mask;
+#endif /* CONFIG_ELOOP_SIGNALFD */
+#ifdef CONFIG_ELOOP_TIMERFD
+	int timer_fd;
+	struct reltime timer_fd_armed; /* sec == 0 while disarmed */
+#endif /* CONFIG_ELOOP_TIMERFD */
+	int internal_readers; /* eloop's own fds, not counted as work */
+
+	struct eloop_stats stats;
+	unsigned long long stall_usec; /* 0 while stall reporting is off */
+	eloop_stall_handler stall_handler;
+	void *stall_ctx;
 
 	int terminate;
 };
 
 static struct eloop_data eloop;
 
+#define ELOOP_CALLER() __builtin_return_address(0)
+#define ELOOP_FUNC(f) ((const void *) (uintptr_t) (f))
+
+static int eloop_sock_add(int sock, eloop_event_type type,
+			  eloop_sock_handler handler, void *eloop_data,
+			  void *user_data, void *site);
+
+#ifdef CONFIG_ELOOP_TIMERFD
+static void eloop_timerfd_receive(int sock, void *eloop_ctx, void *sock_ctx);
+#endif /* CONFIG_ELOOP_TIMERFD */
+
 
 #define eloop_trace_sock_add_ref(table) do { } while (0)
 #define eloop_trace_sock_remove_ref(table) do { } while (0)
 
 
+static unsigned long long eloop_usec_since(struct reltime *start,
+					   struct reltime *now)
+{
+	struct reltime diff;
+
+	get_reltime(now);
+	if (reltime_before(now, start))
+		return 0;
+	reltime_sub(now, start, &diff);
+
+	return (unsigned long long) diff.sec * 1000000ULL + diff.usec;
+}
+
+
+static void eloop_stats_hist(unsigned long *hist, unsigned long long usec)
+{
+	int bucket = usec ? 64 - __builtin_clzll(usec) : 0;
+
+	if (bucket >= ELOOP_STATS_BUCKETS)
+		bucket = ELOOP_STATS_BUCKETS - 1;
+	hist[bucket]++;
+}
+
+
+/* One entry per handler and site, kept sorted with the slowest first */
+static void eloop_stats_slowest(const struct eloop_slow_handler *call)
+{
+	struct eloop_stats *stats = &eloop.stats;
+	struct eloop_slow_handler tmp;
+	int i;
+
+	for (i = 0; i < stats->num_slowest; i++) {
+		if (stats->slowest[i].handler == call->handler &&
+		    stats->slowest[i].site == call->site &&
+		    stats->slowest[i].kind == call->kind)
+			break;
+	}
+
+	if (i < stats->num_slowest) {
+		if (call->usec <= stats->slowest[i].usec)
+			return;
+		stats->slowest[i].usec = call->usec;
+	} else if (stats->num_slowest < ELOOP_STATS_SLOWEST) {
+		stats->slowest[stats->num_slowest++] = *call;
+	} else {
+		i = ELOOP_STATS_SLOWEST - 1;
+		if (call->usec <= stats->slowest[i].usec)
+			return;
+		stats->slowest[i] = *call;
+	}
+
+	for (; i > 0 && stats->slowest[i - 1].usec < stats->slowest[i].usec;
+	     i--) {
+		tmp = stats->slowest[i - 1];
+		stats->slowest[i - 1] = stats->slowest[i];
+		stats->slowest[i] = tmp;
+	}
+}
+
+
+/* Accounts a callback that was started at @start */
+static void eloop_stats_call(const void *handler, const void *site,
+			     const char *kind, struct reltime *start)
+{
+	struct eloop_slow_handler call;
+	struct reltime now;
+
+	call.handler = handler;
+	call.site = site;
+	call.kind = kind;
+	call.usec = eloop_usec_since(start, &now);
+
+	eloop.stats.callbacks++;
+	eloop_stats_slowest(&call);
+
+	if (eloop.stall_usec && call.usec >= eloop.stall_usec) {
+		eloop.stats.stalls++;
+		if (eloop.stall_handler)
+			eloop.stall_handler(&call, eloop.stall_ctx);
+	}
+}
+
+
+static const char *eloop_event_type_name(eloop_event_type type)
+{
+	switch (type) {
+	case EVENT_TYPE_READ:
+		return "read";
+	case EVENT_TYPE_WRITE:
+		return "write";
+	case EVENT_TYPE_EXCEPTION:
+		return "exception";
+	}
+
+	return "unknown";
+}
+
+
+/* eloop's own fds (site == NULL) are not accounted, the timeout, deadline
+ * and signal handlers they run are. es points into the socket tables, which
+ * the handler may grow or compact by registering or unregistering fds, so
+ * nothing is read from it once the handler runs */
+static void eloop_sock_call(struct eloop_sock *es, eloop_event_type type)
+{
+	eloop_sock_handler handler = es->handler;
+	void *site = es->site;
+	struct reltime start;
+
+	if (site == NULL) {
+		handler(es->sock, es->eloop_data, es->user_data);
+		return;
+	}
+
+	get_reltime(&start);
+	handler(es->sock, es->eloop_data, es->user_data);
+	eloop_stats_call(ELOOP_FUNC(handler), site, eloop_event_type_name(type), &start);
+}
+
+
+const struct eloop_stats *eloop_get_stats(void)
+{
+	return &eloop.stats;
+}
+
+
+void eloop_reset_stats(void)
+{
+	memset(&eloop.stats, 0, sizeof(eloop.stats));
+}
+
+
+void eloop_set_stall_handler(unsigned int threshold_ms,
+			     eloop_stall_handler handler, void *ctx)
+{
+	eloop.stall_usec = threshold_ms * 1000ULL;
+	eloop.stall_handler = handler;
+	eloop.stall_ctx = ctx;
+}
+
+
 int eloop_init(void)
 {
+	int i;
+
 	memset(&eloop, 0, sizeof(eloop));
-	dl_list_init(&eloop.timeout);
+	eloop.timer_free = -1;
+	dl_list_init(&eloop.deadlines);
+	for (i = 0; i < ELOOP_TIMEOUT_HASH_SIZE; i++)
+		eloop.timer_hash[i] = -1;
+#ifdef CONFIG_ELOOP_EPOLL
+	eloop.epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (eloop.epollfd < 0)
+		return -1;
+	eloop.epoll_events = realloc_array(NULL, ELOOP_EPOLL_MIN_EVENTS,
+					   sizeof(struct epoll_event));
+	if (eloop.epoll_events == NULL) {
+		close(eloop.epollfd);
+		return -1;
+	}
+	eloop.epoll_max_event_num = ELOOP_EPOLL_MIN_EVENTS;
+#endif /* CONFIG_ELOOP_EPOLL */
+	eloop.readers.type = EVENT_TYPE_READ;
+	eloop.writers.type = EVENT_TYPE_WRITE;
+	eloop.exceptions.type = EVENT_TYPE_EXCEPTION;
+#ifdef CONFIG_ELOOP_SIGNALFD
+	eloop.signal_fd = -1;
+	sigemptyset(&eloop.signal_mask);
+#endif /* CONFIG_ELOOP_SIGNALFD */
+#ifdef CONFIG_ELOOP_TIMERFD
+	eloop.timer_fd = timerfd_create(get_reltime_clock(),
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (eloop.timer_fd < 0 ||
+	    eloop_sock_add(eloop.timer_fd, EVENT_TYPE_READ,
+			   eloop_timerfd_receive, NULL, NULL, NULL) < 0)
+		return -1;
+	eloop.internal_readers++;
+#endif /* CONFIG_ELOOP_TIMERFD */
+	return 0;
+}
+
+
+#ifdef CONFIG_ELOOP_EPOLL
+static uint32_t eloop_epoll_events(eloop_event_type type)
+{
+	switch (type) {
+	case EVENT_TYPE_READ:
+		return EPOLLIN;
+	case EVENT_TYPE_WRITE:
+		return EPOLLOUT;
+	case EVENT_TYPE_EXCEPTION:
+		return EPOLLPRI;
+	}
+
+	return 0;
+}
+
+
+static int eloop_sock_queue(int sock, uint32_t events)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (events == eloop.fd_table[sock].events)
+		return 0;
+
+	if (!events)
+		op = EPOLL_CTL_DEL;
+	else if (!eloop.fd_table[sock].events)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = sock;
+	if (epoll_ctl(eloop.epollfd, op, sock, &ev) < 0) {
+		/* the fd may already be closed on removal */
+		if (op != EPOLL_CTL_DEL)
+			return -1;
+	}
+	eloop.fd_table[sock].events = events;
+
+	return 0;
+}
+
+
+static int eloop_epoll_reserve(int sock)
+{
+	struct eloop_fd *temp_table;
+	struct epoll_event *temp_events;
+	int next;
+
+	if (sock >= eloop.max_fd) {
+		next = sock + 16;
+		temp_table = realloc_array(eloop.fd_table, next,
+					   sizeof(struct eloop_fd));
+		if (temp_table == NULL)
+			return -1;
+		memset(&temp_table[eloop.max_fd], 0,
+		       (next - eloop.max_fd) * sizeof(struct eloop_fd));
+		eloop.max_fd = next;
+		eloop.fd_table = temp_table;
+	}
+
+	if (eloop.count + 1 > eloop.epoll_max_event_num) {
+		next = eloop.epoll_max_event_num * 2;
+		temp_events = realloc_array(eloop.epoll_events, next,
+					    sizeof(struct epoll_event));
+		if (temp_events == NULL)
+			return -1;
+		eloop.epoll_max_event_num = next;
+		eloop.epoll_events = temp_events;
+	}
+
 	return 0;
 }
+#endif /* CONFIG_ELOOP_EPOLL */
 
 
 static int eloop_sock_table_add_sock(struct eloop_sock_table *table,
                                      int sock, eloop_sock_handler handler,
-                                     void *eloop_data, void *user_data)
+                                     void *eloop_data, void *user_data,
+                                     void *site)
 {
 	struct eloop_sock *tmp;
 	int new_max_sock;
@@ -93,11 +431,25 @@ static int eloop_sock_table_add_sock(struct eloop_sock_table *table,
 	if (table == NULL)
 		return -1;
 
+#ifdef CONFIG_ELOOP_EPOLL
+	if (eloop_epoll_reserve(sock) < 0)
+		return -1;
+	if (eloop.fd_table[sock].sock[table->type].handler)
+		return -1;
+	if (eloop_sock_queue(sock, eloop.fd_table[sock].events |
+			     eloop_epoll_events(table->type)) < 0)
+		return -1;
+#endif /* CONFIG_ELOOP_EPOLL */
+
 	eloop_trace_sock_remove_ref(table);
 	tmp = realloc_array(table->table, table->count + 1,
 			       sizeof(struct eloop_sock));
 	if (tmp == NULL) {
 		eloop_trace_sock_add_ref(table);
+#ifdef CONFIG_ELOOP_EPOLL
+		eloop_sock_queue(sock, eloop.fd_table[sock].events &
+				 ~eloop_epoll_events(table->type));
+#endif /* CONFIG_ELOOP_EPOLL */
 		return -1;
 	}
 
@@ -105,8 +457,12 @@ static int eloop_sock_table_add_sock(struct eloop_sock_table *table,
 	tmp[table->count].eloop_data = eloop_data;
 	tmp[table->count].user_data = user_data;
 	tmp[table->count].handler = handler;
+	tmp[table->count].site = site;
 	table->count++;
 	table->table = tmp;
+#ifdef CONFIG_ELOOP_EPOLL
+	eloop.fd_table[sock].sock[table->type] = tmp[table->count - 1];
+#endif /* CONFIG_ELOOP_EPOLL */
 	eloop.max_sock = new_max_sock;
 	eloop.count++;
 	table->changed = 1;
@@ -140,9 +496,63 @@ static void eloop_sock_table_remove_sock(struct eloop_sock_table *table,
 	eloop.count--;
 	table->changed = 1;
 	eloop_trace_sock_add_ref(table);
+#ifdef CONFIG_ELOOP_EPOLL
+	memset(&eloop.fd_table[sock].sock[table->type], 0,
+	       sizeof(struct eloop_sock));
+	eloop_sock_queue(sock, eloop.fd_table[sock].events &
+			 ~eloop_epoll_events(table->type));
+#endif /* CONFIG_ELOOP_EPOLL */
 }
 
 
+#ifdef CONFIG_ELOOP_EPOLL
+static int eloop_sock_tables_changed(void)
+{
+	return eloop.readers.changed || eloop.writers.changed ||
+		eloop.exceptions.changed;
+}
+
+
+static int eloop_epoll_call(int sock, eloop_event_type type)
+{
+	struct eloop_sock *es = &eloop.fd_table[sock].sock[type];
+
+	if (es->handler == NULL)
+		return 0;
+	eloop_sock_call(es, type);
+
+	return eloop_sock_tables_changed();
+}
+
+
+/* Follows select() semantics: errors and hangups wake up readers and
+ * writers, dispatch stops once a handler has changed the registrations. */
+static void eloop_epoll_dispatch(struct epoll_event *events, int nfds)
+{
+	int i, sock;
+	uint32_t ev;
+
+	eloop.readers.changed = 0;
+	eloop.writers.changed = 0;
+	eloop.exceptions.changed = 0;
+
+	for (i = 0; i < nfds; i++) {
+		sock = events[i].data.fd;
+		ev = events[i].events;
+
+		if ((ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+		    eloop_epoll_call(sock, EVENT_TYPE_READ))
+			break;
+		if ((ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) &&
+		    eloop_epoll_call(sock, EVENT_TYPE_WRITE))
+			break;
+		if ((ev & (EPOLLPRI | EPOLLERR)) &&
+		    eloop_epoll_call(sock, EVENT_TYPE_EXCEPTION))
+			break;
+	}
+}
+#else /* CONFIG_ELOOP_EPOLL */
+
 static void eloop_sock_table_set_fds(struct eloop_sock_table *table,
 				     fd_set *fds)
 {
@@ -171,14 +581,13 @@ static void eloop_sock_table_dispatch(struct eloop_sock_table *table,
 	table->changed = 0;
 	for (i = 0; i < table->count; i++) {
 		if (FD_ISSET(table->table[i].sock, fds)) {
-			table->table[i].handler(table->table[i].sock,
-						table->table[i].eloop_data,
-						table->table[i].user_data);
+			eloop_sock_call(&table->table[i], table->type);
 			if (table->changed)
 				break;
 		}
 	}
 }
+#endif /* CONFIG_ELOOP_EPOLL */
 
 
 int eloop_sock_requeue(void)
@@ -200,15 +609,15 @@ static void eloop_sock_table_destroy(struct eloop_sock_table *table)
 int eloop_register_read_sock(int sock, eloop_sock_handler handler,
 			     void *eloop_data, void *user_data)
 {
-	return eloop_register_sock(sock, EVENT_TYPE_READ, handler,
-				   eloop_data, user_data);
+	return eloop_sock_add(sock, EVENT_TYPE_READ, handler,
+			      eloop_data, user_data, ELOOP_CALLER());
 }
 
 int eloop_register_write_sock(int sock, eloop_sock_handler handler,
                              void *eloop_data, void *user_data)
 {
-        return eloop_register_sock(sock, EVENT_TYPE_WRITE, handler,
-                                   eloop_data, user_data);
+        return eloop_sock_add(sock, EVENT_TYPE_WRITE, handler,
+                              eloop_data, user_data, ELOOP_CALLER());
 }
 
 void eloop_unregister_read_sock(int sock)
@@ -236,16 +645,25 @@ static struct eloop_sock_table *eloop_get_sock_table(eloop_event_type type)
 }
 
 
-int eloop_register_sock(int sock, eloop_event_type type,
-			eloop_sock_handler handler,
-			void *eloop_data, void *user_data)
+static int eloop_sock_add(int sock, eloop_event_type type,
+			  eloop_sock_handler handler, void *eloop_data,
+			  void *user_data, void *site)
 {
 	struct eloop_sock_table *table;
 
 	assert(sock >= 0);
 	table = eloop_get_sock_table(type);
 	return eloop_sock_table_add_sock(table, sock, handler,
-					 eloop_data, user_data);
+					 eloop_data, user_data, site);
+}
+
+
+int eloop_register_sock(int sock, eloop_event_type type,
+			eloop_sock_handler handler,
+			void *eloop_data, void *user_data)
+{
+	return eloop_sock_add(sock, type, handler, eloop_data, user_data,
+			      ELOOP_CALLER());
 }
 
 
@@ -258,73 +676,320 @@ void eloop_unregister_sock(int sock, eloop_event_type type)
 }
 
 
-int eloop_register_timeout(unsigned int secs, unsigned int usecs,
-			   eloop_timeout_handler handler,
-			   void *eloop_data, void *user_data)
+#define ELOOP_HEAP_TIMEOUT(pos) (&eloop.timers[eloop.timer_heap[(pos)]])
+
+static int eloop_timeout_before(const struct eloop_timeout *a,
+				const struct eloop_timeout *b)
+{
+	if (a->time.sec != b->time.sec)
+		return a->time.sec < b->time.sec;
+	if (a->time.usec != b->time.usec)
+		return a->time.usec < b->time.usec;
+	return a->seq < b->seq;
+}
+
+
+static void eloop_heap_set(int pos, int slot)
+{
+	eloop.timer_heap[pos] = slot;
+	eloop.timers[slot].heap_idx = pos;
+}
+
+
+static void eloop_heap_sift_up(int pos)
+{
+	int slot = eloop.timer_heap[pos];
+	int parent;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!eloop_timeout_before(&eloop.timers[slot],
+					  ELOOP_HEAP_TIMEOUT(parent)))
+			break;
+		eloop_heap_set(pos, eloop.timer_heap[parent]);
+		pos = parent;
+	}
+	eloop_heap_set(pos, slot);
+}
+
+
+static void eloop_heap_sift_down(int pos)
+{
+	int slot = eloop.timer_heap[pos];
+	int child;
+
+	for (;;) {
+		child = 2 * pos + 1;
+		if (child >= eloop.timer_count)
+			break;
+		if (child + 1 < eloop.timer_count &&
+		    eloop_timeout_before(ELOOP_HEAP_TIMEOUT(child + 1),
+					 ELOOP_HEAP_TIMEOUT(child)))
+			child++;
+		if (!eloop_timeout_before(ELOOP_HEAP_TIMEOUT(child),
+					  &eloop.timers[slot]))
+			break;
+		eloop_heap_set(pos, eloop.timer_heap[child]);
+		pos = child;
+	}
+	eloop_heap_set(pos, slot);
+}
+
+
+static void eloop_heap_fix(int pos)
+{
+	if (pos > 0 && eloop_timeout_before(ELOOP_HEAP_TIMEOUT(pos),
+					    ELOOP_HEAP_TIMEOUT((pos - 1) / 2)))
+		eloop_heap_sift_up(pos);
+	else
+		eloop_heap_sift_down(pos);
+}
+
+
+static unsigned int eloop_timeout_hash(eloop_timeout_handler handler)
+{
+	uintptr_t h = (uintptr_t) handler;
+
+	return (unsigned int) ((h >> 4) ^ (h >> 12)) % ELOOP_TIMEOUT_HASH_SIZE;
+}
+
+
+static void eloop_timeout_link(int slot)
+{
+	struct eloop_timeout *timeout = &eloop.timers[slot];
+	unsigned int h = eloop_timeout_hash(timeout->handler);
+
+	timeout->hash_prev = -1;
+	timeout->hash_next = eloop.timer_hash[h];
+	if (timeout->hash_next >= 0)
+		eloop.timers[timeout->hash_next].hash_prev = slot;
+	eloop.timer_hash[h] = slot;
+}
+
+
+static void eloop_timeout_unlink(int slot)
+{
+	struct eloop_timeout *timeout = &eloop.timers[slot];
+
+	if (timeout->hash_prev >= 0)
+		eloop.timers[timeout->hash_prev].hash_next = timeout->hash_next;
+	else
+		eloop.timer_hash[eloop_timeout_hash(timeout->handler)] =
+			timeout->hash_next;
+	if (timeout->hash_next >= 0)
+		eloop.timers[timeout->hash_next].hash_prev = timeout->hash_prev;
+}
+
+
+static int eloop_timeout_alloc(void)
+{
+	struct eloop_timeout *tmp;
+	int *heap;
+	int i, next, slot;
+
+	if (eloop.timer_free < 0) {
+		next = eloop.timer_slots ? eloop.timer_slots * 2 :
+			ELOOP_TIMEOUT_MIN_SLOTS;
+		tmp = realloc_array(eloop.timers, next, sizeof(*tmp));
+		if (tmp == NULL)
+			return -1;
+		eloop.timers = tmp;
+		heap = realloc_array(eloop.timer_heap, next, sizeof(*heap));
+		if (heap == NULL)
+			return -1;
+		eloop.timer_heap = heap;
+		for (i = next - 1; i >= eloop.timer_slots; i--) {
+			memset(&tmp[i], 0, sizeof(tmp[i]));
+			tmp[i].heap_idx = -1;
+			tmp[i].hash_next = eloop.timer_free;
+			eloop.timer_free = i;
+		}
+		eloop.timer_slots = next;
+	}
+
+	slot = eloop.timer_free;
+	eloop.timer_free = eloop.timers[slot].hash_next;
+	eloop.timers[slot].gen++;
+
+	return slot;
+}
+
+
+static void eloop_remove_timeout(int slot)
+{
+	struct eloop_timeout *timeout = &eloop.timers[slot];
+	int pos = timeout->heap_idx;
+
+	eloop_timeout_unlink(slot);
+	eloop.timer_count--;
+	if (pos != eloop.timer_count) {
+		eloop_heap_set(pos, eloop.timer_heap[eloop.timer_count]);
+		eloop_heap_fix(pos);
+	}
+
+	timeout->heap_idx = -1;
+	timeout->handler = NULL;
+	timeout->hash_next = eloop.timer_free;
+	eloop.timer_free = slot;
+}
+
+
+static int eloop_timeout_set_time(struct reltime *time, unsigned int secs,
+				  unsigned int usecs)
 {
-	struct eloop_timeout *timeout, *tmp;
 	time_t now_sec;
 
-	timeout = zalloc(sizeof(*timeout));
-	if (timeout == NULL)
+	if (get_reltime(time) < 0)
 		return -1;
-	if (get_reltime(&timeout->time) < 0) {
-		free(timeout);
-		return -1;
-	}
-	now_sec = timeout->time.sec;
-	timeout->time.sec += secs;
-	if (timeout->time.sec < now_sec) {
+	now_sec = time->sec;
+	time->sec += secs;
+	if (time->sec < now_sec) {
 		/*
 		 * Integer overflow - assume long enough timeout to be assumed
 		 * to be infinite, i.e., the timeout would never happen.
 		 */
-		free(timeout);
-		return 0;
+		return 1;
 	}
-	timeout->time.usec += usecs;
-	while (timeout->time.usec >= 1000000) {
-		timeout->time.sec++;
-		timeout->time.usec -= 1000000;
+	time->usec += usecs;
+	while (time->usec >= 1000000) {
+		time->sec++;
+		time->usec -= 1000000;
 	}
+
+	return 0;
+}
+
+
+/* Returns the slot, -1 on failure or -2 if the timeout would never fire */
+static int eloop_timeout_add(unsigned int secs, unsigned int usecs,
+			     eloop_timeout_handler handler,
+			     void *eloop_data, void *user_data, void *site)
+{
+	struct eloop_timeout *timeout;
+	struct reltime time;
+	int slot, ret;
+
+	ret = eloop_timeout_set_time(&time, secs, usecs);
+	if (ret)
+		return ret < 0 ? -1 : -2;
+
+	slot = eloop_timeout_alloc();
+	if (slot < 0)
+		return -1;
+
+	timeout = &eloop.timers[slot];
+	timeout->time = time;
+	timeout->seq = eloop.timer_seq++;
 	timeout->eloop_data = eloop_data;
 	timeout->user_data = user_data;
 	timeout->handler = handler;
+	timeout->site = site;
+	eloop_timeout_link(slot);
 
-	/* Maintain timeouts in order of increasing time */
-	dl_list_for_each(tmp, &eloop.timeout, struct eloop_timeout, list) {
-		if (reltime_before(&timeout->time, &tmp->time)) {
-			dl_list_add(tmp->list.prev, &timeout->list);
-			return 0;
-		}
+	eloop.timer_heap[eloop.timer_count] = slot;
+	eloop.timer_count++;
+	eloop_heap_sift_up(eloop.timer_count - 1);
+
+	return slot;
+}
+
+
+static int eloop_timeout_find(eloop_timeout_handler handler,
+			      void *eloop_data, void *user_data)
+{
+	int slot;
+	struct eloop_timeout *timeout;
+
+	for (slot = eloop.timer_hash[eloop_timeout_hash(handler)]; slot >= 0;
+	     slot = timeout->hash_next) {
+		timeout = &eloop.timers[slot];
+		if (timeout->handler == handler &&
+		    timeout->eloop_data == eloop_data &&
+		    timeout->user_data == user_data)
+			return slot;
 	}
-	dl_list_add_tail(&eloop.timeout, &timeout->list);
+
+	return -1;
+}
+
+
+int eloop_register_timeout(unsigned int secs, unsigned int usecs,
+			   eloop_timeout_handler handler,
+			   void *eloop_data, void *user_data)
+{
+	int slot = eloop_timeout_add(secs, usecs, handler, eloop_data,
+				     user_data, ELOOP_CALLER());
+
+	if (slot == -1)
+		return -1;
 
 	return 0;
 }
 
 
-static void eloop_remove_timeout(struct eloop_timeout *timeout)
+eloop_timer_id eloop_register_timer(unsigned int secs, unsigned int usecs,
+				    eloop_timeout_handler handler,
+				    void *eloop_data, void *user_data)
 {
-	dl_list_del(&timeout->list);
-	free(timeout);
+	int slot = eloop_timeout_add(secs, usecs, handler, eloop_data,
+				     user_data, ELOOP_CALLER());
+
+	if (slot < 0)
+		return ELOOP_TIMER_NONE;
+
+	return ((eloop_timer_id) eloop.timers[slot].gen << 32) |
+		(eloop_timer_id) (slot + 1);
+}
+
+
+static int eloop_timer_slot(eloop_timer_id id)
+{
+	int slot = (int) (id & 0xffffffff) - 1;
+
+	if (slot < 0 || slot >= eloop.timer_slots ||
+	    eloop.timers[slot].heap_idx < 0 ||
+	    eloop.timers[slot].gen != (unsigned int) (id >> 32))
+		return -1;
+
+	return slot;
+}
+
+
+int eloop_cancel_timer(eloop_timer_id id)
+{
+	int slot = eloop_timer_slot(id);
+
+	if (slot < 0)
+		return 0;
+
+	eloop_remove_timeout(slot);
+	return 1;
+}
+
+
+int eloop_is_timer_registered(eloop_timer_id id)
+{
+	return eloop_timer_slot(id) >= 0;
 }
 
 
 int eloop_cancel_timeout(eloop_timeout_handler handler,
 			 void *eloop_data, void *user_data)
 {
-	struct eloop_timeout *timeout, *prev;
+	struct eloop_timeout *timeout;
+	int slot, next;
 	int removed = 0;
 
-	dl_list_for_each_safe(timeout, prev, &eloop.timeout,
-			      struct eloop_timeout, list) {
+	for (slot = eloop.timer_hash[eloop_timeout_hash(handler)]; slot >= 0;
+	     slot = next) {
+		timeout = &eloop.timers[slot];
+		next = timeout->hash_next;
 		if (timeout->handler == handler &&
 		    (timeout->eloop_data == eloop_data ||
 		     eloop_data == ELOOP_ALL_CTX) &&
 		    (timeout->user_data == user_data ||
 		     user_data == ELOOP_ALL_CTX)) {
-			eloop_remove_timeout(timeout);
+			eloop_remove_timeout(slot);
 			removed++;
 		}
 	}
@@ -335,16 +1000,21 @@ int eloop_cancel_timeout(eloop_timeout_handler handler,
 int eloop_is_timeout_registered(eloop_timeout_handler handler,
 				void *eloop_data, void *user_data)
 {
-	struct eloop_timeout *tmp;
+	return eloop_timeout_find(handler, eloop_data, user_data) >= 0;
+}
 
-	dl_list_for_each(tmp, &eloop.timeout, struct eloop_timeout, list) {
-		if (tmp->handler == handler &&
-		    tmp->eloop_data == eloop_data &&
-		    tmp->user_data == user_data)
-			return 1;
-	}
 
-	return 0;
+/* Moves a registered timeout to now + req, keeping its slot and handle */
+static void eloop_timeout_reschedule(int slot, struct reltime *req)
+{
+	struct eloop_timeout *timeout = &eloop.timers[slot];
+
+	if (eloop_timeout_set_time(&timeout->time, req->sec, req->usec)) {
+		eloop_remove_timeout(slot);
+		return;
+	}
+	timeout->seq = eloop.timer_seq++;
+	eloop_heap_fix(timeout->heap_idx);
 }
 
 
@@ -353,30 +1023,22 @@ int eloop_deplete_timeout(unsigned int req_secs, unsigned int req_usecs,
 			  void *user_data)
 {
 	struct reltime now, requested, remaining;
-	struct eloop_timeout *tmp;
+	int slot;
 
-	dl_list_for_each(tmp, &eloop.timeout, struct eloop_timeout, list) {
-		if (tmp->handler == handler &&
-		    tmp->eloop_data == eloop_data &&
-		    tmp->user_data == user_data) {
-			requested.sec = req_secs;
-			requested.usec = req_usecs;
-			get_reltime(&now);
-			reltime_sub(&tmp->time, &now, &remaining);
-			if (reltime_before(&requested, &remaining)) {
-				eloop_cancel_timeout(handler, eloop_data,
-						     user_data);
-				eloop_register_timeout(requested.sec,
-						       requested.usec,
-						       handler, eloop_data,
-						       user_data);
-				return 1;
-			}
-			return 0;
-		}
+	slot = eloop_timeout_find(handler, eloop_data, user_data);
+	if (slot < 0)
+		return -1;
+
+	requested.sec = req_secs;
+	requested.usec = req_usecs;
+	get_reltime(&now);
+	reltime_sub(&eloop.timers[slot].time, &now, &remaining);
+	if (reltime_before(&requested, &remaining)) {
+		eloop_timeout_reschedule(slot, &requested);
+		return 1;
 	}
 
-	return -1;
+	return 0;
 }
 
 
@@ -385,33 +1047,187 @@ int eloop_replenish_timeout(unsigned int req_secs, unsigned int req_usecs,
 			    void *user_data)
 {
 	struct reltime now, requested, remaining;
-	struct eloop_timeout *tmp;
+	int slot;
 
-	dl_list_for_each(tmp, &eloop.timeout, struct eloop_timeout, list) {
-		if (tmp->handler == handler &&
-		    tmp->eloop_data == eloop_data &&
-		    tmp->user_data == user_data) {
-			requested.sec = req_secs;
-			requested.usec = req_usecs;
-			get_reltime(&now);
-			reltime_sub(&tmp->time, &now, &remaining);
-			if (reltime_before(&remaining, &requested)) {
-				eloop_cancel_timeout(handler, eloop_data,
-						     user_data);
-				eloop_register_timeout(requested.sec,
-						       requested.usec,
-						       handler, eloop_data,
-						       user_data);
-				return 1;
-			}
-			return 0;
+	slot = eloop_timeout_find(handler, eloop_data, user_data);
+	if (slot < 0)
+		return -1;
+
+	requested.sec = req_secs;
+	requested.usec = req_usecs;
+	get_reltime(&now);
+	reltime_sub(&eloop.timers[slot].time, &now, &remaining);
+	if (reltime_before(&remaining, &requested)) {
+		eloop_timeout_reschedule(slot, &requested);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* Fires every timeout that expired before this call. Timeouts registered by
+ * the handlers wait for the next iteration, so a handler re-arming itself
+ * with a zero delay cannot starve the sockets. */
+static void eloop_process_timeouts(void)
+{
+	struct eloop_timeout *timeout;
+	unsigned long batch_seq = eloop.timer_seq;
+	struct reltime now, start;
+	eloop_timeout_handler handler;
+	void *eloop_data, *user_data, *site;
+
+	if (!eloop.timer_count)
+		return;
+
+	get_reltime(&now);
+	while (eloop.timer_count && !eloop.terminate) {
+		timeout = ELOOP_HEAP_TIMEOUT(0);
+		if (reltime_before(&now, &timeout->time) ||
+		    timeout->seq >= batch_seq)
+			break;
+
+		eloop_data = timeout->eloop_data;
+		user_data = timeout->user_data;
+		handler = timeout->handler;
+		site = timeout->site;
+		eloop_remove_timeout(eloop.timer_heap[0]);
+		get_reltime(&start);
+		handler(eloop_data, user_data);
+		eloop_stats_call(ELOOP_FUNC(handler), site, "timeout", &start);
+	}
+}
+
+
+static int eloop_deadline_arm(struct eloop_deadline *dl)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = dl->deadline;
+	/* a deadline in the past expires right away */
+	if (its.it_value.tv_sec <= 0)
+		its.it_value.tv_nsec = 1;
+
+	return timerfd_settime(dl->fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+			       &its, NULL);
+}
+
+
+static void eloop_deadline_free(struct eloop_deadline *dl)
+{
+	dl_list_del(&dl->list);
+	eloop_unregister_read_sock(dl->fd);
+	close(dl->fd);
+	free(dl);
+}
+
+
+static void eloop_deadline_receive(int sock, void *eloop_ctx, void *sock_ctx)
+{
+	struct eloop_deadline *dl = sock_ctx;
+	eloop_timeout_handler handler;
+	void *eloop_data, *user_data, *site;
+	struct reltime start;
+	uint64_t expirations;
+
+	(void) eloop_ctx;
+
+	if (read(sock, &expirations, sizeof(expirations)) < 0) {
+		/*
+		 * ECANCELED: the wall clock was set. Re-arm with the same
+		 * absolute time, which fires at once if the step moved the
+		 * clock past the deadline.
+		 */
+		if (errno == ECANCELED && eloop_deadline_arm(dl) == 0)
+			return;
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+	}
+
+	handler = dl->handler;
+	eloop_data = dl->eloop_data;
+	user_data = dl->user_data;
+	site = dl->site;
+	eloop_deadline_free(dl);
+	get_reltime(&start);
+	handler(eloop_data, user_data);
+	eloop_stats_call(ELOOP_FUNC(handler), site, "deadline", &start);
+}
+
+
+int eloop_register_deadline(time_t deadline, eloop_timeout_handler handler,
+			    void *eloop_data, void *user_data)
+{
+	struct eloop_deadline *dl;
+
+	dl = zalloc(sizeof(*dl));
+	if (dl == NULL)
+		return -1;
+
+	dl->fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (dl->fd < 0) {
+		free(dl);
+		return -1;
+	}
+	dl->deadline = deadline;
+	dl->handler = handler;
+	dl->eloop_data = eloop_data;
+	dl->user_data = user_data;
+	dl->site = ELOOP_CALLER();
+
+	if (eloop_deadline_arm(dl) < 0 ||
+	    eloop_sock_add(dl->fd, EVENT_TYPE_READ, eloop_deadline_receive,
+			   NULL, dl, NULL) < 0) {
+		close(dl->fd);
+		free(dl);
+		return -1;
+	}
+	dl_list_add_tail(&eloop.deadlines, &dl->list);
+
+	return 0;
+}
+
+
+int eloop_cancel_deadline(eloop_timeout_handler handler,
+			  void *eloop_data, void *user_data)
+{
+	struct eloop_deadline *dl, *prev;
+	int removed = 0;
+
+	dl_list_for_each_safe(dl, prev, &eloop.deadlines,
+			      struct eloop_deadline, list) {
+		if (dl->handler == handler &&
+		    (dl->eloop_data == eloop_data ||
+		     eloop_data == ELOOP_ALL_CTX) &&
+		    (dl->user_data == user_data ||
+		     user_data == ELOOP_ALL_CTX)) {
+			eloop_deadline_free(dl);
+			removed++;
 		}
 	}
 
-	return -1;
+	return removed;
+}
+
+
+int eloop_is_deadline_registered(eloop_timeout_handler handler,
+				 void *eloop_data, void *user_data)
+{
+	struct eloop_deadline *dl;
+
+	dl_list_for_each(dl, &eloop.deadlines, struct eloop_deadline, list) {
+		if (dl->handler == handler &&
+		    dl->eloop_data == eloop_data &&
+		    dl->user_data == user_data)
+			return 1;
+	}
+
+	return 0;
 }
 
 
+#ifndef CONFIG_ELOOP_SIGNALFD
 static void eloop_handle_alarm(int sig)
 {
 	exit(1);
@@ -438,10 +1254,12 @@ static void eloop_handle_signal(int sig)
 		}
 	}
 }
+#endif /* CONFIG_ELOOP_SIGNALFD */
 
 
 static void eloop_process_pending_signals(void)
 {
+	struct reltime start;
 	int i;
 
 	if (eloop.signaled == 0)
@@ -456,15 +1274,74 @@ static void eloop_process_pending_signals(void)
 	for (i = 0; i < eloop.signal_count; i++) {
 		if (eloop.signals[i].signaled) {
 			eloop.signals[i].signaled = 0;
+			get_reltime(&start);
 			eloop.signals[i].handler(eloop.signals[i].sig,
 						 eloop.signals[i].user_data);
+			eloop_stats_call(ELOOP_FUNC(eloop.signals[i].handler),
+					 eloop.signals[i].site, "signal",
+					 &start);
 		}
 	}
 }
 
 
-int eloop_register_signal(int sig, eloop_signal_handler handler,
-			  void *user_data)
+#ifdef CONFIG_ELOOP_SIGNALFD
+static void eloop_signalfd_receive(int sock, void *eloop_ctx, void *sock_ctx)
+{
+	struct signalfd_siginfo info;
+	int i;
+
+	(void) eloop_ctx;
+	(void) sock_ctx;
+
+	while (read(sock, &info, sizeof(info)) == sizeof(info)) {
+		eloop.signaled++;
+		for (i = 0; i < eloop.signal_count; i++) {
+			if (eloop.signals[i].sig == (int) info.ssi_signo) {
+				eloop.signals[i].signaled++;
+				break;
+			}
+		}
+	}
+
+	eloop_process_pending_signals();
+}
+
+
+/*
+ * Signals are blocked and read from a signalfd, so they are dispatched
+ * like socket events: no async handler, no EINTR and no SIGALRM watchdog.
+ */
+static int eloop_signalfd_add(int sig)
+{
+	int fd;
+
+	sigaddset(&eloop.signal_mask, sig);
+	if (sigprocmask(SIG_BLOCK, &eloop.signal_mask, NULL) < 0)
+		return -1;
+
+	fd = signalfd(eloop.signal_fd, &eloop.signal_mask,
+		      SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (eloop.signal_fd < 0) {
+		if (eloop_sock_add(fd, EVENT_TYPE_READ, eloop_signalfd_receive,
+				   NULL, NULL, NULL) < 0) {
+			close(fd);
+			return -1;
+		}
+		eloop.signal_fd = fd;
+		eloop.internal_readers++;
+	}
+
+	return 0;
+}
+#endif /* CONFIG_ELOOP_SIGNALFD */
+
+
+static int eloop_signal_add(int sig, eloop_signal_handler handler,
+			    void *user_data, void *site)
 {
 	struct eloop_signal *tmp;
 
@@ -476,21 +1353,38 @@ int eloop_register_signal(int sig, eloop_signal_handler handler,
 	tmp[eloop.signal_count].sig = sig;
 	tmp[eloop.signal_count].user_data = user_data;
 	tmp[eloop.signal_count].handler = handler;
+	tmp[eloop.signal_count].site = site;
 	tmp[eloop.signal_count].signaled = 0;
 	eloop.signal_count++;
 	eloop.signals = tmp;
+#ifdef CONFIG_ELOOP_SIGNALFD
+	if (eloop_signalfd_add(sig) < 0) {
+		eloop.signal_count--;
+		return -1;
+	}
+#else /* CONFIG_ELOOP_SIGNALFD */
 	signal(sig, eloop_handle_signal);
+#endif /* CONFIG_ELOOP_SIGNALFD */
 
 	return 0;
 }
 
 
+int eloop_register_signal(int sig, eloop_signal_handler handler,
+			  void *user_data)
+{
+	return eloop_signal_add(sig, handler, user_data, ELOOP_CALLER());
+}
+
+
 int eloop_register_signal_terminate(eloop_signal_handler handler,
 				    void *user_data)
 {
-	int ret = eloop_register_signal(SIGINT, handler, user_data);
+	int ret = eloop_signal_add(SIGINT, handler, user_data,
+				   ELOOP_CALLER());
 	if (ret == 0)
-		ret = eloop_register_signal(SIGTERM, handler, user_data);
+		ret = eloop_signal_add(SIGTERM, handler, user_data,
+				       ELOOP_CALLER());
 	return ret;
 }
 
@@ -498,28 +1392,91 @@ int eloop_register_signal_terminate(eloop_signal_handler handler,
 int eloop_register_signal_reconfig(eloop_signal_handler handler,
 				   void *user_data)
 {
-	return eloop_register_signal(SIGHUP, handler, user_data);
+	return eloop_signal_add(SIGHUP, handler, user_data, ELOOP_CALLER());
 }
 
 
+#ifdef CONFIG_ELOOP_TIMERFD
+/* The timerfd is only re-armed when the earliest timeout changes */
+static void eloop_timerfd_arm(void)
+{
+	struct itimerspec its;
+	struct eloop_timeout *timeout;
+
+	memset(&its, 0, sizeof(its));
+	if (eloop.timer_count) {
+		timeout = ELOOP_HEAP_TIMEOUT(0);
+		if (timeout->time.sec == eloop.timer_fd_armed.sec &&
+		    timeout->time.usec == eloop.timer_fd_armed.usec)
+			return;
+		eloop.timer_fd_armed = timeout->time;
+		its.it_value.tv_sec = timeout->time.sec;
+		its.it_value.tv_nsec = timeout->time.usec * 1000;
+		/* a zero it_value would disarm the timer */
+		if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+			its.it_value.tv_nsec = 1;
+	} else {
+		if (!eloop.timer_fd_armed.sec && !eloop.timer_fd_armed.usec)
+			return;
+		memset(&eloop.timer_fd_armed, 0, sizeof(eloop.timer_fd_armed));
+	}
+
+	timerfd_settime(eloop.timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+static void eloop_timerfd_receive(int sock, void *eloop_ctx, void *sock_ctx)
+{
+	uint64_t expirations;
+
+	(void) eloop_ctx;
+	(void) sock_ctx;
+
+	/* expired timeouts are fired from eloop_run() */
+	if (read(sock, &expirations, sizeof(expirations)) > 0)
+		memset(&eloop.timer_fd_armed, 0, sizeof(eloop.timer_fd_armed));
+}
+#endif /* CONFIG_ELOOP_TIMERFD */
+
+
 void eloop_run(void)
 {
+#ifdef CONFIG_ELOOP_EPOLL
+	int timeout_ms = -1;
+#else /* CONFIG_ELOOP_EPOLL */
 	fd_set *rfds, *wfds, *efds;
 	struct timeval _tv;
+#endif /* CONFIG_ELOOP_EPOLL */
 	int res;
 	struct reltime tv, now;
+	struct reltime wait_start, busy_start;
+	unsigned long long usec;
 
+	busy_start.sec = busy_start.usec = 0;
+
+#ifndef CONFIG_ELOOP_EPOLL
 	rfds = malloc(sizeof(*rfds));
 	wfds = malloc(sizeof(*wfds));
 	efds = malloc(sizeof(*efds));
 	if (rfds == NULL || wfds == NULL || efds == NULL)
 		goto out;
+#endif /* CONFIG_ELOOP_EPOLL */
 
 	while (!eloop.terminate &&
-	       (!dl_list_empty(&eloop.timeout) || eloop.readers.count > 0 ||
+	       (eloop.timer_count > 0 ||
+		eloop.readers.count > eloop.internal_readers ||
 		eloop.writers.count > 0 || eloop.exceptions.count > 0)) {
 		struct eloop_timeout *timeout;
 
+		/* the previous iteration ends where this wait starts */
+		if (busy_start.sec || busy_start.usec) {
+			usec = eloop_usec_since(&busy_start, &wait_start);
+			eloop.stats.busy_usec += usec;
+			eloop_stats_hist(eloop.stats.busy_hist, usec);
+		} else {
+			get_reltime(&wait_start);
+		}
+
 		if (eloop.pending_terminate) {
 			/*
 			 * This may happen in some corner cases where a signal
@@ -533,17 +1490,38 @@ void eloop_run(void)
 				break;
 		}
 
-		timeout = dl_list_first(&eloop.timeout, struct eloop_timeout,
-					list);
+#ifdef CONFIG_ELOOP_TIMERFD
+		/* the timerfd wakes the wait, no timeout is computed */
+		eloop_timerfd_arm();
+		timeout = NULL;
+#else /* CONFIG_ELOOP_TIMERFD */
+		timeout = eloop.timer_count ? ELOOP_HEAP_TIMEOUT(0) : NULL;
+#endif /* CONFIG_ELOOP_TIMERFD */
 		if (timeout) {
 			get_reltime(&now);
 			if (reltime_before(&now, &timeout->time))
 				reltime_sub(&timeout->time, &now, &tv);
 			else
 				tv.sec = tv.usec = 0;
+#ifdef CONFIG_ELOOP_EPOLL
+			/* round up so a sub-ms timeout does not spin */
+			timeout_ms = tv.sec * 1000 + (tv.usec + 999) / 1000;
+#else /* CONFIG_ELOOP_EPOLL */
 			_tv.tv_sec = tv.sec;
 			_tv.tv_usec = tv.usec;
+#endif /* CONFIG_ELOOP_EPOLL */
+		}
+#ifdef CONFIG_ELOOP_EPOLL
+		else {
+			timeout_ms = -1;
+		}
+
+		res = epoll_wait(eloop.epollfd, eloop.epoll_events,
+				 eloop.epoll_max_event_num, timeout_ms);
+		if (res < 0 && errno != EINTR && errno != 0) {
+			goto out;
 		}
+#else /* CONFIG_ELOOP_EPOLL */
 
 		eloop_sock_table_set_fds(&eloop.readers, rfds);
 		eloop_sock_table_set_fds(&eloop.writers, wfds);
@@ -553,6 +1531,12 @@ void eloop_run(void)
 		if (res < 0 && errno != EINTR && errno != 0) {
 			goto out;
 		}
+#endif /* CONFIG_ELOOP_EPOLL */
+
+		usec = eloop_usec_since(&wait_start, &busy_start);
+		eloop.stats.iterations++;
+		eloop.stats.wait_usec += usec;
+		eloop_stats_hist(eloop.stats.wait_hist, usec);
 
 		eloop.readers.changed = 0;
 		eloop.writers.changed = 0;
@@ -561,21 +1545,8 @@ void eloop_run(void)
 		eloop_process_pending_signals();
 
 
-		/* check if some registered timeouts have occurred */
-		timeout = dl_list_first(&eloop.timeout, struct eloop_timeout,
-					list);
-		if (timeout) {
-			get_reltime(&now);
-			if (!reltime_before(&now, &timeout->time)) {
-				void *eloop_data = timeout->eloop_data;
-				void *user_data = timeout->user_data;
-				eloop_timeout_handler handler =
-					timeout->handler;
-				eloop_remove_timeout(timeout);
-				handler(eloop_data, user_data);
-			}
-
-		}
+		/* fire all registered timeouts that have occurred */
+		eloop_process_timeouts();
 
 		if (res <= 0)
 			continue;
@@ -593,16 +1564,22 @@ void eloop_run(void)
 			continue;
 		}
 
+#ifdef CONFIG_ELOOP_EPOLL
+		eloop_epoll_dispatch(eloop.epoll_events, res);
+#else /* CONFIG_ELOOP_EPOLL */
 		eloop_sock_table_dispatch(&eloop.readers, rfds);
 		eloop_sock_table_dispatch(&eloop.writers, wfds);
 		eloop_sock_table_dispatch(&eloop.exceptions, efds);
+#endif /* CONFIG_ELOOP_EPOLL */
 	}
 
 	eloop.terminate = 0;
 out:
+#ifndef CONFIG_ELOOP_EPOLL
 	free(rfds);
 	free(wfds);
 	free(efds);
+#endif /* CONFIG_ELOOP_EPOLL */
 	return;
 }
 
@@ -615,25 +1592,44 @@ void eloop_terminate(void)
 
 void eloop_destroy(void)
 {
-	struct eloop_timeout *timeout, *prev;
-	struct reltime now;
-
-	get_reltime(&now);
-	dl_list_for_each_safe(timeout, prev, &eloop.timeout,
-			      struct eloop_timeout, list) {
-		int sec, usec;
-		sec = timeout->time.sec - now.sec;
-		usec = timeout->time.usec - now.usec;
-		if (timeout->time.usec < now.usec) {
-			sec--;
-			usec += 1000000;
-		}
-		eloop_remove_timeout(timeout);
+	struct eloop_deadline *dl, *prev;
+
+	dl_list_for_each_safe(dl, prev, &eloop.deadlines,
+			      struct eloop_deadline, list)
+		eloop_deadline_free(dl);
+	free(eloop.timers);
+	free(eloop.timer_heap);
+	eloop.timers = NULL;
+	eloop.timer_heap = NULL;
+	eloop.timer_count = 0;
+#ifdef CONFIG_ELOOP_SIGNALFD
+	if (eloop.signal_fd >= 0) {
+		struct signalfd_siginfo info;
+
+		/* drop signals that arrived after the loop ended, they
+		 * would hit the default action once unblocked */
+		while (read(eloop.signal_fd, &info, sizeof(info)) > 0)
+			;
+		eloop_unregister_read_sock(eloop.signal_fd);
+		close(eloop.signal_fd);
+		sigprocmask(SIG_UNBLOCK, &eloop.signal_mask, NULL);
+	}
+#endif /* CONFIG_ELOOP_SIGNALFD */
+#ifdef CONFIG_ELOOP_TIMERFD
+	if (eloop.timer_fd >= 0) {
+		eloop_unregister_read_sock(eloop.timer_fd);
+		close(eloop.timer_fd);
 	}
+#endif /* CONFIG_ELOOP_TIMERFD */
 	eloop_sock_table_destroy(&eloop.readers);
 	eloop_sock_table_destroy(&eloop.writers);
 	eloop_sock_table_destroy(&eloop.exceptions);
 	free(eloop.signals);
+#ifdef CONFIG_ELOOP_EPOLL
+	free(eloop.fd_table);
+	free(eloop.epoll_events);
+	close(eloop.epollfd);
+#endif /* CONFIG_ELOOP_EPOLL */
 
 }
 
@@ -7,7 +7,8 @@
  * This file defines an event loop interface that supports processing events
  * from registered timeouts (i.e., do something after N seconds), sockets
  * (e.g., a new packet available for reading), and signals. eloop.c is an
- * implementation of this interface using select() and sockets. This is
+ * implementation of this interface using select() and sockets, or epoll()
+ * when built with CONFIG_ELOOP_EPOLL. This is
  * suitable for most UNIX/POSIX systems. When porting to other operating
  * systems, it may be necessary to replace that implementation with OS specific
  * mechanisms.
@@ -207,6 +208,45 @@ int eloop_register_timeout(unsigned int secs, unsigned int usecs,
 			   eloop_timeout_handler handler,
 			   void *eloop_data, void *user_data);
 
+/**
+ * eloop_timer_id - Handle of a timeout registered with eloop_register_timer()
+ * @ELOOP_TIMER_NONE: never a valid handle
+ */
+typedef unsigned long long eloop_timer_id;
+#define ELOOP_TIMER_NONE 0
+
+/**
+ * eloop_register_timer - Register timeout and return its handle
+ * @secs: Number of seconds to the timeout
+ * @usecs: Number of microseconds to the timeout
+ * @handler: Callback function to be called when timeout occurs
+ * @eloop_data: Callback context data (eloop_ctx)
+ * @user_data: Callback context data (sock_ctx)
+ * Returns: Timer handle, %ELOOP_TIMER_NONE on failure
+ *
+ * Same as eloop_register_timeout(), the handle can be passed to
+ * eloop_cancel_timer() and stays unique after the timeout fired or was
+ * cancelled, so stale handles are safe to cancel.
+ */
+eloop_timer_id eloop_register_timer(unsigned int secs, unsigned int usecs,
+				    eloop_timeout_handler handler,
+				    void *eloop_data, void *user_data);
+
+/**
+ * eloop_cancel_timer - Cancel a timeout by handle
+ * @id: Handle from eloop_register_timer()
+ * Returns: 1 if the timeout was cancelled, 0 if it already fired or was
+ * cancelled
+ */
+int eloop_cancel_timer(eloop_timer_id id);
+
+/**
+ * eloop_is_timer_registered - Check if a timeout handle is still pending
+ * @id: Handle from eloop_register_timer()
+ * Returns: 1 if the timeout is pending, 0 otherwise
+ */
+int eloop_is_timer_registered(eloop_timer_id id);
+
 /**
  * eloop_cancel_timeout - Cancel timeouts
  * @handler: Matching callback function
@@ -283,6 +323,43 @@ int eloop_replenish_timeout(unsigned int req_secs, unsigned int req_usecs,
 			    eloop_timeout_handler handler, void *eloop_data,
 			    void *user_data);
 
+/**
+ * eloop_register_deadline - Register a wall clock deadline
+ * @deadline: Absolute time in seconds since the epoch (CLOCK_REALTIME)
+ * @handler: Callback function to be called when the deadline is reached
+ * @eloop_data: Callback context data (eloop_ctx)
+ * @user_data: Callback context data (user_ctx)
+ * Returns: 0 on success, -1 on failure
+ *
+ * Timeouts run on the monotonic clock and keep their relative length when
+ * the system clock is set. A deadline instead follows the wall clock: it is
+ * backed by a timerfd with TFD_TIMER_CANCEL_ON_SET and re-armed whenever the
+ * clock is stepped, so it fires as soon as the corrected clock reaches
+ * @deadline, and immediately if the deadline is already in the past.
+ */
+int eloop_register_deadline(time_t deadline, eloop_timeout_handler handler,
+			    void *eloop_data, void *user_data);
+
+/**
+ * eloop_cancel_deadline - Cancel deadlines
+ * @handler: Matching callback function
+ * @eloop_data: Matching eloop_data or %ELOOP_ALL_CTX to match all
+ * @user_data: Matching user_data or %ELOOP_ALL_CTX to match all
+ * Returns: Number of cancelled deadlines
+ */
+int eloop_cancel_deadline(eloop_timeout_handler handler,
+			  void *eloop_data, void *user_data);
+
+/**
+ * eloop_is_deadline_registered - Check if a deadline is registered
+ * @handler: Matching callback function
+ * @eloop_data: Matching eloop_data
+ * @user_data: Matching user_data
+ * Returns: 1 if the deadline is registered, 0 if it is not
+ */
+int eloop_is_deadline_registered(eloop_timeout_handler handler,
+				 void *eloop_data, void *user_data);
+
 /**
  * eloop_register_signal - Register handler for signals
  * @sig: Signal number (e.g., SIGHUP)
@@ -391,4 +468,77 @@ int eloop_terminated(void);
  */
 void eloop_wait_for_read_sock(int sock);
 
+/* log2 histogram, bucket 0 counts 0 us, bucket i counts [2^(i-1), 2^i) us
+ * and the last bucket everything above */
+#define ELOOP_STATS_BUCKETS 24
+#define ELOOP_STATS_SLOWEST 8
+
+/**
+ * struct eloop_slow_handler - Callback run time
+ * @handler: Callback function
+ * @site: Return address of the eloop_register_*() call
+ * @kind: "read", "write", "exception", "timeout", "deadline" or "signal"
+ * @usec: Longest run time seen, or this call's run time for the stall handler
+ */
+struct eloop_slow_handler {
+	const void *handler;
+	const void *site;
+	const char *kind;
+	unsigned long long usec;
+};
+
+/**
+ * struct eloop_stats - Event loop latency statistics
+ * @iterations: Number of loop iterations
+ * @callbacks: Number of callbacks run
+ * @stalls: Callbacks that ran for at least the stall threshold
+ * @wait_usec: Total time spent waiting for events
+ * @busy_usec: Total time spent in handlers and loop bookkeeping
+ * @wait_hist: Per iteration wait time histogram
+ * @busy_hist: Per iteration handler time histogram
+ * @slowest: Slowest callbacks, slowest first, one entry per callback
+ * @num_slowest: Number of valid @slowest entries
+ */
+struct eloop_stats {
+	unsigned long long iterations;
+	unsigned long long callbacks;
+	unsigned long long stalls;
+	unsigned long long wait_usec;
+	unsigned long long busy_usec;
+	unsigned long wait_hist[ELOOP_STATS_BUCKETS];
+	unsigned long busy_hist[ELOOP_STATS_BUCKETS];
+	struct eloop_slow_handler slowest[ELOOP_STATS_SLOWEST];
+	int num_slowest;
+};
+
+/**
+ * eloop_stall_handler - Stall notification
+ * @slow: Callback that blocked the loop and its run time
+ * @ctx: Context from eloop_set_stall_handler()
+ */
+typedef void (*eloop_stall_handler)(const struct eloop_slow_handler *slow,
+				    void *ctx);
+
+/**
+ * eloop_get_stats - Get event loop statistics
+ * Returns: Statistics collected since eloop_init() or eloop_reset_stats()
+ */
+const struct eloop_stats *eloop_get_stats(void);
+
+/**
+ * eloop_reset_stats - Clear event loop statistics
+ */
+void eloop_reset_stats(void);
+
+/**
+ * eloop_set_stall_handler - Report callbacks blocking the loop
+ * @threshold_ms: Run time at which a callback counts as a stall, 0 disables
+ * @handler: Called after each stalling callback returns, may be %NULL
+ * @ctx: Context for the handler
+ *
+ * Must be called after eloop_init().
+ */
+void eloop_set_stall_handler(unsigned int threshold_ms,
+			     eloop_stall_handler handler, void *ctx);
+
 #endif /* ELOOP_H */
@@ -0,0 +1,210 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "afc.h"
+#include "afc_reg_rule.h"
+#include "afc_grant.h"
+#include "utils.h"
+
+static struct afc_grant_table *grant;
+static int grant_is_shm;
+/* grant is assembled here and copied into the segment under the seqlock */
+static struct afc_grant_table grant_staging;
+
+int afc_grant_init(void)
+{
+	int fd;
+	void *addr;
+
+	/* a segment left by a crashed afcd or created by another user is never
+	reused, readers still mapping it keep the stale copy */
+	if (shm_unlink(AFC_GRANT_SHM_NAME) < 0 && errno != ENOENT)
+		afc_printf(MSG_ERROR, "grant shm_unlink failed: %s", strerror(errno));
+
+	fd = shm_open(AFC_GRANT_SHM_NAME, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		afc_printf(MSG_ERROR, "grant shm_open failed: %s", strerror(errno));
+		goto fallback;
+	}
+
+	/* umask must not take the read bits from the readers */
+	if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) < 0 ||
+	    ftruncate(fd, sizeof(struct afc_grant_table)) < 0) {
+		afc_printf(MSG_ERROR, "grant segment setup failed: %s", strerror(errno));
+		close(fd);
+		shm_unlink(AFC_GRANT_SHM_NAME);
+		goto fallback;
+	}
+
+	addr = mmap(NULL, sizeof(struct afc_grant_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		afc_printf(MSG_ERROR, "grant mmap failed: %s", strerror(errno));
+		shm_unlink(AFC_GRANT_SHM_NAME);
+		goto fallback;
+	}
+
+	grant = addr;
+	grant_is_shm = 1;
+	goto out;
+
+fallback:
+	/* grant is still kept in memory for the control interface */
+	grant = zalloc(sizeof(*grant));
+	if (!grant)
+		return AFC_STATUS_FAILURE;
+	grant_is_shm = 0;
+
+out:
+	/* the table starts zeroed, so the seqlock is even and no grant is published */
+	__atomic_store_n(&grant->seqlock, grant->seqlock + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset(&grant->grant_seq, 0, sizeof(*grant) - offsetof(struct afc_grant_table, grant_seq));
+	grant->version = AFC_GRANT_VERSION;
+	grant->magic = AFC_GRANT_MAGIC;
+	__atomic_store_n(&grant->seqlock, grant->seqlock + 1, __ATOMIC_RELEASE);
+
+	afc_printf(MSG_INFO, "grant table %s (%zu bytes)",
+		   grant_is_shm ? "published at " AFC_GRANT_SHM_NAME : "kept in memory only",
+		   sizeof(struct afc_grant_table));
+
+	return AFC_STATUS_SUCCESS;
+}
+
+void afc_grant_deinit(void)
+{
+	if (!grant)
+		return;
+
+	if (grant_is_shm) {
+		munmap(grant, sizeof(*grant));
+		shm_unlink(AFC_GRANT_SHM_NAME);
+	} else {
+		free(grant);
+	}
+	grant = NULL;
+}
+
+const struct afc_grant_table *afc_grant_get(void)
+{
+	return grant;
+}
+
+static int afc_grant_chan_cmp(const void *a, const void *b)
+{
+	const struct afc_grant_chan *ca = a, *cb = b;
+
+	if (ca->global_op_class != cb->global_op_class)
+		return ca->global_op_class - cb->global_op_class;
+
+	return ca->cfi - cb->cfi;
+}
+
+static int afc_grant_psd_cmp(const void *a, const void *b)
+{
+	const struct afc_grant_psd *pa = a, *pb = b;
+
+	if (pa->low_freq_mhz != pb->low_freq_mhz)
+		return pa->low_freq_mhz - pb->low_freq_mhz;
+
+	return pa->high_freq_mhz - pb->high_freq_mhz;
+}
+
+static const uint16_t afc_grant_bw_op_class[AFC_NUM_BW_CLASS] = { 131, 132, 133, 134, 137 };
+
+/* map an applied regulatory rule back to its 6GHz channel, frequency rules that
+do not line up with a channel raster are only reported in the PSD map */
+static int afc_grant_rule_to_chan(const struct ieee80211_reg_rule *rule, struct afc_grant_chan *chan)
+{
+	uint32_t start_mhz = REGLIB_KHZ_TO_MHZ(rule->freq_range.start_freq_khz);
+	uint32_t end_mhz = REGLIB_KHZ_TO_MHZ(rule->freq_range.end_freq_khz);
+	uint32_t center_mhz = (start_mhz + end_mhz) / 2;
+	enum afc_bw_class bw = afc_bw_khz_to_class(rule->freq_range.max_bandwidth_khz);
+
+	if (bw == AFC_NUM_BW_CLASS || (end_mhz - start_mhz) != REGLIB_KHZ_TO_MHZ(rule->freq_range.max_bandwidth_khz))
+		return -1;
+
+	/* 6GHz channel center = 5950 + 5 * cfi */
+	if (center_mhz <= 5950 || (center_mhz - 5950) % 5)
+		return -1;
+
+	chan->global_op_class = afc_grant_bw_op_class[bw];
+	chan->cfi = (center_mhz - 5950) / 5;
+	chan->reserved = 0;
+	chan->start_freq_mhz = start_mhz;
+	chan->end_freq_mhz = end_mhz;
+	chan->max_eirp_mbm = (int32_t)rule->power_rule.max_eirp;
+
+	return 0;
+}
+
+void afc_grant_publish(const struct afc_spectrum_inquiry_resp *afc_response,
+		       const struct mxl_ieee80211_regdomain *regd, int64_t expire_time)
+{
+	uint32_t idx;
+	int freq_idx;
+	double psd;
+	struct afc_grant_table *stage = &grant_staging;
+
+	if (!grant)
+		return;
+
+	memset(stage, 0, sizeof(*stage));
+	stage->expire_time = expire_time;
+	stage->publish_time = time(NULL);
+	stage->resp_status = afc_response->resp_info.resp_status;
+	memcpy(stage->country, afc_response->country, 2);
+	memcpy(stage->rule_set_id, afc_response->rule_set_ids, sizeof(stage->rule_set_id) - 1);
+
+	for (idx = 0; regd && idx < regd->n_reg_rules && stage->num_chan < AFC_GRANT_MAX_CHAN; idx++) {
+		if (!afc_grant_rule_to_chan(&regd->reg_rules[idx], &stage->chan[stage->num_chan]))
+			stage->num_chan++;
+	}
+	qsort(stage->chan, stage->num_chan, sizeof(stage->chan[0]), afc_grant_chan_cmp);
+
+	for (freq_idx = 0; freq_idx < afc_response->num_freq_info && stage->num_psd < AFC_GRANT_MAX_PSD;
+	     freq_idx++) {
+		psd = afc_response->freq_info[freq_idx].max_psd * EIRP_UNIT_CONVERSION;
+		stage->psd[stage->num_psd].low_freq_mhz = afc_response->freq_info[freq_idx].freq_range.low_frequency;
+		stage->psd[stage->num_psd].high_freq_mhz = afc_response->freq_info[freq_idx].freq_range.high_frequency;
+		stage->psd[stage->num_psd].max_psd_mbm = afc_round_mbm(psd);
+		stage->num_psd++;
+	}
+	qsort(stage->psd, stage->num_psd, sizeof(stage->psd[0]), afc_grant_psd_cmp);
+
+	/* seqlock write side, readers retry while the counter is odd or has moved */
+	__atomic_store_n(&grant->seqlock, grant->seqlock + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	stage->grant_seq = grant->grant_seq + 1;
+	memcpy(&grant->grant_seq, &stage->grant_seq,
+	       sizeof(*grant) - offsetof(struct afc_grant_table, grant_seq));
+	__atomic_store_n(&grant->seqlock, grant->seqlock + 1, __ATOMIC_RELEASE);
+
+	afc_printf(MSG_INFO, "published grant %u: %u channels, %u psd ranges",
+		   grant->grant_seq, grant->num_chan, grant->num_psd);
+}
+
+void afc_grant_set_rejected(uint16_t ifaces)
+{
+	if (!grant || grant->rejected_ifaces == ifaces)
+		return;
+
+	__atomic_store_n(&grant->seqlock, grant->seqlock + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	grant->rejected_ifaces = ifaces;
+	__atomic_store_n(&grant->seqlock, grant->seqlock + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,111 @@
+/******************************************************************************
+
+		 Copyright (c) 2024, MaxLinear, Inc.
+
+For licensing information, see the file 'LICENSE' in the root folder of
+this software module.
+
+*******************************************************************************/
+#ifndef AFC_GRANT_H
+#define AFC_GRANT_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Active AFC grant published by afcd in a POSIX shared memory segment.
+ * The segment is created read-only for other processes, readers map it with
+ * shm_open(AFC_GRANT_SHM_NAME, O_RDONLY) and mmap(PROT_READ) and access it
+ * lock-free under the seqlock:
+ *
+ *	do {
+ *		seq = afc_grant_read_begin(table);
+ *		eirp = table->chan[i].max_eirp_mbm;
+ *	} while (afc_grant_read_retry(table, seq));
+ *
+ * afcd recreates the segment every time it starts, so readers that keep it
+ * mapped must reopen it after afcd restarts.
+ */
+#define AFC_GRANT_SHM_NAME "/afcd_grant"
+#define AFC_GRANT_MAGIC 0x47434641 /* "AFCG" */
+#define AFC_GRANT_VERSION 2
+#define AFC_GRANT_MAX_CHAN 128
+#define AFC_GRANT_MAX_PSD 64
+
+struct afc_grant_chan {
+	uint16_t global_op_class;
+	uint8_t cfi;
+	uint8_t reserved;
+	uint16_t start_freq_mhz;
+	uint16_t end_freq_mhz;
+	int32_t max_eirp_mbm;	/* hundredths of dBm */
+};
+
+struct afc_grant_psd {
+	uint16_t low_freq_mhz;
+	uint16_t high_freq_mhz;
+	int32_t max_psd_mbm;	/* hundredths of dBm/MHz */
+};
+
+struct afc_grant_table {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seqlock;	/* odd while afcd updates the table */
+	uint32_t grant_seq;	/* incremented for every published grant */
+	int64_t expire_time;	/* availabilityExpireTime in seconds since epoch, 0 if none */
+	int64_t publish_time;	/* seconds since epoch */
+	uint8_t resp_status;
+	char country[3];
+	char rule_set_id[40];
+	uint16_t num_chan;
+	uint16_t num_psd;
+	/* sorted by global_op_class, then cfi */
+	struct afc_grant_chan chan[AFC_GRANT_MAX_CHAN];
+	/* sorted by low_freq_mhz */
+	struct afc_grant_psd psd[AFC_GRANT_MAX_PSD];
+	/* interfaces whose driver rejected or did not ack this grant, its power
+	levels are not in effect there (version 2) */
+	uint16_t rejected_ifaces;
+};
+
+static inline uint32_t afc_grant_read_begin(const struct afc_grant_table *table)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&table->seqlock, __ATOMIC_ACQUIRE);
+	} while (seq & 1);
+
+	return seq;
+}
+
+static inline int afc_grant_read_retry(const struct afc_grant_table *table, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&table->seqlock, __ATOMIC_RELAXED) != seq;
+}
+
+/* consistent copy of the whole table, for readers that keep a private snapshot */
+static inline void afc_grant_snapshot(const struct afc_grant_table *table,
+				      struct afc_grant_table *copy)
+{
+	uint32_t seq;
+
+	do {
+		seq = afc_grant_read_begin(table);
+		memcpy(copy, table, sizeof(*copy));
+	} while (afc_grant_read_retry(table, seq));
+}
+
+/* publisher side, used by afcd only */
+struct afc_spectrum_inquiry_resp;
+struct mxl_ieee80211_regdomain;
+
+int afc_grant_init(void);
+void afc_grant_deinit(void);
+void afc_grant_publish(const struct afc_spectrum_inquiry_resp *afc_response,
+		       const struct mxl_ieee80211_regdomain *regd, int64_t expire_time);
+void afc_grant_set_rejected(uint16_t ifaces);
+const struct afc_grant_table *afc_grant_get(void);
+
+#endif /* AFC_GRANT_H */
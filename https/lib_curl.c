@@ -8,18 +8,115 @@ this software module.
 *******************************************************************************/
 #include <curl/curl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "json.h"
-#include "afc_debug.h"
+#include "eloop.h"
+#include "list.h"
+#include "afc.h"
 
-int afc_curl_message_to_server(char *json_data, struct afc_config *config)
-{
-	int retry_count = 0;
-	struct curl_slist *headers = NULL;
+/* Transfers run on a curl multi handle driven by eloop: curl tells which
+sockets to watch and when to call back, eloop reports readiness. */
+struct afc_curl_transfer {
+	struct dl_list list;
 	CURL *curl;
+	struct curl_slist *headers;
+	char *body;
+	size_t body_len;
+	size_t body_size;
+	int retry_count;
+	afc_curl_done_cb cb;
+	void *ctx;
+};
+
+static CURLM *afc_curl_multi;
+static struct dl_list afc_curl_transfers = DL_LIST_HEAD_INIT(afc_curl_transfers);
+
+static void afc_curl_check_done(void);
+
+static size_t afc_curl_write_cb(void *data, size_t size, size_t nmemb, void *userdata)
+{
+	struct afc_curl_transfer *xfer = userdata;
+	size_t len = size * nmemb;
+	char *body;
+
+	if (xfer->body_len + len + 1 > xfer->body_size) {
+		body = realloc(xfer->body, xfer->body_len + len + 1);
+		if (!body)
+			return 0;
+		xfer->body = body;
+		xfer->body_size = xfer->body_len + len + 1;
+	}
+
+	memcpy(xfer->body + xfer->body_len, data, len);
+	xfer->body_len += len;
+	xfer->body[xfer->body_len] = '\0';
+
+	return len;
+}
+
+static void afc_curl_sock_ready(int sock, void *eloop_ctx, void *sock_ctx)
+{
+	int running, action = (int)(intptr_t)sock_ctx;
+
+	UNUSED_PARAM(eloop_ctx);
+
+	curl_multi_socket_action(afc_curl_multi, sock, action, &running);
+	afc_curl_check_done();
+}
+
+static int afc_curl_socket_cb(CURL *curl, curl_socket_t sock, int what, void *userp, void *socketp)
+{
+	UNUSED_PARAM(curl);
+	UNUSED_PARAM(userp);
+	UNUSED_PARAM(socketp);
+
+	/* eloop refuses a second handler for the same socket and direction */
+	eloop_unregister_read_sock(sock);
+	eloop_unregister_write_sock(sock);
+
+	if (what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+		eloop_register_read_sock(sock, afc_curl_sock_ready, NULL,
+					 (void *)(intptr_t)CURL_CSELECT_IN);
+	if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+		eloop_register_write_sock(sock, afc_curl_sock_ready, NULL,
+					  (void *)(intptr_t)CURL_CSELECT_OUT);
+
+	return 0;
+}
+
+static void afc_curl_timeout(void *eloop_ctx, void *user_ctx)
+{
+	int running;
+
+	UNUSED_PARAM(eloop_ctx);
+	UNUSED_PARAM(user_ctx);
+
+	curl_multi_socket_action(afc_curl_multi, CURL_SOCKET_TIMEOUT, 0, &running);
+	afc_curl_check_done();
+}
+
+static int afc_curl_timer_cb(CURLM *multi, long timeout_ms, void *userp)
+{
+	UNUSED_PARAM(multi);
+	UNUSED_PARAM(userp);
+
+	eloop_cancel_timeout(afc_curl_timeout, NULL, NULL);
+	/* socket_action must not be called from here, a zero timeout
+	runs it from the loop */
+	if (timeout_ms >= 0)
+		eloop_register_timeout(timeout_ms / 1000, (timeout_ms % 1000) * 1000,
+				       afc_curl_timeout, NULL, NULL);
+
+	return 0;
+}
+
+static int afc_curl_multi_init(void)
+{
 	CURLcode ret;
 
-	if (!config || !json_data)
-		return AFC_STATUS_FAILURE;
+	if (afc_curl_multi)
+		return AFC_STATUS_SUCCESS;
 
 	ret = curl_global_init(CURL_GLOBAL_DEFAULT);
 	if (ret != CURLE_OK) {
@@ -27,12 +124,95 @@ int afc_curl_message_to_server(char *json_data, struct afc_config *config)
 		return AFC_STATUS_FAILURE;
 	}
 
+	afc_curl_multi = curl_multi_init();
+	if (!afc_curl_multi) {
+		afc_printf(MSG_ERROR, "curl multi init failed");
+		curl_global_cleanup();
+		return AFC_STATUS_FAILURE;
+	}
+
+	curl_multi_setopt(afc_curl_multi, CURLMOPT_SOCKETFUNCTION, afc_curl_socket_cb);
+	curl_multi_setopt(afc_curl_multi, CURLMOPT_TIMERFUNCTION, afc_curl_timer_cb);
+
+	return AFC_STATUS_SUCCESS;
+}
+
+static void afc_curl_transfer_free(struct afc_curl_transfer *xfer)
+{
+	dl_list_del(&xfer->list);
+	curl_multi_remove_handle(afc_curl_multi, xfer->curl);
+	curl_slist_free_all(xfer->headers);
+	curl_easy_cleanup(xfer->curl);
+	free(xfer->body);
+	free(xfer);
+}
+
+static void afc_curl_finish(struct afc_curl_transfer *xfer, CURLcode result)
+{
+	afc_curl_done_cb cb = xfer->cb;
+	void *ctx = xfer->ctx;
+
+	if (result != CURLE_OK) {
+		afc_printf(MSG_ERROR, "libcurl : error: %s", curl_easy_strerror(result));
+		if (++xfer->retry_count < MAX_RETRY_COUNT) {
+			curl_multi_remove_handle(afc_curl_multi, xfer->curl);
+			xfer->body_len = 0;
+			if (curl_multi_add_handle(afc_curl_multi, xfer->curl) == CURLM_OK)
+				return;
+		}
+		afc_printf(MSG_ERROR, "libcurl : retry count exceeded");
+		afc_curl_transfer_free(xfer);
+		cb(AFC_STATUS_FAILURE, NULL, 0, ctx);
+		return;
+	}
+
+	/* the body stays with the transfer until the callback returned */
+	curl_multi_remove_handle(afc_curl_multi, xfer->curl);
+	cb(AFC_STATUS_SUCCESS, xfer->body ? xfer->body : "", xfer->body_len, ctx);
+	afc_curl_transfer_free(xfer);
+}
+
+static void afc_curl_check_done(void)
+{
+	struct afc_curl_transfer *xfer;
+	CURLMsg *msg;
+	int pending;
+
+	while ((msg = curl_multi_info_read(afc_curl_multi, &pending))) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+		xfer = NULL;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&xfer);
+		if (xfer)
+			afc_curl_finish(xfer, msg->data.result);
+	}
+}
+
+int afc_curl_message_to_server(const char *json_data, struct afc_config *config,
+			       afc_curl_done_cb cb, void *ctx)
+{
+	struct afc_curl_transfer *xfer;
+	CURL *curl;
+
+	if (!config || !json_data || !cb)
+		return AFC_STATUS_FAILURE;
+
+	if (afc_curl_multi_init())
+		return AFC_STATUS_FAILURE;
+
+	xfer = calloc(1, sizeof(*xfer));
+	if (!xfer)
+		return AFC_STATUS_FAILURE;
+
 	curl = curl_easy_init();
 	if (!curl) {
 		afc_printf(MSG_ERROR, "curl easy init failed");
-		curl_global_cleanup();
+		free(xfer);
 		return AFC_STATUS_FAILURE;
 	}
+	xfer->curl = curl;
+	xfer->cb = cb;
+	xfer->ctx = ctx;
 
 	curl_easy_setopt(curl, CURLOPT_URL, config->afc_server_url);
 	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
@@ -42,30 +222,41 @@ int afc_curl_message_to_server(char *json_data, struct afc_config *config)
 	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, config->verify_cert);
 	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, config->verify_cert);
 	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYSTATUS, config->verify_cert);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)AFC_CURL_TIMEOUT_SEC);
 	curl_easy_setopt(curl, CURLOPT_POST, 1L);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json_data);
-
-	headers = curl_slist_append(headers, "Content-Type: application/json");
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, afc_populate_afc_spectrum_inquiry_resp_cb);
-
-	do {
-		ret = curl_easy_perform(curl);
-		if (ret != CURLE_OK) {
-			afc_printf(MSG_ERROR, "libcurl : error: %s", curl_easy_strerror(ret));
-			retry_count++;
-		} else {
-			break;
-		}
-	} while (retry_count < MAX_RETRY_COUNT);
+	curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, json_data);
 
-	curl_slist_free_all(headers);
-	curl_easy_cleanup(curl);
+	xfer->headers = curl_slist_append(NULL, "Content-Type: application/json");
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, xfer->headers);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, afc_curl_write_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, xfer);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, xfer);
 
-	if (retry_count >= MAX_RETRY_COUNT) {
-		afc_printf(MSG_ERROR, "libcurl : retry count exceeded");
+	if (curl_multi_add_handle(afc_curl_multi, curl) != CURLM_OK) {
+		afc_printf(MSG_ERROR, "curl multi add failed");
+		curl_slist_free_all(xfer->headers);
+		curl_easy_cleanup(curl);
+		free(xfer);
 		return AFC_STATUS_FAILURE;
 	}
+	dl_list_add_tail(&afc_curl_transfers, &xfer->list);
 
 	return AFC_STATUS_SUCCESS;
-}
\ No newline at end of file
+}
+
+void afc_curl_deinit(void)
+{
+	struct afc_curl_transfer *xfer, *next;
+
+	if (!afc_curl_multi)
+		return;
+
+	/* abandoned transfers do not call back */
+	dl_list_for_each_safe(xfer, next, &afc_curl_transfers, struct afc_curl_transfer, list)
+		afc_curl_transfer_free(xfer);
+
+	eloop_cancel_timeout(afc_curl_timeout, NULL, NULL);
+	curl_multi_cleanup(afc_curl_multi);
+	afc_curl_multi = NULL;
+	curl_global_cleanup();
+}
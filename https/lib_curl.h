@@ -11,5 +11,12 @@ this software module.
 #include "config_file.h"
 
 #define MAX_RETRY_COUNT 5
+#define AFC_CURL_TIMEOUT_SEC 60 /* per attempt, keeps a stalled server from holding the queue */
 
-int afc_curl_message_to_server(char *json_data, struct afc_config *config);
\ No newline at end of file
+/* status is AFC_STATUS_SUCCESS or AFC_STATUS_FAILURE, body is NUL terminated
+and only valid during the call */
+typedef void (*afc_curl_done_cb)(int status, char *body, size_t len, void *ctx);
+
+int afc_curl_message_to_server(const char *json_data, struct afc_config *config,
+			       afc_curl_done_cb cb, void *ctx);
+void afc_curl_deinit(void);
@@ -15,107 +15,129 @@ this software module.
 #include <errno.h>
 #include "eloop.h"
 #include "afc.h"
-#include "afc_nl80211.h"
+#include "afc_driver.h"
+#include "afc_reg_rule.h"
+#include "afc_grant.h"
 #include "ctrl.h"
+#include "ctrl_cmds.h"
+#include "ctrl_clients.h"
 #include "list.h"
 
 extern int afc_debug_level;
 
-void afc_ctrl_iface_free(struct dl_list *ctrl_dst)
+static void afc_eloop_stall(const struct eloop_slow_handler *slow, void *ctx)
 {
-	struct ctrl_client *dst, *next;
+	UNUSED_PARAM(ctx);
 
-	dl_list_for_each_safe(dst, next, ctrl_dst, struct ctrl_client, list) {
-		dl_list_del(&dst->list);
-		free(dst);
-	}
+	afc_printf(MSG_WARNING, "eloop: %s handler %p registered at %p blocked the loop for %llu ms",
+		   slow->kind, slow->handler, slow->site, slow->usec / 1000);
 }
 
-struct ctrl_client *afc_ctrl_find_dst(struct dl_list *ctrl_dst, struct sockaddr_storage *from,
-				      socklen_t fromlen)
-{
-	struct ctrl_client *dst, *next;
-	struct sockaddr_un *a, *b;
-
-	a = (struct sockaddr_un *)from;
-	dl_list_for_each_safe(dst, next, ctrl_dst, struct ctrl_client, list) {
-		b = (struct sockaddr_un *)&dst->addr;
-		if ((fromlen == dst->addrlen) &&
-		    !memcmp(a->sun_path, b->sun_path, fromlen - offsetof(struct sockaddr_un, sun_path)))
-			return dst;
-	}
-	return NULL;
-}
+/* requester of an inquiry, the completion event is sent like its reply
+used to be: to the requester alone or to all attached monitors */
+struct afc_ctrl_query {
+	struct afc_ctrl_iface *iface;
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	int confidential_reply;
+};
 
-int afc_ctrl_iface_attach(struct dl_list *ctrl_dst, struct sockaddr_storage *from,
-			  socklen_t fromlen)
+static void afc_ctrl_query_done(const struct afc_query_result *result, void *ctx)
 {
-	struct ctrl_client *dst;
-
-	dst = afc_ctrl_find_dst(ctrl_dst, from, fromlen);
-	if (dst == NULL) {
-		dst = zalloc(sizeof(*dst));
-		if (dst == NULL)
-			return -1;
-		memcpy(&dst->addr, from, fromlen);
-		dst->addrlen = fromlen;
-		dl_list_add(ctrl_dst, &dst->list);
-	}
+	struct afc_ctrl_query *req = ctx;
+	char event[128];
+	int len;
 
-	return AFC_STATUS_SUCCESS;
-}
+	len = snprintf(event, sizeof(event),
+		       "<SPECTRUM_REQUEST_DONE id=%u inquiry=%u status=%s queue_ms=%u exchange_ms=%u",
+		       result->id, result->inquiry, result->status ? "FAILURE" : "SUCCESS",
+		       result->queue_ms, result->exchange_ms);
 
-void afc_ctrl_iface_detach(struct dl_list *ctrl_dst, struct sockaddr_storage *from,
-			   socklen_t fromlen)
-{
-	struct ctrl_client *dst;
+	if (req->confidential_reply)
+		afc_ctrl_iface_reply(req->iface, event, len, &req->from, req->fromlen);
+	else
+		afc_ctrl_iface_send(req->iface, AFC_CTRL_EVENT_REQUEST, event, len);
 
-	dst = afc_ctrl_find_dst(ctrl_dst, from, fromlen);
-	if (dst) {
-		dl_list_del(&dst->list);
-		free(dst);
-	}
+	free(req);
 }
 
-void afc_ctrl_iface_send(struct dl_list *ctrl_dst, int cli_sock,
-			 const char *buf, size_t len)
+/* inquiries from requests and refreshes alike; every successful one
+publishes a grant, a failed one is retried after next_sec */
+static void afc_ctrl_query_event(const struct afc_query_result *result, void *ctx)
 {
-	struct ctrl_client *dst, *next;
-
-	dl_list_for_each_safe(dst, next, ctrl_dst, struct ctrl_client, list) {
-		if (sendto(cli_sock, buf, len, 0, (struct sockaddr *)&dst->addr,
-			   dst->addrlen) < 0) {
-			afc_printf(MSG_DEBUG, "CTRL_IFACE sendto failed: %s",
-				   strerror(errno));
-			dst->errors++;
-			if (dst->errors > 10 || errno == ENOENT)
-				afc_ctrl_iface_detach(ctrl_dst,
-						      &dst->addr, dst->addrlen);
-		} else {
-			dst->errors = 0;
+	const struct afc_grant_table *grant = afc_grant_get();
+	unsigned int class = AFC_CTRL_EVENT_INQUIRY;
+	char event[128];
+	int len;
+
+	switch (result->event) {
+	case AFC_QUERY_STARTED:
+		len = snprintf(event, sizeof(event), "<INQUIRY_STARTED inquiry=%u requests=%u",
+			       result->inquiry, result->requests);
+		break;
+	case AFC_QUERY_EXPIRING:
+		if (!grant)
+			return;
+		class = AFC_CTRL_EVENT_GRANT;
+		len = snprintf(event, sizeof(event), "<GRANT_EXPIRING grant_seq=%u expire_time=%lld remaining_sec=%u",
+			       grant->grant_seq, (long long)grant->expire_time, result->next_sec);
+		break;
+	case AFC_QUERY_REJECTED:
+		if (!grant)
+			return;
+		class = AFC_CTRL_EVENT_GRANT;
+		len = snprintf(event, sizeof(event), "<GRANT_REJECTED grant_seq=%u ifaces=%u",
+			       grant->grant_seq, result->ifaces);
+		break;
+	default:
+		if (result->status) {
+			len = snprintf(event, sizeof(event), "<INQUIRY_FAILED inquiry=%u status=FAILURE exchange_ms=%u retry_sec=%u",
+				       result->inquiry, result->exchange_ms, result->next_sec);
+			break;
 		}
+		if (!grant)
+			return;
+		class = AFC_CTRL_EVENT_GRANT;
+		len = snprintf(event, sizeof(event), "<GRANT_UPDATED grant_seq=%u inquiry=%u expire_time=%lld",
+			       grant->grant_seq, result->inquiry, (long long)grant->expire_time);
+		break;
 	}
+
+	afc_ctrl_iface_send(ctx, class, event, len);
 }
 
-static void afc_ctrl_iface_receive(int sock, void *eloop_ctx, void *sock_ctx)
+static void afc_ctrl_iface_handle(struct afc_ctrl_iface *iface, char *buf,
+				  struct sockaddr_storage *from, socklen_t fromlen)
 {
-	int status;
-	int ret, reply_len = 0, confidential_reply = 0;
-	char buffer[256], *buf = buffer, reply[256];
-	struct sockaddr_storage from;
-	socklen_t fromlen = sizeof(from);
-	struct dl_list *ctrl_dst = (struct dl_list *)eloop_ctx;
-
-	UNUSED_PARAM(sock_ctx);
-
-	ret = recvfrom(sock, buffer, sizeof(buffer) - 1, 0,
-		       (struct sockaddr *)&from, &fromlen);
-	if (ret < 0) {
-		afc_printf(MSG_ERROR, "recvfrom error : %d", ret);
-		return;
+	unsigned int id, events;
+	struct afc_ctrl_query *req;
+	int reply_len = 0, confidential_reply = 0;
+	size_t tag_len = 0, size;
+	/* replies are chunked by afc_ctrl_iface_reply, the buffer is static as it
+	is larger than a datagram */
+	static char reply_buf[AFC_CTRL_MSG_MAX];
+	char *reply = reply_buf;
+
+	/* pipelined requests start with "#<tag> ", echoed in front of the reply.
+	a malformed tag is answered under its leading digits, so the client
+	fails the request now instead of timing it out */
+	if (buf[0] == AFC_CTRL_TAG) {
+		tag_len = 1 + strspn(buf + 1, "0123456789");
+		if (tag_len == 1 || tag_len > AFC_CTRL_TAG_MAX) {
+			tag_len = 0;
+			reply_len = snprintf(reply, sizeof(reply_buf), "Invalid tag");
+			goto send;
+		}
+		memcpy(reply, buf, tag_len);
+		reply[tag_len] = ' ';
+		if (buf[tag_len++] != ' ') {
+			reply_len = snprintf(reply + tag_len, sizeof(reply_buf) - tag_len, "Invalid tag");
+			goto send;
+		}
+		buf += tag_len;
+		reply += tag_len;
 	}
-
-	buf[ret] = '\0';
+	size = sizeof(reply_buf) - tag_len;
 
 	if (!strncmp(buf, "confidential_reply ", 19)) {
 		buf += 19;
@@ -124,46 +146,84 @@ static void afc_ctrl_iface_receive(int sock, void *eloop_ctx, void *sock_ctx)
 
 	afc_printf(MSG_ERROR, "received data from client: %s", buf);
 
+	/* read-only commands are answered from in-memory state */
+	reply_len = afc_ctrl_cmd_process(buf, reply, size);
+	if (reply_len)
+		goto send;
+
 	if (!strcmp(buf, "AFC_SEND_SPECTRUM_REQUEST")) {
-		status = afc_query_server();
-		if (status)
-			reply_len = snprintf(reply, sizeof(reply), "FAILURE");
+		/* replies with the ID right away, the inquiry completes later */
+		id = 0;
+		req = zalloc(sizeof(*req));
+		if (req) {
+			req->iface = iface;
+			memcpy(&req->from, from, fromlen);
+			req->fromlen = fromlen;
+			req->confidential_reply = confidential_reply;
+			id = afc_query_start(afc_ctrl_query_done, req);
+			if (!id)
+				free(req);
+		}
+		if (id)
+			reply_len = snprintf(reply, size, "PENDING id=%u", id);
 		else
-			reply_len = snprintf(reply, sizeof(reply), "SUCCESS");
-	} else if (!strcmp(buf, "ATTACH")) {
-		reply_len = afc_ctrl_iface_attach(ctrl_dst, &from, fromlen);
-		if (!reply_len)
-			reply_len = snprintf(reply, sizeof(reply), "OK");
+			reply_len = snprintf(reply, size, "FAILURE");
+	} else if (!strcmp(buf, "ATTACH") || !strncmp(buf, "ATTACH events=", 14)) {
+		/* all events unless the monitor names the classes it wants */
+		events = buf[6] ? afc_ctrl_event_mask(buf + 14) : AFC_CTRL_EVENT_ALL;
+		if (!events)
+			reply_len = snprintf(reply, size, "FAIL unknown event class");
+		else if (afc_ctrl_client_attach(iface, from, fromlen, events))
+			reply_len = snprintf(reply, size, "RETRY");
 		else
-			reply_len = snprintf(reply, sizeof(reply), "RETRY");
-		sendto(sock, reply, reply_len, 0, (struct sockaddr *)&from, fromlen);
-		return;
+			reply_len = snprintf(reply, size, "OK");
+	} else if (!strcmp(buf, "ELOOP_STATS_RESET")) {
+		eloop_reset_stats();
+		reply_len = snprintf(reply, size, "OK");
 	} else if (!strcmp(buf, "DETACH")) {
-		afc_ctrl_iface_detach(ctrl_dst, &from, fromlen);
-		reply_len = snprintf(reply, sizeof(reply), "OK");
-		sendto(sock, reply, reply_len, 0, (struct sockaddr *)&from, fromlen);
-		return;
+		afc_ctrl_client_detach(iface, from, fromlen);
+		reply_len = snprintf(reply, size, "OK");
 	} else {
-		reply_len = snprintf(reply, sizeof(reply), "Invalid command");
-		sendto(sock, reply, reply_len, 0, (struct sockaddr *)&from, fromlen);
-		return;
+		reply_len = snprintf(reply, size, "Invalid command");
 	}
 
-	if (confidential_reply) {
-		sendto(sock, reply, reply_len, 0, (struct sockaddr *)&from, fromlen);
-	} else {
-		afc_ctrl_iface_send(ctrl_dst, sock, reply, reply_len);
+send:
+	afc_ctrl_iface_reply(iface, reply_buf, tag_len + reply_len, from, fromlen);
+}
+
+/* pipelining clients queue several requests, they are served in one wakeup */
+static void afc_ctrl_iface_receive(int sock, void *eloop_ctx, void *sock_ctx)
+{
+	char buffer[256];
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	int ret, count;
+
+	UNUSED_PARAM(sock_ctx);
+
+	for (count = 0; count < AFC_CTRL_RECV_BATCH; count++) {
+		fromlen = sizeof(from);
+		ret = recvfrom(sock, buffer, sizeof(buffer) - 1, count ? MSG_DONTWAIT : 0,
+			       (struct sockaddr *)&from, &fromlen);
+		if (ret < 0) {
+			if (!count || (errno != EAGAIN && errno != EWOULDBLOCK))
+				afc_printf(MSG_ERROR, "recvfrom error : %d", ret);
+			return;
+		}
+
+		buffer[ret] = '\0';
+		afc_ctrl_iface_handle(eloop_ctx, buffer, &from, fromlen);
 	}
 }
 
 enum afc_status afc_cli_ctrl_iface_init(int *cli_sock, struct sockaddr_un *cli_addr,
-					struct dl_list *ctrliface_dst_list)
+					struct afc_ctrl_iface *iface)
 {
 	afc_printf(MSG_INFO, "initializing control interface");
 	if (afc_ctrl_iface_init(cli_sock, cli_addr, AFCD_SOCKET_PATH) < 0)
 		return AFC_STATUS_FAILURE;
 
-	if (eloop_register_read_sock(*cli_sock, afc_ctrl_iface_receive, ctrliface_dst_list, NULL) < 0) {
+	if (eloop_register_read_sock(*cli_sock, afc_ctrl_iface_receive, iface, NULL) < 0) {
 		afc_printf(MSG_ERROR, "eloop register read sock failed");
 		return AFC_STATUS_FAILURE;
 	}
@@ -181,15 +241,22 @@ void afc_cli_ctrl_iface_deinit(int *cli_sock, struct sockaddr_un *cli_addr)
 
 int main(int argc, char *argv[])
 {
-	int cli_sock, c;
+	int c;
 	struct sockaddr_un cli_addr;
-	struct dl_list ctrliface_dst_list;
+	static struct afc_ctrl_iface ctrl_iface;
 
 	for (;;) {
-		c = getopt(argc, argv, "d:");
+		c = getopt(argc, argv, "d:b:");
 		if (c < 0)
 			break;
 		switch (c) {
+		case 'b':
+			if (afc_driver_select(optarg)) {
+				fprintf(stderr, "available backends: ");
+				afc_driver_list(stderr);
+				return AFC_STATUS_FAILURE;
+			}
+			break;
 		case 'd':
 			afc_debug_level = atoi(optarg);
 		default:
@@ -197,29 +264,43 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (afc_nl80211_init()) {
-		afc_printf(MSG_ERROR, "netlink init failed");
+	if (afc_driver_init()) {
+		afc_printf(MSG_ERROR, "driver init failed");
 		return AFC_STATUS_FAILURE;
 	}
 
+	if (afc_grant_init())
+		afc_printf(MSG_ERROR, "grant table init failed");
+
 	if (eloop_init() != 0) {
 		afc_printf(MSG_ERROR, "failed to initialize eloop");
 		return AFC_STATUS_FAILURE;
 	}
+	eloop_set_stall_handler(AFC_ELOOP_STALL_MS, afc_eloop_stall, NULL);
+
+	if (afc_driver_start()) {
+		afc_printf(MSG_ERROR, "driver start failed");
+		return AFC_STATUS_FAILURE;
+	}
 
-	dl_list_init(&ctrliface_dst_list);
+	afc_ctrl_clients_init(&ctrl_iface);
 
-	if (afc_cli_ctrl_iface_init(&cli_sock, &cli_addr, &ctrliface_dst_list)) {
+	if (afc_cli_ctrl_iface_init(&ctrl_iface.sock, &cli_addr, &ctrl_iface)) {
 		afc_printf(MSG_ERROR, "AFC ctrl interface init failed");
-		afc_cli_ctrl_iface_deinit(&cli_sock, &cli_addr);
+		afc_cli_ctrl_iface_deinit(&ctrl_iface.sock, &cli_addr);
 	}
+	afc_query_set_observer(afc_ctrl_query_event, &ctrl_iface);
 
 	afc_query_server();
 	eloop_run();
 
-	afc_ctrl_iface_free(&ctrliface_dst_list);
-	afc_cli_ctrl_iface_deinit(&cli_sock, &cli_addr);
-	afc_nl80211_cleanup();
+	afc_query_deinit();
+	afc_query_set_observer(NULL, NULL);
+	afc_ctrl_clients_deinit(&ctrl_iface);
+	afc_cli_ctrl_iface_deinit(&ctrl_iface.sock, &cli_addr);
+	afc_reg_rule_deinit();
+	afc_grant_deinit();
+	afc_driver_deinit();
 	eloop_destroy();
 
 	return AFC_STATUS_SUCCESS;
@@ -10,16 +10,34 @@ this software module.
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include "utils.h"
 #include "afc.h"
 
 /* helper fuctions */
+
+/* Relative time for timers, immune to wall clock steps (NTP at boot).
+CLOCK_BOOTTIME also counts suspend, CLOCK_MONOTONIC covers older kernels. */
+clockid_t get_reltime_clock(void)
+{
+	static clockid_t clock_id = (clockid_t)-1;
+	struct timespec ts;
+
+	if (clock_id == (clockid_t)-1) {
+		clock_id = CLOCK_BOOTTIME;
+		if (clock_gettime(clock_id, &ts) && errno == EINVAL)
+			clock_id = CLOCK_MONOTONIC;
+	}
+
+	return clock_id;
+}
+
 int get_reltime(struct reltime *t)
 {
 	int ret;
 	struct timespec ts;
 
-	ret = clock_gettime(CLOCK_REALTIME, &ts);
+	ret = clock_gettime(get_reltime_clock(), &ts);
 	if (!ret) {
 		t->sec = ts.tv_sec;
 		t->usec = ts.tv_nsec / 1000;
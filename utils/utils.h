@@ -14,6 +14,7 @@ struct reltime {
 	time_t usec;
 };
 
+clockid_t get_reltime_clock(void);
 int get_reltime(struct reltime *t);
 int reltime_before(struct reltime *a, struct reltime *b);
 void reltime_sub(struct reltime *a, struct reltime *b, struct reltime *res);